@@ -0,0 +1,46 @@
+root="./"
+package.path = package.path .. ";" .. root .. "?.lua"
+package.cpath = package.cpath .. ";" .. root .. "?.so"
+
+local profile = require "profile"
+local c = require "luaprofilec"
+
+local function busy_a()
+    local s = 0
+    for i = 1, 200000 do
+        s = s + i % 7
+    end
+    return s
+end
+
+local function busy_b()
+    local t = {}
+    for i = 1, 20000 do
+        t[#t + 1] = tostring(i)
+    end
+    return #t
+end
+
+-- 模拟一个一直在跑的服务：前半段主要是 busy_a，后半段切换到 busy_b
+local function serve(seconds, work)
+    local deadline = c.getnanosec() + seconds * 1000000000
+    while c.getnanosec() < deadline do
+        work()
+    end
+end
+
+local function test()
+    -- 每秒一个窗口，内存里保留最近 10 个，不需要 stop/start
+    profile.start({ cpu = "sample", mem = "off", cpu_sample_hz = 250, window_sec = 1, window_count = 10 })
+    serve(3, busy_a)
+    serve(3, busy_b)
+
+    -- 事后只取最近 2 秒：应当几乎只有 busy_b
+    assert(profile.dump_windows("continuous-last2s.pb.gz", 2, "pprof"))
+    assert(profile.dump_windows("continuous-last2s.folded", 2, "folded"))
+    -- 全部窗口：busy_a 与 busy_b 各占一半左右
+    assert(profile.dump_windows("continuous-all.folded", 0, "folded"))
+    profile.stop()
+end
+
+test()
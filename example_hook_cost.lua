@@ -0,0 +1,83 @@
+root="./"
+package.path = package.path .. ";" .. root .. "?.lua"
+package.cpath = package.cpath .. ";" .. root .. "?.so"
+
+local profile = require "profile"
+local c = require "luaprofilec"
+
+local CALLS = 10000000
+local SWITCHES = 1000000
+local DEEP = 200
+local DEEP_YIELDS = 200000
+
+local function empty()
+end
+
+-- 纯函数调用：每次调用触发一次 call + return hook
+local function bench_call()
+    for i = 1, CALLS do
+        empty()
+    end
+end
+
+-- 协程来回切换：每次 resume/yield 都会换 L，走 call_state 查找
+local function bench_switch()
+    local cos = {}
+    for i = 1, 8 do
+        cos[i] = coroutine.create(function()
+            while true do
+                coroutine.yield()
+            end
+        end)
+    end
+    for i = 1, SWITCHES do
+        coroutine.resume(cos[i % 8 + 1])
+    end
+end
+
+-- 200 层深的栈反复 yield：resume 的开销不应随栈深增长
+local function deep(n)
+    if n > 0 then
+        return deep(n - 1) + 0
+    end
+    while true do
+        coroutine.yield()
+    end
+end
+
+local function bench_deep_yield()
+    local co = coroutine.create(deep)
+    coroutine.resume(co, DEEP)
+    for i = 1, DEEP_YIELDS do
+        coroutine.resume(co)
+    end
+end
+
+local function measure(f)
+    local t1 = c.getnanosec()
+    f()
+    local t2 = c.getnanosec()
+    return t2 - t1
+end
+
+local function run(opts)
+    local base_call = measure(bench_call)
+    local base_switch = measure(bench_switch)
+    local base_deep = measure(bench_deep_yield)
+    profile.start(opts)
+    local prof_call = measure(bench_call)
+    local prof_switch = measure(bench_switch)
+    local prof_deep = measure(bench_deep_yield)
+    profile.stop()
+    print(string.format("cpu=%s mem=%s tsc=%s", opts.cpu, opts.mem, tostring(opts.tsc or false)))
+    print(string.format("  call:   %.1f ns/call hook overhead (base %.1f, profiled %.1f)",
+        (prof_call - base_call) / CALLS, base_call / CALLS, prof_call / CALLS))
+    print(string.format("  switch: %.1f ns/switch hook overhead (base %.1f, profiled %.1f)",
+        (prof_switch - base_switch) / SWITCHES, base_switch / SWITCHES, prof_switch / SWITCHES))
+    print(string.format("  deep:   %.1f ns/resume hook overhead at depth %d (base %.1f, profiled %.1f)",
+        (prof_deep - base_deep) / DEEP_YIELDS, DEEP, base_deep / DEEP_YIELDS, prof_deep / DEEP_YIELDS))
+end
+
+run({ cpu = "profile", mem = "off" })
+run({ cpu = "profile", mem = "off", tsc = true })
+run({ cpu = "profile", mem = "profile" })
@@ -0,0 +1,62 @@
+root="./"
+package.path = package.path .. ";" .. root .. "?.lua"
+package.cpath = package.cpath .. ";" .. root .. "?.so"
+
+local profile = require "profile"
+
+-- 固定周期的帧循环：每帧 update 约 3.8ms、hotspot 约 0.2ms，正好是 250hz 的一个周期。
+-- 固定周期抽样会与帧同相，hotspot 要么几乎采不到，要么被放大很多倍；Poisson 抽样应接近真实占比。
+-- lua example_periodic.lua poisson|fixed
+local TICK_MS = 4
+local HOT_MS = 0.2
+local TICKS = 2500
+
+local function spin(ms)
+    local t = os.clock() + ms / 1000
+    local n = 0
+    while os.clock() < t do
+        n = n + 1
+    end
+    return n
+end
+
+local function update()
+    return spin(TICK_MS - HOT_MS)
+end
+
+local function hotspot()
+    return spin(HOT_MS)
+end
+
+local function run()
+    local mode = arg and arg[1] or "poisson"
+    profile.start({ cpu = "sample", mem = "off", cpu_sample_hz = 1000 // TICK_MS, cpu_sample_poisson = (mode ~= "fixed") })
+    local hot_time = 0
+    local t0 = os.clock()
+    for _ = 1, TICKS do
+        update()
+        local t = os.clock()
+        hotspot()
+        hot_time = hot_time + os.clock() - t
+    end
+    local total_time = os.clock() - t0
+    local result = profile.stop()
+
+    -- folded 输出：每行 "frame;frame;... count"
+    local all, hot = 0, 0
+    for line in string.gmatch(result.nodes or "", "[^\n]+") do
+        local stack, count = string.match(line, "^(.*) (%d+)$")
+        if stack then
+            count = tonumber(count)
+            all = all + count
+            if string.find(stack, "hotspot", 1, true) then
+                hot = hot + count
+            end
+        end
+    end
+    print(string.format("mode = %s, samples = %d", mode, all))
+    print(string.format("hotspot: measured %.1f%%, sampled %.1f%%",
+        100 * hot_time / total_time, all > 0 and 100 * hot / all or 0))
+end
+
+run()
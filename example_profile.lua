@@ -109,6 +109,10 @@ local function test_with_profile()
     local t1 = c.getnanosec()
     do_test()
     local t2 = c.getnanosec()
+    -- 大结果可以直接从 C 流式落盘，不经过 json.lua
+    assert(profile.dump_to_file(root .. "profile_result.json", "json"))
+    assert(profile.dump_to_file(root .. "profile_result.folded", "folded"))
+    assert(profile.dump_to_file(root .. "profile_result.pb.gz", "pprof"))
     local result = profile.stop()
     local strResult = json.encode(result)
     print(strResult)
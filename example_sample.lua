@@ -41,6 +41,44 @@ local function test_vccl()
     return acc
 end
 
+-- 混合栈：__index 函数和 for ... in 的 Lua 迭代器都由 luaD_call 重新进入 luaV_execute，
+-- 它们的帧不能并到外层 luaV_execute 上
+local lazy = setmetatable({}, { __index = function(t, k)
+    local s = 0
+    for i = 1, 20 do
+        s = s + i * k
+    end
+    return s
+end })
+
+local function test_index()
+    local acc = 0
+    for i = 1, 200000 do
+        acc = acc + lazy[i]
+    end
+    return acc
+end
+
+local function range(n)
+    return function(_, i)
+        i = i + 1
+        if i > n then return nil end
+        local s = 0
+        for j = 1, 20 do
+            s = s + j
+        end
+        return i
+    end, nil, 0
+end
+
+local function test_iter()
+    local acc = 0
+    for i in range(200000) do
+        acc = acc + i
+    end
+    return acc
+end
+
 local function test_storage1()
     for i = 1, 100 do
         table.insert(g_storage, i)
@@ -70,7 +108,12 @@ local function write_file(path, content)
 end
 
 local function test1()
-    local opts = { cpu = "sample", mem = "sample", cpu_sample_hz = 250 }
+    -- lua example_sample.lua count_sample：用 LUA_MASKCOUNT 抽样，原版 lua 也可用
+    -- lua example_sample.lua sample mixed：C 帧与 Lua 帧拼成一条混合栈
+    local cpu_mode = arg and arg[1] or "sample"
+    local mixed = arg and arg[2] == "mixed"
+    local opts = { cpu = cpu_mode, mem = "sample", cpu_sample_hz = 250, cpu_sample_instr = 10000, mem_sample_bytes = 64 * 1024,
+        cpu_sample_mixed = mixed }
     profile.start(opts)
     test_storage1()
     test_storage2()
@@ -83,11 +126,17 @@ local function test1()
     test2()
     test22()
     test_vccl()
+    test_index()
+    test_iter()
+    profile.dump_to_file("cpu-lines.txt", "lines")
     local result = profile.stop()
     print("time:",result.time)
     print("nodes:")
     print(result.nodes)
     write_file("cpu-samples.txt", result.nodes)
+    if result.mem_nodes then
+        write_file("mem-samples.json", json.encode(result.mem_nodes))
+    end
 end
 
 local function test()
@@ -0,0 +1,165 @@
+#include "fwriter.h"
+#include "profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+
+#define FWRITER_BUF_SIZE    (64 * 1024)
+
+struct fwriter {
+    int fd;
+    int err;            // 第一个写入错误的 errno，0 表示无错误
+    size_t pos;
+    uint64_t total;
+    char buf[FWRITER_BUF_SIZE];
+};
+
+struct fwriter*
+fwriter_open(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct fwriter* w = (struct fwriter*)pmalloc(sizeof(*w));
+    if (!w) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->fd = fd;
+    w->err = 0;
+    w->pos = 0;
+    w->total = 0;
+    return w;
+}
+
+static void
+_flush(struct fwriter* w) {
+    size_t off = 0;
+    while (off < w->pos && !w->err) {
+        ssize_t n = write(w->fd, w->buf + off, w->pos - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            w->err = errno;
+            break;
+        }
+        off += (size_t)n;
+    }
+    w->pos = 0;
+}
+
+int
+fwriter_close(struct fwriter* w) {
+    _flush(w);
+    if (close(w->fd) != 0 && !w->err) {
+        w->err = errno;
+    }
+    int err = w->err;
+    pfree(w);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void
+fwriter_write(struct fwriter* w, const void* data, size_t len) {
+    if (w->err) return;
+    w->total += len;
+    const char* p = (const char*)data;
+    while (len > 0) {
+        size_t room = FWRITER_BUF_SIZE - w->pos;
+        size_t n = len < room ? len : room;
+        memcpy(w->buf + w->pos, p, n);
+        w->pos += n;
+        p += n;
+        len -= n;
+        if (w->pos == FWRITER_BUF_SIZE) {
+            _flush(w);
+        }
+    }
+}
+
+void
+fwriter_puts(struct fwriter* w, const char* s) {
+    fwriter_write(w, s, strlen(s));
+}
+
+void
+fwriter_putc(struct fwriter* w, char c) {
+    if (w->pos == FWRITER_BUF_SIZE) {
+        _flush(w);
+    }
+    if (w->err) return;
+    w->buf[w->pos++] = c;
+    w->total++;
+}
+
+void
+fwriter_printf(struct fwriter* w, const char* fmt, ...) {
+    char tmp[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(tmp)) {
+        fwriter_write(w, tmp, (size_t)n);
+        return;
+    }
+    // 超长时退化为堆上的临时缓冲
+    char* big = (char*)pmalloc((size_t)n + 1);
+    if (!big) return;
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    fwriter_write(w, big, (size_t)n);
+    pfree(big);
+}
+
+void
+fwriter_u64(struct fwriter* w, uint64_t v) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[sizeof(tmp) - 1 - n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    fwriter_write(w, tmp + sizeof(tmp) - n, (size_t)n);
+}
+
+void
+fwriter_json_string(struct fwriter* w, const char* s) {
+    static const char hex[] = "0123456789abcdef";
+    fwriter_putc(w, '"');
+    if (s) {
+        const char* run = s;    // 尚未写出的无需转义的片段起点
+        for (; *s; ++s) {
+            unsigned char c = (unsigned char)*s;
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            fwriter_write(w, run, (size_t)(s - run));
+            run = s + 1;
+            switch (c) {
+            case '"':  fwriter_write(w, "\\\"", 2); break;
+            case '\\': fwriter_write(w, "\\\\", 2); break;
+            case '\n': fwriter_write(w, "\\n", 2); break;
+            case '\r': fwriter_write(w, "\\r", 2); break;
+            case '\t': fwriter_write(w, "\\t", 2); break;
+            default: {
+                char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                fwriter_write(w, esc, sizeof(esc));
+                break;
+            }
+            }
+        }
+        fwriter_write(w, run, (size_t)(s - run));
+    }
+    fwriter_putc(w, '"');
+}
+
+uint64_t
+fwriter_bytes(struct fwriter* w) {
+    return w->total;
+}
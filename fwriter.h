@@ -0,0 +1,30 @@
+#ifndef _FWRITER_H_
+#define _FWRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+带缓冲的文件写入器：直接对 fd 做 write(2)，缓冲区满了才落盘。
+只用 malloc 管理自身的缓冲区，不碰 lua 堆，dump 期间不会触发 gc 或 alloc hook。
+写入错误是粘性的：出错后后续写入都被忽略，由 fwriter_close 统一返回。
+*/
+
+struct fwriter;
+
+// 失败返回 NULL，errno 保留 open(2) 的错误码
+struct fwriter* fwriter_open(const char* path);
+// 落盘并关闭，返回 0 表示全部写入成功，否则返回 -1 且 errno 为第一个错误
+int fwriter_close(struct fwriter* w);
+
+void fwriter_write(struct fwriter* w, const void* data, size_t len);
+void fwriter_puts(struct fwriter* w, const char* s);
+void fwriter_putc(struct fwriter* w, char c);
+void fwriter_printf(struct fwriter* w, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void fwriter_u64(struct fwriter* w, uint64_t v);
+// 写出带引号、按 JSON 规则转义的字符串，NULL 写成空串
+void fwriter_json_string(struct fwriter* w, const char* s);
+
+uint64_t fwriter_bytes(struct fwriter* w);
+
+#endif
@@ -1,54 +1,161 @@
 #include "profile.h"
 #include "icallpath.h"
-#include "imap.h"
+#include "pmap.h"
+
+/*
+紧凑的 callpath 树：
+1、节点连同 value 一起按创建顺序放在大块连续内存（chunk）里，不再每个节点单独 malloc；
+2、子节点不超过 ICALLPATH_INLINE_CHILDREN 个时直接内联存放指针，超过后才升级为 pmap；
+3、每个节点缓存最近一次命中的子节点（last_child），循环里反复调用同一函数时无需查找。
+chunk 一经分配不再移动，所以节点指针在整棵树的生命周期内都有效。
+*/
+
+#define ICALLPATH_INLINE_CHILDREN   4
+#define ICALLPATH_NODES_PER_CHUNK   1024
+
+struct icallpath_chunk {
+    struct icallpath_chunk* next;
+    size_t used;
+    char nodes[0];
+};
+
+struct icallpath_tree {
+    size_t value_size;
+    size_t node_stride;
+    size_t node_count;
+    struct icallpath_chunk* chunks;     // 最新的 chunk 在链表头
+    struct icallpath_context* wide;     // 已升级为 pmap 的节点链表，释放时用
+};
 
 struct icallpath_context {
     uint64_t key;
-    void* value;
-    struct imap_context* children;
+    struct icallpath_tree* tree;
+    struct icallpath_context* last_child;
+    size_t children_count;
+    union {
+        struct icallpath_context* inline_nodes[ICALLPATH_INLINE_CHILDREN];
+        struct {
+            struct pmap_context* map;
+            struct icallpath_context* next_wide;
+        } wide;
+    } children;
 };
 
-struct icallpath_context* icallpath_create(uint64_t key, void* value) {
-    struct icallpath_context* icallpath = (struct icallpath_context*)pmalloc(sizeof(*icallpath));
-    icallpath->key = key;
-    icallpath->value = value;
-    icallpath->children = imap_create();
+#define ICALLPATH_VALUE(node)   ((void*)((char*)(node) + sizeof(struct icallpath_context)))
 
-    return icallpath;
+static struct icallpath_context* _icallpath_new_node(struct icallpath_tree* tree, uint64_t key) {
+    struct icallpath_chunk* chunk = tree->chunks;
+    if (!chunk || chunk->used >= ICALLPATH_NODES_PER_CHUNK) {
+        chunk = (struct icallpath_chunk*)pmalloc(sizeof(*chunk) + tree->node_stride * ICALLPATH_NODES_PER_CHUNK);
+        chunk->used = 0;
+        chunk->next = tree->chunks;
+        tree->chunks = chunk;
+    }
+    struct icallpath_context* node = (struct icallpath_context*)(chunk->nodes + tree->node_stride * chunk->used);
+    chunk->used++;
+    tree->node_count++;
+    memset(node, 0, tree->node_stride);
+    node->key = key;
+    node->tree = tree;
+    return node;
 }
 
-void icallpath_free_child(uint64_t key, void* value, void* ud) {
-    icallpath_free((struct icallpath_context*)value);
+struct icallpath_context* icallpath_create(uint64_t key, size_t value_size) {
+    struct icallpath_tree* tree = (struct icallpath_tree*)pmalloc(sizeof(*tree));
+    tree->value_size = value_size;
+    tree->node_stride = sizeof(struct icallpath_context) + ((value_size + 7) & ~(size_t)7);
+    tree->node_count = 0;
+    tree->chunks = NULL;
+    tree->wide = NULL;
+    return _icallpath_new_node(tree, key);
 }
+
 void icallpath_free(struct icallpath_context* icallpath) {
-    if (icallpath->value) {
-        pfree(icallpath->value);
-        icallpath->value = NULL;
+    struct icallpath_tree* tree = icallpath->tree;
+    struct icallpath_context* wide = tree->wide;
+    while (wide) {
+        struct icallpath_context* next = wide->children.wide.next_wide;
+        pmap_free(wide->children.wide.map);
+        wide = next;
     }
-    imap_dump(icallpath->children, icallpath_free_child, NULL);
-    imap_free(icallpath->children);
-    pfree(icallpath);
+    struct icallpath_chunk* chunk = tree->chunks;
+    while (chunk) {
+        struct icallpath_chunk* next = chunk->next;
+        pfree(chunk);
+        chunk = next;
+    }
+    pfree(tree);
 }
 
 struct icallpath_context* icallpath_get_child(struct icallpath_context* icallpath, uint64_t key) {
-    void* child_path = imap_query(icallpath->children, key);
-    return (struct icallpath_context*)child_path;
+    struct icallpath_context* child = icallpath->last_child;
+    if (child && child->key == key) {
+        return child;
+    }
+    child = NULL;
+    if (icallpath->children_count <= ICALLPATH_INLINE_CHILDREN) {
+        size_t i;
+        for (i = 0; i < icallpath->children_count; i++) {
+            if (icallpath->children.inline_nodes[i]->key == key) {
+                child = icallpath->children.inline_nodes[i];
+                break;
+            }
+        }
+    } else {
+        child = (struct icallpath_context*)pmap_query(icallpath->children.wide.map, key);
+    }
+    if (child) {
+        icallpath->last_child = child;
+    }
+    return child;
 }
 
-struct icallpath_context* icallpath_add_child(struct icallpath_context* icallpath, uint64_t key, void* value) {
-    struct icallpath_context* child_path = icallpath_create(key, value);
-    imap_set(icallpath->children, key, child_path);
-    return child_path;
+struct icallpath_context* icallpath_add_child(struct icallpath_context* icallpath, uint64_t key) {
+    struct icallpath_tree* tree = icallpath->tree;
+    struct icallpath_context* child = _icallpath_new_node(tree, key);
+    size_t n = icallpath->children_count;
+    if (n < ICALLPATH_INLINE_CHILDREN) {
+        icallpath->children.inline_nodes[n] = child;
+    } else {
+        if (n == ICALLPATH_INLINE_CHILDREN) {
+            // 内联槽位已满，升级为 pmap
+            struct pmap_context* map = pmap_create();
+            size_t i;
+            for (i = 0; i < n; i++) {
+                struct icallpath_context* c = icallpath->children.inline_nodes[i];
+                pmap_insert(map, c->key, c);
+            }
+            icallpath->children.wide.map = map;
+            icallpath->children.wide.next_wide = tree->wide;
+            tree->wide = icallpath;
+        }
+        pmap_insert(icallpath->children.wide.map, key, child);
+    }
+    icallpath->children_count = n + 1;
+    icallpath->last_child = child;
+    return child;
 }
 
 void* icallpath_getvalue(struct icallpath_context* icallpath) {
-    return icallpath->value;
+    return ICALLPATH_VALUE(icallpath);
 }
 
 void icallpath_dump_children(struct icallpath_context* icallpath, observer observer_cb, void* ud) {
-    imap_dump(icallpath->children, observer_cb, ud);
+    if (icallpath->children_count <= ICALLPATH_INLINE_CHILDREN) {
+        size_t i;
+        for (i = 0; i < icallpath->children_count; i++) {
+            struct icallpath_context* c = icallpath->children.inline_nodes[i];
+            observer_cb(c->key, c, ud);
+        }
+    } else {
+        pmap_dump(icallpath->children.wide.map, observer_cb, ud);
+    }
 }
 
 size_t icallpath_children_size(struct icallpath_context* icallpath) {
-    return imap_size(icallpath->children);
+    return icallpath->children_count;
+}
+
+size_t icallpath_node_count(struct icallpath_context* icallpath) {
+    return icallpath->tree->node_count;
 }
\ No newline at end of file
@@ -6,16 +6,19 @@
 
 struct icallpath_context;
 
-struct icallpath_context* icallpath_create(uint64_t key, void* value);
+// 创建树的根节点；每个节点自带 value_size 字节、清零的 value 存储
+struct icallpath_context* icallpath_create(uint64_t key, size_t value_size);
+// 只能对根节点调用，释放整棵树
 void icallpath_free(struct icallpath_context* icallpath);
 
 struct icallpath_context* icallpath_get_child(struct icallpath_context* icallpath, uint64_t key);
-struct icallpath_context* icallpath_add_child(struct icallpath_context* icallpath, uint64_t key, void* value);
+struct icallpath_context* icallpath_add_child(struct icallpath_context* icallpath, uint64_t key);
 void* icallpath_getvalue(struct icallpath_context* icallpath);
 
 typedef void(*observer)(uint64_t key, void* value, void* ud);
 void icallpath_dump_children(struct icallpath_context* icallpath, observer observer_cb, void* ud);
 size_t icallpath_children_size(struct icallpath_context* icallpath);
+size_t icallpath_node_count(struct icallpath_context* icallpath);
 
 
 #endif
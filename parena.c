@@ -0,0 +1,126 @@
+#include "parena.h"
+#include "profile.h"
+
+#define PARENA_ALIGN            16
+#define PARENA_CHUNK_SIZE       (64 * 1024)
+#define PARENA_SIZE_CLASSES     (PARENA_SMALL_MAX / PARENA_ALIGN)
+
+struct parena_chunk {
+    struct parena_chunk* next;
+    size_t size;
+    size_t used;
+    char _pad[PARENA_ALIGN - sizeof(size_t)];
+    char data[0];
+};
+
+struct parena_free_node {
+    struct parena_free_node* next;
+};
+
+struct parena {
+    struct parena_chunk* chunks;    // 当前 bump 的 chunk 在链表头
+    struct parena_free_node* free_lists[PARENA_SIZE_CLASSES];
+    size_t bytes;                   // 向系统申请的总字节数
+};
+
+static inline size_t
+_parena_round(size_t sz) {
+    if (sz == 0) sz = 1;
+    return (sz + PARENA_ALIGN - 1) & ~(size_t)(PARENA_ALIGN - 1);
+}
+
+static struct parena_chunk *
+_parena_new_chunk(struct parena* arena, size_t size) {
+    struct parena_chunk* chunk = (struct parena_chunk*)pmalloc(sizeof(*chunk) + size);
+    chunk->size = size;
+    chunk->used = 0;
+    arena->bytes += sizeof(*chunk) + size;
+    return chunk;
+}
+
+struct parena *
+parena_create() {
+    struct parena* arena = (struct parena*)pmalloc(sizeof(*arena));
+    memset(arena, 0, sizeof(*arena));
+    return arena;
+}
+
+void
+parena_free(struct parena* arena) {
+    struct parena_chunk* chunk = arena->chunks;
+    while (chunk) {
+        struct parena_chunk* next = chunk->next;
+        pfree(chunk);
+        chunk = next;
+    }
+    pfree(arena);
+}
+
+void *
+parena_alloc(struct parena* arena, size_t sz) {
+    sz = _parena_round(sz);
+    if (sz <= PARENA_SMALL_MAX) {
+        struct parena_free_node** head = &arena->free_lists[sz / PARENA_ALIGN - 1];
+        if (*head) {
+            struct parena_free_node* n = *head;
+            *head = n->next;
+            return n;
+        }
+    }
+
+    // 大对象单独占一个 chunk，挂在链表第二位，不打断当前 bump 的 chunk
+    if (sz > PARENA_CHUNK_SIZE / 4) {
+        struct parena_chunk* big = _parena_new_chunk(arena, sz);
+        big->used = sz;
+        if (arena->chunks) {
+            big->next = arena->chunks->next;
+            arena->chunks->next = big;
+        } else {
+            big->next = NULL;
+            arena->chunks = big;
+        }
+        return big->data;
+    }
+
+    struct parena_chunk* chunk = arena->chunks;
+    if (!chunk || chunk->used + sz > chunk->size) {
+        chunk = _parena_new_chunk(arena, PARENA_CHUNK_SIZE);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void* p = chunk->data + chunk->used;
+    chunk->used += sz;
+    return p;
+}
+
+void *
+parena_calloc(struct parena* arena, size_t sz) {
+    void* p = parena_alloc(arena, sz);
+    memset(p, 0, sz);
+    return p;
+}
+
+void
+parena_release(struct parena* arena, void* p, size_t sz) {
+    if (!p) return;
+    sz = _parena_round(sz);
+    if (sz > PARENA_SMALL_MAX) return;
+    struct parena_free_node* n = (struct parena_free_node*)p;
+    n->next = arena->free_lists[sz / PARENA_ALIGN - 1];
+    arena->free_lists[sz / PARENA_ALIGN - 1] = n;
+}
+
+char *
+parena_strdup(struct parena* arena, const char* s) {
+    if (!s) return NULL;
+    size_t n = strlen(s);
+    char* d = (char*)parena_alloc(arena, n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+size_t
+parena_bytes(struct parena* arena) {
+    return arena->bytes;
+}
@@ -0,0 +1,30 @@
+#ifndef _PARENA_H_
+#define _PARENA_H_
+
+#include <unistd.h>
+#include <stdint.h>
+
+/*
+profile context 私有的内存池：
+- 小对象按 16 字节粒度分级（<= PARENA_SMALL_MAX），释放后挂到对应等级的 free list 复用；
+- 其余对象从 chunk 中 bump 分配，单独释放是空操作；
+- parena_free 一次性归还所有 chunk，耗时只与 chunk 数有关，与对象个数无关。
+非线程安全，只在所属 lua vm 的线程里使用。
+*/
+
+#define PARENA_SMALL_MAX    256
+
+struct parena;
+
+struct parena* parena_create();
+void parena_free(struct parena* arena);
+
+void* parena_alloc(struct parena* arena, size_t sz);
+void* parena_calloc(struct parena* arena, size_t sz);
+// sz 必须与分配时一致
+void parena_release(struct parena* arena, void* p, size_t sz);
+char* parena_strdup(struct parena* arena, const char* s);
+
+size_t parena_bytes(struct parena* arena);
+
+#endif
@@ -0,0 +1,195 @@
+#include "pgzip.h"
+#include "fwriter.h"
+#include "profile.h"
+
+#include <pthread.h>
+
+#define WINDOW_SIZE     32768
+#define WINDOW_MASK     (WINDOW_SIZE - 1)
+#define HASH_BITS       15
+#define HASH_SIZE       (1 << HASH_BITS)
+#define MIN_MATCH       3
+#define MAX_MATCH       258
+#define MAX_CHAIN       64
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+struct bitwriter {
+    struct fwriter* w;
+    uint64_t bits;
+    int nbits;
+};
+
+// deflate 的位流从低位开始填充
+static inline void
+_put_bits(struct bitwriter* bw, uint32_t v, int n) {
+    bw->bits |= (uint64_t)v << bw->nbits;
+    bw->nbits += n;
+    while (bw->nbits >= 8) {
+        fwriter_putc(bw->w, (char)(bw->bits & 0xff));
+        bw->bits >>= 8;
+        bw->nbits -= 8;
+    }
+}
+
+// huffman 码按高位在前写出，所以先把码字按位反转
+static inline void
+_put_code(struct bitwriter* bw, uint32_t code, int n) {
+    uint32_t rev = 0;
+    for (int i = 0; i < n; ++i) {
+        rev = (rev << 1) | ((code >> i) & 1);
+    }
+    _put_bits(bw, rev, n);
+}
+
+static void
+_put_litlen(struct bitwriter* bw, int sym) {
+    if (sym < 144) {
+        _put_code(bw, 0x30 + sym, 8);
+    } else if (sym < 256) {
+        _put_code(bw, 0x190 + (sym - 144), 9);
+    } else if (sym < 280) {
+        _put_code(bw, sym - 256, 7);
+    } else {
+        _put_code(bw, 0xc0 + (sym - 280), 8);
+    }
+}
+
+static void
+_put_match(struct bitwriter* bw, int len, int dist) {
+    int lc = 28;
+    while (len_base[lc] > len) lc--;
+    _put_litlen(bw, 257 + lc);
+    if (len_extra[lc]) _put_bits(bw, (uint32_t)(len - len_base[lc]), len_extra[lc]);
+
+    int dc = 29;
+    while (dist_base[dc] > dist) dc--;
+    _put_code(bw, (uint32_t)dc, 5);
+    if (dist_extra[dc]) _put_bits(bw, (uint32_t)(dist - dist_base[dc]), dist_extra[dc]);
+}
+
+static inline uint32_t
+_hash3(const uint8_t* p) {
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void
+_deflate_fixed(struct bitwriter* bw, const uint8_t* in, size_t len) {
+    _put_bits(bw, 1, 1);    // BFINAL
+    _put_bits(bw, 1, 2);    // BTYPE = 01 固定 huffman
+
+    int32_t* head = (int32_t*)pmalloc(sizeof(int32_t) * HASH_SIZE);
+    int32_t* prev = (int32_t*)pmalloc(sizeof(int32_t) * WINDOW_SIZE);
+    for (int i = 0; i < HASH_SIZE; ++i) head[i] = -1;
+
+    size_t i = 0;
+    while (i < len) {
+        int best_len = 0;
+        size_t best_dist = 0;
+        if (i + MIN_MATCH <= len) {
+            uint32_t h = _hash3(in + i);
+            int32_t cand = head[h];
+            size_t max_len = len - i < MAX_MATCH ? len - i : MAX_MATCH;
+            for (int chain = 0; cand >= 0 && chain < MAX_CHAIN; ++chain) {
+                size_t dist = i - (size_t)cand;
+                if (dist > WINDOW_SIZE) break;
+                const uint8_t* a = in + cand;
+                const uint8_t* b = in + i;
+                if (a[best_len] == b[best_len]) {
+                    size_t l = 0;
+                    while (l < max_len && a[l] == b[l]) l++;
+                    if ((int)l > best_len) {
+                        best_len = (int)l;
+                        best_dist = dist;
+                        if (l == max_len) break;
+                    }
+                }
+                int32_t next = prev[cand & WINDOW_MASK];
+                if (next >= cand) break;    // 槽位已被更新的位置覆盖
+                cand = next;
+            }
+            prev[i & WINDOW_MASK] = head[h];
+            head[h] = (int32_t)i;
+        }
+        if (best_len >= MIN_MATCH) {
+            _put_match(bw, best_len, (int)best_dist);
+            // 匹配区间内的位置也插入哈希链，后续才能匹配到它们
+            size_t end = i + (size_t)best_len;
+            for (++i; i < end; ++i) {
+                if (i + MIN_MATCH <= len) {
+                    uint32_t h = _hash3(in + i);
+                    prev[i & WINDOW_MASK] = head[h];
+                    head[h] = (int32_t)i;
+                }
+            }
+        } else {
+            _put_litlen(bw, in[i]);
+            i++;
+        }
+    }
+    _put_litlen(bw, 256);   // end of block
+    if (bw->nbits > 0) {
+        _put_bits(bw, 0, 8 - bw->nbits);
+    }
+    pfree(head);
+    pfree(prev);
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void
+_crc_table_init() {
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+// dump helper 线程与 vm 线程都可能调用
+uint32_t
+pgzip_crc32(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&crc_table_once, _crc_table_init);
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void
+_put_le32(struct fwriter* w, uint32_t v) {
+    char b[4] = { (char)(v & 0xff), (char)((v >> 8) & 0xff), (char)((v >> 16) & 0xff), (char)((v >> 24) & 0xff) };
+    fwriter_write(w, b, 4);
+}
+
+void
+pgzip_write(struct fwriter* w, const void* data, size_t len) {
+    // magic, CM=deflate, FLG=0, MTIME=0, XFL=0, OS=unix
+    static const char header[10] = { 0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    fwriter_write(w, header, sizeof(header));
+    struct bitwriter bw = { w, 0, 0 };
+    _deflate_fixed(&bw, (const uint8_t*)data, len);
+    _put_le32(w, pgzip_crc32(0, data, len));
+    _put_le32(w, (uint32_t)len);
+}
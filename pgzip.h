@@ -0,0 +1,20 @@
+#ifndef _PGZIP_H_
+#define _PGZIP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fwriter;
+
+/*
+内置的 gzip 压缩（RFC 1951/1952），不依赖 zlib：
+LZ77（32KB 窗口，哈希链匹配）+ 固定 huffman 编码，整段输入作为单个 deflate block 输出。
+压缩率不如 zlib 的动态 huffman，但对 profile.proto 这种重复很多的数据足够用。
+*/
+
+// 把 data 压缩成一个完整的 gzip member 写入 w
+void pgzip_write(struct fwriter* w, const void* data, size_t len);
+
+uint32_t pgzip_crc32(uint32_t crc, const void* data, size_t len);
+
+#endif
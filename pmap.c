@@ -0,0 +1,156 @@
+#include "pmap.h"
+#include "profile.h"
+
+/*
+key 多为指针（Proto*、lua_State*、分配地址），低 4 位几乎恒为 0，
+直接取模会让大部分槽位空置，所以先用 murmur3 的 fmix64 打散再取低位。
+空槽以 value == NULL 标识（value 约定非空），删除时把后续同簇元素前移，不留墓碑。
+*/
+
+struct pmap_slot {
+    uint64_t key;
+    void* value;
+};
+
+struct pmap_context {
+    struct pmap_slot* slots;
+    size_t size;        // power of 2
+    size_t count;
+};
+
+#define DEFAULT_PMAP_SLOT_SIZE  8
+
+static inline uint64_t
+_pmap_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+struct pmap_context *
+pmap_create() {
+    struct pmap_context* pmap = (struct pmap_context*)pmalloc(sizeof(*pmap));
+    pmap->slots = (struct pmap_slot*)pcalloc(DEFAULT_PMAP_SLOT_SIZE, sizeof(struct pmap_slot));
+    pmap->size = DEFAULT_PMAP_SLOT_SIZE;
+    pmap->count = 0;
+    return pmap;
+}
+
+void
+pmap_free(struct pmap_context* pmap) {
+    pfree(pmap->slots);
+    pfree(pmap);
+}
+
+static void
+_pmap_insert_new(struct pmap_slot* slots, size_t mask, uint64_t key, void* value) {
+    size_t i = (size_t)_pmap_hash(key) & mask;
+    while (slots[i].value) {
+        i = (i + 1) & mask;
+    }
+    slots[i].key = key;
+    slots[i].value = value;
+}
+
+static void
+_pmap_rehash(struct pmap_context* pmap, size_t new_sz) {
+    struct pmap_slot* old_slots = pmap->slots;
+    size_t old_size = pmap->size;
+    struct pmap_slot* new_slots = (struct pmap_slot*)pcalloc(new_sz, sizeof(struct pmap_slot));
+    size_t i;
+    for (i = 0; i < old_size; i++) {
+        if (old_slots[i].value) {
+            _pmap_insert_new(new_slots, new_sz - 1, old_slots[i].key, old_slots[i].value);
+        }
+    }
+    pmap->slots = new_slots;
+    pmap->size = new_sz;
+    pfree(old_slots);
+}
+
+static inline struct pmap_slot *
+_pmap_find(struct pmap_context* pmap, uint64_t key) {
+    size_t mask = pmap->size - 1;
+    size_t i = (size_t)_pmap_hash(key) & mask;
+    for (;;) {
+        struct pmap_slot* p = &pmap->slots[i];
+        if (!p->value) {
+            return NULL;
+        }
+        if (p->key == key) {
+            return p;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+void *
+pmap_query(struct pmap_context* pmap, uint64_t key) {
+    struct pmap_slot* p = _pmap_find(pmap, key);
+    return p ? p->value : NULL;
+}
+
+void
+pmap_insert(struct pmap_context* pmap, uint64_t key, void* value) {
+    assert(value);
+    struct pmap_slot* p = _pmap_find(pmap, key);
+    if (p) {
+        p->value = value;
+        return;
+    }
+    // 装载因子上限 3/4
+    if ((pmap->count + 1) * 4 > pmap->size * 3) {
+        _pmap_rehash(pmap, pmap->size * 2);
+    }
+    _pmap_insert_new(pmap->slots, pmap->size - 1, key, value);
+    pmap->count++;
+}
+
+void *
+pmap_remove(struct pmap_context* pmap, uint64_t key) {
+    struct pmap_slot* p = _pmap_find(pmap, key);
+    if (!p) {
+        return NULL;
+    }
+    void* value = p->value;
+    size_t mask = pmap->size - 1;
+    size_t hole = (size_t)(p - pmap->slots);
+    size_t i = hole;
+    // backward shift：把簇内后续元素前移填洞，直到遇到空槽
+    for (;;) {
+        i = (i + 1) & mask;
+        struct pmap_slot* q = &pmap->slots[i];
+        if (!q->value) {
+            break;
+        }
+        size_t home = (size_t)_pmap_hash(q->key) & mask;
+        // 若 home 不在 (hole, i] 区间内，q 可以移动到 hole
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            pmap->slots[hole] = *q;
+            hole = i;
+        }
+    }
+    pmap->slots[hole].key = 0;
+    pmap->slots[hole].value = NULL;
+    pmap->count--;
+    return value;
+}
+
+void
+pmap_dump(struct pmap_context* pmap, pmap_observer observer_cb, void* ud) {
+    size_t i;
+    for (i = 0; i < pmap->size; i++) {
+        struct pmap_slot* v = &pmap->slots[i];
+        if (v->value) {
+            observer_cb(v->key, v->value, ud);
+        }
+    }
+}
+
+size_t
+pmap_size(struct pmap_context* pmap) {
+    return pmap->count;
+}
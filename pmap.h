@@ -0,0 +1,25 @@
+#ifndef _PMAP_H_
+#define _PMAP_H_
+
+#include <unistd.h>
+#include <stdint.h>
+
+// 指针 key 专用的开放寻址哈希表（fmix64 + 线性探测 + backward shift 删除，无墓碑）
+struct pmap_context;
+
+struct pmap_context* pmap_create();
+void pmap_free(struct pmap_context* pmap);
+
+// the value is no-null point
+// 不叫 pmap_set：glibc 的 sunrpc 导出了同名符号，dlopen 时会被它抢先绑定
+void pmap_insert(struct pmap_context* pmap, uint64_t key, void* value);
+
+void* pmap_remove(struct pmap_context* pmap, uint64_t key);
+void* pmap_query(struct pmap_context* pmap, uint64_t key);
+
+typedef void(*pmap_observer)(uint64_t key, void* value, void* ud);
+void pmap_dump(struct pmap_context* pmap, pmap_observer observer_cb, void* ud);
+
+size_t pmap_size(struct pmap_context* pmap);
+
+#endif
@@ -0,0 +1,261 @@
+#include "pprof.h"
+#include "profile.h"
+#include "pmap.h"
+#include "smap.h"
+#include "fwriter.h"
+#include "pgzip.h"
+
+#include <errno.h>
+
+// profile.proto 字段号
+#define PROFILE_SAMPLE_TYPE         1
+#define PROFILE_SAMPLE              2
+#define PROFILE_LOCATION            4
+#define PROFILE_FUNCTION            5
+#define PROFILE_STRING_TABLE        6
+#define PROFILE_TIME_NANOS          9
+#define PROFILE_DURATION_NANOS      10
+#define PROFILE_PERIOD_TYPE         11
+#define PROFILE_PERIOD              12
+#define PROFILE_DEFAULT_SAMPLE_TYPE 14
+
+#define VALUE_TYPE_TYPE             1
+#define VALUE_TYPE_UNIT             2
+#define SAMPLE_LOCATION_ID          1
+#define SAMPLE_VALUE                2
+#define LOCATION_ID                 1
+#define LOCATION_LINE               4
+#define LINE_FUNCTION_ID            1
+#define LINE_LINE                   2
+#define FUNCTION_ID                 1
+#define FUNCTION_NAME               2
+#define FUNCTION_SYSTEM_NAME        3
+#define FUNCTION_FILENAME           4
+#define FUNCTION_START_LINE         5
+
+#define WIRE_VARINT                 0
+#define WIRE_LEN                    2
+
+struct pbuf {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+};
+
+struct pprof_builder {
+    struct pbuf out;            // 已编码的 Profile 字段（sample_type + sample）
+    struct pbuf tables;         // location + function
+    struct pbuf tmp;            // 嵌套消息的临时缓冲
+    struct pbuf tmp2;
+    struct parena* arena;       // 字符串表与其索引
+    smap_t* strings;            // string -> index + 1
+    char** string_list;         // index -> string
+    uint64_t string_count;
+    uint64_t string_cap;
+    struct pmap_context* locations;     // key -> location id
+    uint64_t location_count;
+    struct pmap_context* functions;     // func_key -> function id
+    uint64_t function_count;
+    int ntypes;
+    uint64_t period_type;
+    uint64_t period_unit;
+    int64_t period;
+    int64_t time_nanos;
+    int64_t duration_nanos;
+    uint64_t default_sample_type;
+};
+
+static void
+_pbuf_reserve(struct pbuf* pb, size_t n) {
+    if (pb->len + n <= pb->cap) return;
+    size_t cap = pb->cap ? pb->cap : 4096;
+    while (pb->len + n > cap) cap *= 2;
+    pb->data = (uint8_t*)prealloc(pb->data, cap);
+    pb->cap = cap;
+}
+
+static void
+_pbuf_bytes(struct pbuf* pb, const void* p, size_t n) {
+    _pbuf_reserve(pb, n);
+    memcpy(pb->data + pb->len, p, n);
+    pb->len += n;
+}
+
+static void
+_pbuf_varint(struct pbuf* pb, uint64_t v) {
+    _pbuf_reserve(pb, 10);
+    while (v >= 0x80) {
+        pb->data[pb->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    pb->data[pb->len++] = (uint8_t)v;
+}
+
+static inline void
+_pbuf_tag(struct pbuf* pb, int field, int wire) {
+    _pbuf_varint(pb, ((uint64_t)field << 3) | (uint64_t)wire);
+}
+
+// proto3 默认值不编码
+static void
+_pbuf_field_varint(struct pbuf* pb, int field, uint64_t v) {
+    if (v == 0) return;
+    _pbuf_tag(pb, field, WIRE_VARINT);
+    _pbuf_varint(pb, v);
+}
+
+static void
+_pbuf_field_bytes(struct pbuf* pb, int field, const void* p, size_t n) {
+    _pbuf_tag(pb, field, WIRE_LEN);
+    _pbuf_varint(pb, n);
+    _pbuf_bytes(pb, p, n);
+}
+
+static uint64_t
+_string_index(struct pprof_builder* b, const char* s) {
+    if (!s) s = "";
+    void* v = smap_get(b->strings, s);
+    if (v) return (uint64_t)(uintptr_t)v - 1;
+    if (b->string_count == b->string_cap) {
+        b->string_cap = b->string_cap ? b->string_cap * 2 : 256;
+        b->string_list = (char**)prealloc(b->string_list, sizeof(char*) * b->string_cap);
+    }
+    uint64_t idx = b->string_count++;
+    smap_set(b->strings, s, (void*)(uintptr_t)(idx + 1));
+    b->string_list[idx] = pastrdup(b->arena, s);
+    return idx;
+}
+
+struct pprof_builder*
+pprof_create(const struct pprof_value_type* types, int ntypes) {
+    struct pprof_builder* b = (struct pprof_builder*)pcalloc(1, sizeof(*b));
+    b->arena = parena_create();
+    b->strings = smap_create(1024, b->arena);
+    b->locations = pmap_create();
+    b->functions = pmap_create();
+    b->ntypes = ntypes;
+    _string_index(b, "");   // string_table[0] 必须是空串
+    for (int i = 0; i < ntypes; ++i) {
+        b->tmp.len = 0;
+        _pbuf_field_varint(&b->tmp, VALUE_TYPE_TYPE, _string_index(b, types[i].type));
+        _pbuf_field_varint(&b->tmp, VALUE_TYPE_UNIT, _string_index(b, types[i].unit));
+        _pbuf_field_bytes(&b->out, PROFILE_SAMPLE_TYPE, b->tmp.data, b->tmp.len);
+    }
+    return b;
+}
+
+void
+pprof_free(struct pprof_builder* b) {
+    pfree(b->string_list);
+    smap_free(b->strings);
+    parena_free(b->arena);
+    pmap_free(b->locations);
+    pmap_free(b->functions);
+    pfree(b->out.data);
+    pfree(b->tables.data);
+    pfree(b->tmp.data);
+    pfree(b->tmp2.data);
+    pfree(b);
+}
+
+static uint64_t
+_function_id(struct pprof_builder* b, uint64_t func_key, const char* name, const char* filename, int64_t start_line) {
+    void* v = pmap_query(b->functions, func_key);
+    if (v) return (uint64_t)(uintptr_t)v;
+    uint64_t id = ++b->function_count;
+    pmap_insert(b->functions, func_key, (void*)(uintptr_t)id);
+
+    uint64_t name_idx = _string_index(b, name);
+    b->tmp.len = 0;
+    _pbuf_field_varint(&b->tmp, FUNCTION_ID, id);
+    _pbuf_field_varint(&b->tmp, FUNCTION_NAME, name_idx);
+    _pbuf_field_varint(&b->tmp, FUNCTION_SYSTEM_NAME, name_idx);
+    _pbuf_field_varint(&b->tmp, FUNCTION_FILENAME, _string_index(b, filename));
+    _pbuf_field_varint(&b->tmp, FUNCTION_START_LINE, start_line > 0 ? (uint64_t)start_line : 0);
+    _pbuf_field_bytes(&b->tables, PROFILE_FUNCTION, b->tmp.data, b->tmp.len);
+    return id;
+}
+
+uint64_t
+pprof_location(struct pprof_builder* b, uint64_t key, const char* name, const char* filename, int64_t line) {
+    return pprof_line_location(b, key, key, name, filename, line, line);
+}
+
+uint64_t
+pprof_line_location(struct pprof_builder* b, uint64_t key, uint64_t func_key, const char* name, const char* filename,
+    int64_t start_line, int64_t line) {
+    void* v = pmap_query(b->locations, key);
+    if (v) return (uint64_t)(uintptr_t)v;
+    uint64_t id = ++b->location_count;
+    pmap_insert(b->locations, key, (void*)(uintptr_t)id);
+    uint64_t func_id = _function_id(b, func_key, name, filename, start_line);
+
+    b->tmp2.len = 0;
+    _pbuf_field_varint(&b->tmp2, LINE_FUNCTION_ID, func_id);
+    _pbuf_field_varint(&b->tmp2, LINE_LINE, line > 0 ? (uint64_t)line : 0);
+    b->tmp.len = 0;
+    _pbuf_field_varint(&b->tmp, LOCATION_ID, id);
+    _pbuf_field_bytes(&b->tmp, LOCATION_LINE, b->tmp2.data, b->tmp2.len);
+    _pbuf_field_bytes(&b->tables, PROFILE_LOCATION, b->tmp.data, b->tmp.len);
+    return id;
+}
+
+void
+pprof_add_sample(struct pprof_builder* b, const uint64_t* locations, int depth, const int64_t* values) {
+    // repeated 标量字段使用 packed 编码
+    b->tmp2.len = 0;
+    for (int i = 0; i < depth; ++i) {
+        _pbuf_varint(&b->tmp2, locations[i]);
+    }
+    b->tmp.len = 0;
+    _pbuf_field_bytes(&b->tmp, SAMPLE_LOCATION_ID, b->tmp2.data, b->tmp2.len);
+    b->tmp2.len = 0;
+    for (int i = 0; i < b->ntypes; ++i) {
+        _pbuf_varint(&b->tmp2, (uint64_t)values[i]);
+    }
+    _pbuf_field_bytes(&b->tmp, SAMPLE_VALUE, b->tmp2.data, b->tmp2.len);
+    _pbuf_field_bytes(&b->out, PROFILE_SAMPLE, b->tmp.data, b->tmp.len);
+}
+
+void
+pprof_set_period(struct pprof_builder* b, const char* type, const char* unit, int64_t period) {
+    b->period_type = _string_index(b, type);
+    b->period_unit = _string_index(b, unit);
+    b->period = period;
+}
+
+void
+pprof_set_time(struct pprof_builder* b, int64_t time_nanos, int64_t duration_nanos) {
+    b->time_nanos = time_nanos;
+    b->duration_nanos = duration_nanos;
+}
+
+void
+pprof_set_default_sample_type(struct pprof_builder* b, const char* type) {
+    b->default_sample_type = _string_index(b, type);
+}
+
+int
+pprof_write(struct pprof_builder* b, const char* path) {
+    struct pbuf* out = &b->out;
+    _pbuf_bytes(out, b->tables.data, b->tables.len);
+    for (uint64_t i = 0; i < b->string_count; ++i) {
+        const char* s = b->string_list[i];
+        _pbuf_field_bytes(out, PROFILE_STRING_TABLE, s, strlen(s));
+    }
+    _pbuf_field_varint(out, PROFILE_TIME_NANOS, (uint64_t)b->time_nanos);
+    _pbuf_field_varint(out, PROFILE_DURATION_NANOS, (uint64_t)b->duration_nanos);
+    if (b->period_type || b->period_unit) {
+        b->tmp.len = 0;
+        _pbuf_field_varint(&b->tmp, VALUE_TYPE_TYPE, b->period_type);
+        _pbuf_field_varint(&b->tmp, VALUE_TYPE_UNIT, b->period_unit);
+        _pbuf_field_bytes(out, PROFILE_PERIOD_TYPE, b->tmp.data, b->tmp.len);
+    }
+    _pbuf_field_varint(out, PROFILE_PERIOD, (uint64_t)b->period);
+    _pbuf_field_varint(out, PROFILE_DEFAULT_SAMPLE_TYPE, b->default_sample_type);
+
+    struct fwriter* w = fwriter_open(path);
+    if (!w) return -1;
+    pgzip_write(w, out->data, out->len);
+    return fwriter_close(w);
+}
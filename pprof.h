@@ -0,0 +1,38 @@
+#ifndef _PPROF_H_
+#define _PPROF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+profile.proto（github.com/google/pprof/proto/profile.proto）的编码器。
+sample 在 pprof_add_sample 时直接编码进输出缓冲，function/location/string 表去重后在 pprof_write 时追加，
+最终输出 gzip 压缩后的文件，可以直接被 `pprof` 打开。
+*/
+
+struct pprof_value_type {
+    const char* type;
+    const char* unit;
+};
+
+struct pprof_builder;
+
+struct pprof_builder* pprof_create(const struct pprof_value_type* types, int ntypes);
+void pprof_free(struct pprof_builder* b);
+
+// key 由调用方保证唯一（例如 frame id）；同一 key 只创建一次 function + location，返回 location id
+uint64_t pprof_location(struct pprof_builder* b, uint64_t key, const char* name, const char* filename, int64_t line);
+// 函数内某一行的 location：function 按 func_key 去重（start_line 为函数定义行），location 按 key 去重
+uint64_t pprof_line_location(struct pprof_builder* b, uint64_t key, uint64_t func_key, const char* name, const char* filename,
+    int64_t start_line, int64_t line);
+// locations 为 leaf -> root 顺序；values 个数与 sample type 个数相同
+void pprof_add_sample(struct pprof_builder* b, const uint64_t* locations, int depth, const int64_t* values);
+
+void pprof_set_period(struct pprof_builder* b, const char* type, const char* unit, int64_t period);
+void pprof_set_time(struct pprof_builder* b, int64_t time_nanos, int64_t duration_nanos);
+void pprof_set_default_sample_type(struct pprof_builder* b, const char* type);
+
+// 返回 0 表示成功，否则返回 -1 且 errno 有效
+int pprof_write(struct pprof_builder* b, const char* path);
+
+#endif
@@ -4,9 +4,15 @@
 #endif
 
 #include "profile.h"
-#include "imap.h"
+#include "pmap.h"
 #include "smap.h"
+#include "stackmap.h"
 #include "icallpath.h"
+#include "fwriter.h"
+#include "pprof.h"
+#include "ptime.h"
+#include "psym.h"
+#include "punwind.h"
 #include "lobject.h"
 #include "lfunc.h"
 #include "lstate.h"
@@ -18,12 +24,15 @@
 #include <math.h>
 #include <time.h>
 #include <errno.h>
+#ifdef LUA_PROF_TRAP
 #include "lprof.h"
+#endif
 #include <signal.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/ucontext.h>
 #include <dlfcn.h>
+#include <link.h>
 
 /*
 callpath node 构成一棵树，每个frame可以在这个树中找到一个 node。framestack 从 root frame 到 cur frame, 对应这棵树的某条路径。  
@@ -38,8 +47,9 @@ node1
 对应着 frame1 -> frame2 -> frame3 的调用关系。 
 */
 
-#define MAX_CALL_SIZE               1024
-#define MAX_CO_SIZE                 1024
+#define INIT_CALL_SIZE              8
+#define MAX_CALL_SIZE               (1 << 16)   // 影子栈深度上限，超出后只计数不记录
+#define SHRINK_CALL_EPOCH           64          // 影子栈每退空这么多次才考虑收缩一次
 #define NANOSEC                     1000000000
 #define MICROSEC                    1000000
 #define MAX_SAMPLE_DEPTH            256
@@ -48,99 +58,385 @@ node1
 #define MODE_OFF                    0
 #define MODE_PROFILE                1
 #define MODE_SAMPLE                 2
+#define MODE_COUNT_SAMPLE           3       // 仅 cpu：LUA_MASKCOUNT 按指数分布的指令间隔抽样，不需要补丁 vm
 
 #define DEFAULT_CPU_SAMPLE_HZ       250
+#define DEFAULT_CPU_SAMPLE_INSTR    10000
+#define DEFAULT_MEM_SAMPLE_BYTES    (512 * 1024)
+#define DEFAULT_WINDOW_COUNT        60
+
+// cpu_sample_lines：抽样帧记录到 (Proto*, pc) 的粒度
+#define SAMPLE_LINES_OFF            0
+#define SAMPLE_LINES_LEAF           1       // 只有叶子帧（默认）
+#define SAMPLE_LINES_ALL            2       // 每个 Lua 帧都记录调用点
+
+// frame id -> symbol_info 的两级表：chunk 一旦分配就不再移动，helper 线程可以无锁读取已发布的 id
+#define SYMBOL_CHUNK_SHIFT          10
+#define SYMBOL_CHUNK_SIZE           (1 << SYMBOL_CHUNK_SHIFT)
+#define SYMBOL_DIR_SIZE             16384
+#define SYMBOL_MAX                  ((uint32_t)SYMBOL_CHUNK_SIZE * SYMBOL_DIR_SIZE)
+
+#define DUMP_FORMAT_PPROF           0
+#define DUMP_FORMAT_FOLDED          1
+#define DUMP_FORMAT_FOLD            -1      // dump job 只折算冻结的 callpath 计数，不写文件
 
 static char profile_context_key = 'x';
+// get_profile_context 的线程内缓存：start/stop 时代数 +1，使所有线程的缓存失效
+static uint32_t g_ctx_generation = 0;
+static __thread const void* g_ctx_cache_g = NULL;
+static __thread struct profile_context* g_ctx_cache = NULL;
+static __thread uint32_t g_ctx_cache_gen = 0;
 
 
+#ifdef LUA_PROF_TRAP
 // forward decl for trap callback implemented later (needs structs defined)
 static void _on_prof_trap_n(lua_State* L, unsigned int n);
+#endif
 
-#ifdef LUA_PROF_TRAP
 // -------- CPU sampling (TLS + per-thread timer + signal handler) --------
-static int start_thread_timer_hz(int hz);
+// 只有 prof_ticks 与 trap 回调依赖打过补丁的 vm（LUA_PROF_TRAP），其余部分在原版 lua 上也能编译
+static int start_thread_timer_hz(int hz, bool wall, bool poisson, uint64_t seed);
+static inline uint64_t xorshift64(uint64_t* s);
 static void stop_thread_timer(void);
 static __thread lua_State* g_prof_current_L = NULL;
 static __thread timer_t g_prof_timerid;
+static __thread bool g_prof_timer_created = false;  /* timer_t 可能为 0（glibc 第一个内核定时器），不能用它判断 */
 static int g_prof_signo = 0; // assigned on install
 static __thread uintptr_t g_stack_lo = 0;
 static __thread uintptr_t g_stack_hi = 0;
 static char g_self_module[128];
 
-#define C_RB_CAP 8192
 #define C_MAX_FRAMES 64
 typedef struct {
     uint16_t depth;
     uintptr_t pcs[C_MAX_FRAMES];
 } c_sample_t;
-static __thread c_sample_t g_c_rb[C_RB_CAP];
-static __thread unsigned g_c_rb_head = 0;
-
-/* write helpers (async-signal-safe) */
-static inline void _hex_nibble(char n, char* out) {
-    *out = (n < 10) ? ('0' + n) : ('a' + (n - 10));
-}
-static size_t _hex_ptr(uintptr_t v, char* buf) {
-    char tmp[2 + sizeof(uintptr_t) * 2];
-    size_t p = 0;
-    tmp[p++] = '0'; tmp[p++] = 'x';
-    int started = 0;
-    for (int i = (int)(sizeof(uintptr_t) * 2 - 1); i >= 0; --i) {
-        char nib = (char)((v >> (i * 4)) & 0xf);
-        if (!started && nib == 0 && i != 0) continue;
-        started = 1;
-        _hex_nibble(nib, tmp + p);
-        p++;
-    }
-    for (size_t i = 0; i < p; ++i) buf[i] = tmp[i];
+
+/*
+C 栈样本缓冲：每线程一个单生产者单消费者的字节环，定时器启动时分配，停止时释放，没被抽样的线程不占内存。
+信号处理器把每条栈编码追加进去：varint 深度，第一帧为 pc 本身，之后是与上一帧差值的 zigzag varint。
+环满时丢弃新样本并计数，不覆盖旧数据。
+*/
+#define C_BUF_SIZE      (256 * 1024)                // 2 的幂
+#define C_RECORD_MAX    (2 + C_MAX_FRAMES * 10)     // 一条记录编码后的最大字节数
+typedef struct {
+    uint32_t head;              /* 只由信号处理器推进，字节计数，取模得到下标 */
+    uint32_t tail;              /* 只由消费者推进 */
+    uint32_t dropped;           /* 环满丢弃的样本数，消费者用原子交换取走 */
+    uint8_t data[C_BUF_SIZE];
+} c_sample_buf_t;
+
+/*
+C 栈聚合：每个被抽样的线程一个 c_sampler，全部交给后台聚合线程（sample_agg_main）：每 SAMPLE_AGG_INTERVAL_MS
+遍历登记的 c_sampler，把字节环解码、去重成 stackmap，用聚合线程独有的一个 psym 符号化新出现的地址。
+被抽样的线程在信号里只写字节环，哈希与符号化都不在它上面做；聚合线程处理某个 c_sampler 时不持有 g_agg_lock。
+dump 请求聚合线程取完剩余记录并复制一份（c_sample_copy_t），写文件时不持有任何锁。
+*/
+#define SAMPLE_AGG_INTERVAL_MS  10
+typedef struct {
+    const struct psym_frame* frame;     /* 指向聚合线程的 psym，c_sampler 登记期间有效 */
+    const char* path;                   /* 模块完整路径，raw 输出的模块表用，未知时为 NULL */
+} c_pc_sym_t;
+typedef struct {
+    struct stackmap* stacks;        /* leaf -> root 的 pc id，id 是 pcs/syms 的下标 */
+    uintptr_t* pcs;
+    c_pc_sym_t* syms;
+    uint32_t pc_count;
+    uint64_t dropped;
+} c_sample_copy_t;
+typedef struct c_sampler {
+    c_sample_buf_t buf;
+    /* 以下字段只由聚合线程访问 */
+    struct stackmap* stacks;
+    struct pmap_context* pc_ids;    /* pc -> id + 1 */
+    uintptr_t* pcs;
+    c_pc_sym_t* syms;
+    uint32_t pc_count;
+    uint32_t pc_cap;
+    uint64_t dropped;
+    /* 以下字段由 g_agg_lock 保护 */
+    uint32_t agg_round;             /* 聚合线程本轮已处理过时等于 g_agg_round */
+    bool flush;                     /* dump 在等 copy */
+    c_sample_copy_t* copy;
+    struct c_sampler* next;         /* 登记链表 */
+} c_sampler_t;
+static __thread c_sampler_t* g_c_sampler = NULL;
+static c_sampler_t* c_sampler_start(void);
+static void c_sampler_stop(c_sampler_t* s);
+
+/*
+混合栈（cpu_sample_mixed = true）：快照里同时保存本次信号的 C 帧，drain 时把落在 luaV_execute 里的
+本地帧替换成它正在解释执行的 Lua 帧，C 模块（cjson、crypto、pb）的耗时就挂在调用它的 Lua 函数下面。
+luaV_execute 的地址范围在 start 时通过动态符号表查到，找不到（例如 lua 没有用 -E 导出符号）时不开启。
+*/
+static __thread bool g_sample_mixed = false;
+static uintptr_t g_vm_exec_lo = 0;
+static uintptr_t g_vm_exec_hi = 0;
+
+/*
+Lua 栈快照：在信号处理器里直接读 L->ci 链（只做内存读取，不调用任何 Lua API），
+记录每帧的 Proto* 或 C 函数指针、savedpc 和 callstatus，写入本线程的环形缓冲（g_lua_rb）。
+符号化与聚合由 vm 线程在安全点（trap 回调、dump）里完成，见 drain_lua_snapshots。
+相比在 trap 里才抓栈，长时间不发生 call/return 的循环也能准确归因到正在执行的帧。
+*/
+#define LUA_RB_CAP 128
+#define LUA_SNAPSHOT_DEPTH 128
+typedef struct {
+    const void* fn;                 /* Lua 帧为 Proto*，C 帧为 lua_CFunction */
+    const Instruction* savedpc;     /* 仅 Lua 帧有效 */
+    unsigned short callstatus;
+    unsigned char is_lua;
+} lua_frame_t;
+typedef struct {
+    uint16_t depth;
+    uint32_t weight_ns;             /* 样本代表的时间：定时器时钟上距上一个样本的间隔，合并的 off-cpu 样本累加 */
+    uint8_t off_cpu;                /* 仅 wall clock 模式：两次信号之间线程几乎没有占用 cpu */
+    uint16_t c_depth;               /* 仅混合栈模式 */
+    lua_frame_t frames[LUA_SNAPSHOT_DEPTH];     /* leaf -> root */
+    uintptr_t c_pcs[C_MAX_FRAMES];  /* leaf -> root，pcs[0] 为被打断处的 ip */
+} lua_snapshot_t;
+typedef struct {
+    volatile unsigned head;         /* 只由信号处理器推进 */
+    volatile unsigned tail;         /* 只由消费者推进 */
+    unsigned dropped;
+    lua_snapshot_t snaps[LUA_RB_CAP];
+} lua_snapshot_ring_t;
+/* 约 460KB：不放进 TLS 让每个线程都背上，本线程 arm 定时器时与 g_c_sampler 一起分配，stop 时释放 */
+static __thread lua_snapshot_ring_t* g_lua_rb = NULL;
+
+/*
+wall clock 抽样（cpu_clock = "wall"）：定时器用 CLOCK_MONOTONIC，线程阻塞时也会收到信号。
+信号处理器比较两次信号间的线程 cpu 时间与墙钟时间，cpu 占比不到一半记为 off-cpu。
+阻塞期间栈不变，同一个 CallInfo 上连续的 off-cpu 样本合并到环里最新的一条，避免长时间阻塞把环写满。
+*/
+static __thread bool g_wall_clock = false;
+static __thread const CallInfo* g_wall_last_ci = NULL;
+
+/*
+Poisson 抽样（默认开启，cpu_sample_poisson = false 退回固定周期）：定时器是一次性的，
+每次信号里按均值 1e9/hz 的指数分布重新 arm。固定周期会和游戏帧循环这类定周期负载锁相，
+整段函数被一直采到或一直漏掉；指数分布的间隔与任何周期都不相关。
+间隔不再相等，每个样本带上定时器时钟上距上一个样本的实际间隔作为权重，总量仍然无偏。
+*/
+static __thread bool g_sample_poisson = false;
+static __thread uint64_t g_sample_mean_ns = 0;
+static __thread uint64_t g_sample_rng = 0;
+static __thread uint64_t g_sample_last_ns = 0;      /* 定时器时钟：wall 为 CLOCK_MONOTONIC，否则为线程 cpu 时间 */
+static __thread uint64_t g_sample_last_cpu_ns = 0;
+#define POISSON_MIN_GAP_NS  10000       /* 避免极短间隔造成信号风暴 */
+
+/* async-signal-safe: plain memory reads of the CallInfo chain */
+static int fill_lua_snapshot(lua_State* L, lua_snapshot_t* snap) {
+    StkId stack_lo = L->stack.p;
+    StkId stack_hi = L->stack_last.p;
+    int depth = 0;
+    for (CallInfo* ci = L->ci; ci && ci != &L->base_ci && depth < LUA_SNAPSHOT_DEPTH; ci = ci->previous) {
+        StkId func = ci->func.p;
+        /* luaD_reallocstack 搬移栈期间 func 暂时是偏移量，此时放弃剩余部分 */
+        if (func < stack_lo || func >= stack_hi) break;
+        const TValue* tv = s2v(func);
+        lua_frame_t* f = &snap->frames[depth];
+        if (ttislcf(tv)) {
+            f->fn = (const void*)fvalue(tv);
+            f->savedpc = NULL;
+            f->is_lua = 0;
+        } else if (ttisclosure(tv)) {
+            const Closure* cl = clvalue(tv);
+            if (cl->c.tt == LUA_VLCL) {
+                f->fn = (const void*)cl->l.p;
+                f->savedpc = ci->u.l.savedpc;
+                f->is_lua = 1;
+            } else if (cl->c.tt == LUA_VCCL) {
+                f->fn = (const void*)cl->c.f;
+                f->savedpc = NULL;
+                f->is_lua = 0;
+            } else {
+                continue;
+            }
+        } else {
+            continue;
+        }
+        f->callstatus = ci->callstatus;
+        depth++;
+    }
+    snap->depth = (uint16_t)depth;
+    snap->weight_ns = 0;
+    snap->off_cpu = 0;
+    snap->c_depth = 0;
+    return depth;
+}
+
+static void capture_lua_snapshot(lua_State* L, bool off_cpu, uint32_t weight_ns, const c_sample_t* cs) {
+    lua_snapshot_ring_t* rb = g_lua_rb;
+    if (!rb) return;
+    unsigned head = rb->head;
+    if (off_cpu && head != rb->tail && L->ci == g_wall_last_ci) {
+        /* 尚未被消费的上一条也是同一帧上的 off-cpu 样本：只加权重 */
+        lua_snapshot_t* last = &rb->snaps[(head - 1) % LUA_RB_CAP];
+        if (last->off_cpu && last->weight_ns <= UINT32_MAX - weight_ns) {
+            last->weight_ns += weight_ns;
+            return;
+        }
+    }
+    if (head - rb->tail >= LUA_RB_CAP) {
+        rb->dropped++;
+        return;
+    }
+    lua_snapshot_t* snap = &rb->snaps[head % LUA_RB_CAP];
+    if (fill_lua_snapshot(L, snap) == 0) return;
+    snap->weight_ns = weight_ns;
+    snap->off_cpu = off_cpu ? 1 : 0;
+    if (g_sample_mixed && cs) {
+        for (int i = 0; i < cs->depth; ++i) snap->c_pcs[i] = cs->pcs[i];
+        snap->c_depth = cs->depth;
+    }
+    g_wall_last_ci = off_cpu ? L->ci : NULL;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    rb->head = head + 1;
+}
+
+/* clock_gettime 是 async-signal-safe 的 */
+static inline uint64_t _clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// 本次样本的权重（ns），wall clock 模式下顺带判断 on/off-cpu
+static uint32_t sample_weight_ns(bool* off_cpu) {
+    *off_cpu = false;
+    if (!g_wall_clock && !g_sample_poisson) return (uint32_t)g_sample_mean_ns;
+    uint64_t cpu = _clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t now = g_wall_clock ? _clock_ns(CLOCK_MONOTONIC) : cpu;
+    uint64_t elapsed = now - g_sample_last_ns;
+    if (g_wall_clock) {
+        *off_cpu = (cpu - g_sample_last_cpu_ns) * 2 < elapsed;
+    }
+    g_sample_last_ns = now;
+    g_sample_last_cpu_ns = cpu;
+    if (!g_sample_poisson) return (uint32_t)g_sample_mean_ns;
+    return elapsed < UINT32_MAX ? (uint32_t)elapsed : UINT32_MAX;
+}
+
+/*
+指数分布的下一个间隔。log 不在 async-signal-safe 列表里，但它是不加锁、不分配的纯计算，
+u 在 (0,1] 内也不会设置 errno。
+*/
+static uint64_t poisson_gap_ns(void) {
+    uint64_t r = xorshift64(&g_sample_rng);
+    double u = (double)((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+    uint64_t gap = (uint64_t)(-log(u) * (double)g_sample_mean_ns);
+    if (gap < POISSON_MIN_GAP_NS) gap = POISSON_MIN_GAP_NS;
+    return gap;
+}
+
+// timer_settime 是 async-signal-safe 的，一次性定时器在信号处理器里直接重新 arm
+static void rearm_poisson_timer(void) {
+    uint64_t gap = poisson_gap_ns();
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(gap / 1000000000ULL);
+    its.it_value.tv_nsec = (long)(gap % 1000000000ULL);
+    timer_settime(g_prof_timerid, 0, &its, NULL);
+}
+
+static const c_sample_t* walk_c_stack(void* uctx, c_sample_t* cs);
+
+static inline uint32_t _c_buf_put(c_sample_buf_t* buf, uint32_t p, uint64_t v) {
+    while (v >= 0x80) {
+        buf->data[p++ & (C_BUF_SIZE - 1)] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf->data[p++ & (C_BUF_SIZE - 1)] = (uint8_t)v;
     return p;
 }
 
+/* 消费者在另一个线程：head/tail 用 acquire/release，dropped 用原子加 */
+static void push_c_sample(const c_sample_t* cs) {
+    c_sampler_t* sampler = g_c_sampler;
+    if (!sampler || !cs || cs->depth == 0) return;
+    c_sample_buf_t* buf = &sampler->buf;
+    uint32_t head = buf->head;
+    if (C_BUF_SIZE - (head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE)) < C_RECORD_MAX) {
+        __atomic_fetch_add(&buf->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint32_t p = _c_buf_put(buf, head, cs->depth);
+    uintptr_t prev = 0;
+    for (int i = 0; i < cs->depth; ++i) {
+        int64_t d = (int64_t)(cs->pcs[i] - prev);
+        p = _c_buf_put(buf, p, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+        prev = cs->pcs[i];
+    }
+    __atomic_store_n(&buf->head, p, __ATOMIC_RELEASE);
+}
+
 static void prof_sig_handler(int sig, siginfo_t* si, void* uctx) {
     (void)sig; (void)si; (void)uctx;
+    int saved_errno = errno;
     lua_State* L = g_prof_current_L;
+    bool off_cpu;
+    uint32_t weight_ns = sample_weight_ns(&off_cpu);
+    c_sample_t stack;
+    const c_sample_t* cs = walk_c_stack(uctx, &stack);
+    push_c_sample(cs);
     if (L) {
+#ifdef LUA_PROF_TRAP
         if (L->prof_ticks < 0x7fffffffU) {
             L->prof_ticks++;
         }
+#endif
+        capture_lua_snapshot(L, off_cpu, weight_ns, cs);
+    }
+    if (g_sample_poisson) {
+        rearm_poisson_timer();
     }
+    errno = saved_errno;
+}
 
-    /* Grab C stack (best-effort, x86_64) and print one folded line to stderr */
+/*
+Grab C stack (best-effort, x86_64) into cs; returns NULL elsewhere.
+优先按 .eh_frame 规则表回溯（punwind_step，表在 start 和聚合线程上预先展开），不需要帧指针；
+地址没有 CFI 规则时这一帧退回帧指针。
+*/
+static const c_sample_t* walk_c_stack(void* uctx, c_sample_t* cs) {
 #if defined(__x86_64__)
     ucontext_t* ctx = (ucontext_t*)uctx;
-    uintptr_t ip = 0, bp = 0;
+    uintptr_t ip = 0, sp = 0, bp = 0;
 # ifdef REG_RIP
     ip = (uintptr_t)ctx->uc_mcontext.gregs[REG_RIP];
 # endif
+# ifdef REG_RSP
+    sp = (uintptr_t)ctx->uc_mcontext.gregs[REG_RSP];
+# endif
 # ifdef REG_RBP
     bp = (uintptr_t)ctx->uc_mcontext.gregs[REG_RBP];
 # endif
-    /* collect frames into TLS ring buffer */
-    unsigned idx = g_c_rb_head++ % C_RB_CAP;
-    c_sample_t* cs = &g_c_rb[idx];
     cs->depth = 0;
-    if (ip && cs->depth < C_MAX_FRAMES) {
-        cs->pcs[cs->depth++] = ip;
-    }
     uintptr_t lo = g_stack_lo, hi = g_stack_hi;
-    int depth = 0;
-    while (bp && bp >= lo && (bp + 2 * sizeof(uintptr_t)) < hi && depth < 64) {
-        /* ret address at [bp + sizeof(void*)], next bp at [bp] */
-        uintptr_t next_bp = 0;
-        uintptr_t ret = 0;
-        /* guard against invalid memory by simple bounds checks */
-        next_bp = *((uintptr_t*)bp);
-        ret = *((uintptr_t*)(bp + sizeof(uintptr_t)));
-        if (next_bp <= bp || next_bp >= hi) break;
-        if (cs->depth < C_MAX_FRAMES) {
-            cs->pcs[cs->depth++] = ret;
-        }
-        bp = next_bp;
-        depth++;
+    int leaf = 1;
+    punwind_enter();
+    while (ip && cs->depth < C_MAX_FRAMES) {
+        cs->pcs[cs->depth++] = ip;
+        int r = punwind_step(&ip, &sp, &bp, lo, hi, leaf);
+        if (r < 0) break;
+        if (r == 0) {
+            /* ret address at [bp + sizeof(void*)], next bp at [bp] */
+            /* guard against invalid memory by simple bounds checks */
+            if (bp < lo || bp < sp || (bp + 2 * sizeof(uintptr_t)) >= hi) break;
+            uintptr_t next_bp = *((uintptr_t*)bp);
+            ip = *((uintptr_t*)(bp + sizeof(uintptr_t)));
+            sp = bp + 2 * sizeof(uintptr_t);
+            /* 调用者有 CFI 时 bp 无关紧要，这里不因为 next_bp 无效就停止 */
+            bp = next_bp;
+        }
+        leaf = 0;
     }
+    punwind_leave();
+    return cs;
 #else
-    (void)uctx;
+    (void)uctx; (void)cs;
+    return NULL;
 #endif
 }
 
@@ -169,10 +465,24 @@ static int install_prof_signal_once(void) {
     return 0;
 }
 
-static int start_thread_timer_hz(int hz) {
+// 注销并释放本线程的 C 样本缓冲与 Lua 快照环
+static void release_thread_buffers(void) {
+    /* 信号处理器在本线程上同步执行：置空之后就不会再写这两块缓冲 */
+    c_sampler_t* sampler = g_c_sampler;
+    lua_snapshot_ring_t* rb = g_lua_rb;
+    g_c_sampler = NULL;
+    g_lua_rb = NULL;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (sampler) c_sampler_stop(sampler);
+    pfree(rb);
+}
+
+static void stop_thread_timer(void);
+
+static int start_thread_timer_hz(int hz, bool wall, bool poisson, uint64_t seed) {
     if (hz <= 0) hz = 250;
     if (install_prof_signal_once() != 0) return -1;
-    /* cache stack bounds for safe FP walk */
+    /* cache stack bounds for safe stack walk */
     {
         pthread_attr_t attr;
         if (pthread_getattr_np(pthread_self(), &attr) == 0) {
@@ -195,23 +505,84 @@ static int start_thread_timer_hz(int hz) {
     sev.sigev_notify = SIGEV_SIGNAL;
 #endif
     sev.sigev_signo = g_prof_signo;
-    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &g_prof_timerid) != 0) return -1;
+    if (!g_c_sampler) {
+        g_c_sampler = c_sampler_start();
+        if (!g_c_sampler) return -1;
+    }
+    if (!g_lua_rb) {
+        // 每次会话重新分配，上一次会话的快照不会留到这里
+        lua_snapshot_ring_t* rb = (lua_snapshot_ring_t*)pmalloc(sizeof(lua_snapshot_ring_t));
+        if (!rb) {
+            release_thread_buffers();
+            return -1;
+        }
+        rb->head = 0;
+        rb->tail = 0;
+        rb->dropped = 0;
+        g_lua_rb = rb;
+    }
+    g_wall_clock = wall;
+    g_wall_last_ci = NULL;
+    g_sample_mean_ns = 1000000000ULL / (uint64_t)hz;
+    g_sample_rng = seed;
+    g_sample_last_cpu_ns = _clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    g_sample_last_ns = wall ? _clock_ns(CLOCK_MONOTONIC) : g_sample_last_cpu_ns;
+    if (timer_create(wall ? CLOCK_MONOTONIC : CLOCK_THREAD_CPUTIME_ID, &sev, &g_prof_timerid) != 0) {
+        memset(&g_prof_timerid, 0, sizeof(g_prof_timerid));
+        g_wall_clock = false;
+        release_thread_buffers();
+        return -1;
+    }
+    g_prof_timer_created = true;
     struct itimerspec its;
     memset(&its, 0, sizeof(its));
-    its.it_value.tv_nsec = 1000000000LL / hz;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
-    if (timer_settime(g_prof_timerid, 0, &its, NULL) != 0) return -1;
+    if (poisson) {
+        uint64_t gap = poisson_gap_ns();
+        its.it_value.tv_sec = (time_t)(gap / 1000000000ULL);
+        its.it_value.tv_nsec = (long)(gap % 1000000000ULL);
+    } else {
+        its.it_value.tv_nsec = (long)g_sample_mean_ns;
+        its.it_interval.tv_nsec = its.it_value.tv_nsec;
+    }
+    // 先置标记再 arm：第一个信号到来时就会按 Poisson 重新 arm
+    g_sample_poisson = poisson;
+    if (timer_settime(g_prof_timerid, 0, &its, NULL) != 0) {
+        stop_thread_timer();
+        return -1;
+    }
     return 0;
 }
 
+// luaV_execute 的地址范围，混合栈用它识别解释器帧；需要 lua 导出符号（链接时 -Wl,-E）
+static bool find_vm_execute(void) {
+    if (g_vm_exec_hi != 0) return true;
+#if defined(__x86_64__)
+    void* addr = dlsym(RTLD_DEFAULT, "luaV_execute");
+    Dl_info info;
+    const ElfW(Sym)* sym = NULL;
+    if (!addr || !dladdr1(addr, &info, (void**)&sym, RTLD_DL_SYMENT) || !sym || sym->st_size == 0) {
+        return false;
+    }
+    g_vm_exec_lo = (uintptr_t)addr;
+    g_vm_exec_hi = (uintptr_t)addr + sym->st_size;
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void stop_thread_timer(void) {
+    g_sample_poisson = false;   /* 之后到达的信号不再重新 arm */
+    g_sample_mixed = false;
     struct itimerspec its;
     memset(&its, 0, sizeof(its));
     timer_settime(g_prof_timerid, 0, &its, NULL);
     timer_delete(g_prof_timerid);
     memset(&g_prof_timerid, 0, sizeof(g_prof_timerid));
+    g_prof_timer_created = false;
+    g_wall_clock = false;
+    release_thread_buffers();
 }
-#endif
 
 
 // 获取单调递增的时间戳（纳秒），不会被 NTP 调整。
@@ -237,41 +608,159 @@ get_realtime_ns() {
     return sec * (uint64_t)NANOSEC + nsec;
 }
 
-// 读取启动参数：{ cpu = "off|profile|sample", mem = "off|profile|sample", cpu_sample_hz = int }
+struct profile_opts {
+    int     cpu_mode;
+    int     mem_mode;
+    int     cpu_sample_hz;
+    int     cpu_sample_instr;   // count_sample 模式的平均指令间隔
+    bool    cpu_clock_wall;     // sample 模式的定时器用墙钟（含阻塞时间），样本带 on/off-cpu 标记
+    bool    cpu_sample_poisson; // sample 模式按指数分布间隔抽样（默认开启），false 为固定周期
+    int     cpu_sample_lines;   // SAMPLE_LINES_*
+    bool    cpu_sample_mixed;   // sample 模式把 C 帧与 Lua 帧拼成一条混合栈
+    size_t  mem_sample_bytes;
+    bool    full_gc;            // start 前先做一次 full gc（默认不做）
+    int     window_sec;         // > 0 时开启 continuous profiling，按此周期轮转窗口
+    int     window_count;       // 内存中保留的窗口个数
+    const char* window_dir;     // 非空时窗口写成带时间戳的文件，不保留在内存；指向 opts table 里的字符串
+    bool    dump_thread;        // 冻结后的序列化放到 helper 线程
+    bool    hook_existing;      // start 时遍历 allgc 给已有协程挂 hook（默认关闭，O(堆对象数)）
+    bool    tsc;                // tracing 计时用 TSC，不支持时自动回退到 clock_gettime
+};
+
+// 读取启动参数：{ cpu = "off|profile|sample|count_sample", mem = "off|profile|sample", cpu_clock = "cpu|wall", cpu_sample_hz = int, cpu_sample_poisson = bool, cpu_sample_lines = "off|leaf|all", cpu_sample_mixed = bool,
+//               cpu_sample_instr = int, mem_sample_bytes = int,
+//               full_gc = bool, window_sec = int, window_count = int, window_dir = string, dump_thread = bool }
 static bool
-read_arg(lua_State* L, int* out_cpu_mode, int* out_mem_mode, int* out_cpu_sample_hz) {
-    if (!out_cpu_mode || !out_mem_mode || !out_cpu_sample_hz) return false;
-    *out_cpu_mode = MODE_PROFILE;
-    *out_mem_mode = MODE_PROFILE;
-    *out_cpu_sample_hz = DEFAULT_CPU_SAMPLE_HZ;
+read_arg(lua_State* L, struct profile_opts* opts) {
+    opts->cpu_mode = MODE_PROFILE;
+    opts->mem_mode = MODE_PROFILE;
+    opts->cpu_sample_hz = DEFAULT_CPU_SAMPLE_HZ;
+    opts->cpu_sample_instr = DEFAULT_CPU_SAMPLE_INSTR;
+    opts->cpu_clock_wall = false;
+    opts->cpu_sample_poisson = true;
+    opts->cpu_sample_lines = SAMPLE_LINES_LEAF;
+    opts->cpu_sample_mixed = false;
+    opts->mem_sample_bytes = DEFAULT_MEM_SAMPLE_BYTES;
+    opts->full_gc = false;
+    opts->window_sec = 0;
+    opts->window_count = DEFAULT_WINDOW_COUNT;
+    opts->window_dir = NULL;
+    opts->dump_thread = false;
+    opts->hook_existing = false;
+    opts->tsc = false;
     if (lua_gettop(L) < 1 || !lua_istable(L, 1)) return true;
 
     lua_getfield(L, 1, "cpu");
     if (lua_isstring(L, -1)) {
         const char* s = lua_tostring(L, -1);
-        if (strcmp(s, "off") == 0) *out_cpu_mode = MODE_OFF;
-        else if (strcmp(s, "profile") == 0) *out_cpu_mode = MODE_PROFILE;
-        else if (strcmp(s, "sample") == 0) *out_cpu_mode = MODE_SAMPLE;
+        if (strcmp(s, "off") == 0) opts->cpu_mode = MODE_OFF;
+        else if (strcmp(s, "profile") == 0) opts->cpu_mode = MODE_PROFILE;
+        else if (strcmp(s, "sample") == 0) opts->cpu_mode = MODE_SAMPLE;
+        else if (strcmp(s, "count_sample") == 0) opts->cpu_mode = MODE_COUNT_SAMPLE;
         else {printf("invalid cpu mode: %s\n", s); return false;}
+#ifndef LUA_PROF_TRAP
+        if (opts->cpu_mode == MODE_SAMPLE) {printf("cpu mode sample needs LUA_PROF_TRAP, use count_sample\n"); return false;}
+#endif
     }
     lua_pop(L, 1);
 
     lua_getfield(L, 1, "mem");
     if (lua_isstring(L, -1)) {
         const char* s = lua_tostring(L, -1);
-        if (strcmp(s, "off") == 0) *out_mem_mode = MODE_OFF;
-        else if (strcmp(s, "profile") == 0) *out_mem_mode = MODE_PROFILE;
-        else if (strcmp(s, "sample") == 0) *out_mem_mode = MODE_SAMPLE;
+        if (strcmp(s, "off") == 0) opts->mem_mode = MODE_OFF;
+        else if (strcmp(s, "profile") == 0) opts->mem_mode = MODE_PROFILE;
+        else if (strcmp(s, "sample") == 0) opts->mem_mode = MODE_SAMPLE;
         else {printf("invalid mem mode: %s\n", s); return false;}
     }
     lua_pop(L, 1);
 
+    lua_getfield(L, 1, "cpu_clock");
+    if (lua_isstring(L, -1)) {
+        const char* s = lua_tostring(L, -1);
+        if (strcmp(s, "cpu") == 0) opts->cpu_clock_wall = false;
+        else if (strcmp(s, "wall") == 0) opts->cpu_clock_wall = true;
+        else {printf("invalid cpu clock: %s\n", s); return false;}
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "cpu_sample_lines");
+    if (lua_isstring(L, -1)) {
+        const char* s = lua_tostring(L, -1);
+        if (strcmp(s, "off") == 0) opts->cpu_sample_lines = SAMPLE_LINES_OFF;
+        else if (strcmp(s, "leaf") == 0) opts->cpu_sample_lines = SAMPLE_LINES_LEAF;
+        else if (strcmp(s, "all") == 0) opts->cpu_sample_lines = SAMPLE_LINES_ALL;
+        else {printf("invalid cpu sample lines: %s\n", s); return false;}
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "cpu_sample_instr");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer si = lua_tointeger(L, -1);
+        if (si > 0 && si <= INT32_MAX) opts->cpu_sample_instr = (int)si;
+    }
+    lua_pop(L, 1);
+
     lua_getfield(L, 1, "cpu_sample_hz");
     if (lua_isinteger(L, -1)) {
         int sp = (int)lua_tointeger(L, -1);
-        if (sp > 0) *out_cpu_sample_hz = sp;
+        if (sp > 0) opts->cpu_sample_hz = sp;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "cpu_sample_poisson");
+    if (lua_isboolean(L, -1)) {
+        opts->cpu_sample_poisson = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "mem_sample_bytes");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer sb = lua_tointeger(L, -1);
+        if (sb > 0) opts->mem_sample_bytes = (size_t)sb;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "full_gc");
+    opts->full_gc = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "window_sec");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer ws = lua_tointeger(L, -1);
+        if (ws > 0) opts->window_sec = (int)ws;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "window_count");
+    if (lua_isinteger(L, -1)) {
+        lua_Integer wc = lua_tointeger(L, -1);
+        if (wc > 0) opts->window_count = (int)wc;
     }
     lua_pop(L, 1);
+
+    lua_getfield(L, 1, "window_dir");
+    if (lua_isstring(L, -1)) {
+        opts->window_dir = lua_tostring(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "dump_thread");
+    opts->dump_thread = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "hook_existing");
+    if (lua_isboolean(L, -1)) {
+        opts->hook_existing = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "tsc");
+    opts->tsc = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "cpu_sample_mixed");
+    opts->cpu_sample_mixed = lua_toboolean(L, -1);
+    lua_pop(L, 1);
     return true;
 }
 
@@ -280,45 +769,126 @@ struct call_frame {
     struct icallpath_context*   path;
     bool  tail;
     uint64_t call_time;
-    uint64_t co_cost;     // co yield cost 
+    uint64_t co_base;     // 入栈时 call_state 的 co_cost，出栈时相减得到本帧期间的 yield 耗时
+    uint64_t call_base;   // 入栈时 call_state 的 calls，出栈时相减得到本帧期间的子孙调用次数
 };
 
 struct call_state {
     lua_State*  co;
     uint64_t    leave_time; // co yield begin time
+    uint64_t    co_cost;    // 累计挂起耗时，只增不减
+    uint64_t    calls;      // 累计 call 事件数，只增不减
+    uint32_t    slot;       // 在 cs_slots 中的下标，见 _lookup_call_state
     int         top;
-    struct call_frame call_list[0];
+    int         cap;
+    int         overflow;   // 超过 MAX_CALL_SIZE 未记录的帧数
+    bool        overflow_tail;  // 溢出始于尾调用：它替换了栈顶帧，溢出结束的那次 ret 要把栈顶帧一起弹出
+    int         peak;       // 本轮（SHRINK_CALL_EPOCH 次退空）内的最大深度
+    int         empties;    // 本轮内退空的次数
+    struct call_frame* call_list;
+};
+
+// continuous profiling 的一个窗口：只含 [start, start + duration) 区间内的增量
+struct profile_window {
+    uint64_t    seq;
+    uint64_t    start_realtime;     // 窗口开始的绝对时间（ns）
+    uint64_t    duration;
+    struct stackmap*    cpu_samples;    // 交换出来的 lua cpu 抽样（单值），可能为 NULL
+    struct stackmap*    stacks;         // callpath tree 的增量（PPROF_TYPE_COUNT 个值），可能为 NULL
 };
 
+struct dump_worker;
+static struct dump_worker* dump_worker_start();
+static void dump_worker_stop(struct dump_worker* worker);
+
 struct profile_context {
     uint64_t    start_time;
     bool        is_ready;
     bool        running_in_hook;
     lua_Alloc   last_alloc_f;
     void*       last_alloc_ud;
-    struct imap_context*        cs_map;
-    struct imap_context*        alloc_map;
-    struct imap_context*        symbol_map;
-    smap_t*                     sample_map;   // folded stacks for lua cpu sampling
-    smap_t*                     c_sample_map; // folded stacks for c cpu sampling
+    struct pmap_context*        cs_map;
+    struct pmap_context*        alloc_map;
+    struct pmap_context*        symbol_map;
+    struct stackmap*            sample_map;   // frame-id stacks for lua cpu sampling
+    c_sampler_t*                c_sampler;    // 本 vm 所在线程的 C 栈聚合，start 时设置，stop 后失效
+    struct psym*                symbolizer;   // C 地址符号化，首次需要时创建，见 _symbolizer
     struct icallpath_context*   callpath;
     struct call_state*          cur_cs;
+    struct call_state**         cs_slots;       // slot -> call_state，协程 extraspace 里的 tag 指向这里
+    uint32_t                    cs_slot_count;
+    uint32_t                    cs_slot_cap;
+    uint32_t*                   cs_free_slots;  // 已回收的 slot
+    uint32_t                    cs_free_count;
+    uint32_t                    cs_free_cap;
+    uint64_t                    cs_live;        // 当前跟踪的协程数
+    uint64_t                    cs_reclaimed;   // 协程被回收时释放的 call_state 数
+    uint64_t                    call_overflow;  // 因超过 MAX_CALL_SIZE 未记录的调用次数
+    uint32_t                    session;        // 本次 start 的随机标识，最高位恒为 1
     int         cpu_mode;       // MODE_*
     int         mem_mode;       // MODE_*
-    int         cpu_sample_hz;  // instruction count for LUA_MASKCOUNT
+    int         cpu_sample_hz;  // sample 模式的定时器频率
+    int         cpu_sample_instr;   // count_sample 模式的平均指令间隔（LUA_MASKCOUNT）
+    bool        cpu_clock_wall;     // sample 模式按墙钟抽样，栈根上加 [on-cpu]/[off-cpu] 标记帧
+    int         cpu_sample_lines;   // SAMPLE_LINES_*，抽样帧是否细化到 (Proto*, pc)
+    size_t      mem_sample_bytes;       // mean bytes between heap samples
+    int64_t     mem_sample_remaining;   // bytes left before the next heap sample
     uint64_t    rng_state;      // RNG state for sampling gaps
-    uint64_t    profile_cost_ns;
+    struct parena*              arena;  // 内部小对象（symbol/alloc_node/call_state/计数器）
+    struct symbol_info***       symbol_dir;     // frame id -> symbol_info，见 symbol_get
+    uint32_t                    symbol_count;
+    uint32_t                    mem_symbols;    // 分配器里新建、名字还没在安全点解析的 symbol 数
+    bool        use_tsc;        // hook 时间戳是 TSC tick，见 hook_now
+    uint64_t    profile_cost;   // hook 自身耗时（hook 时钟）
+    uint64_t    hook_overhead;  // 每次调用（call + ret 两个事件）的 hook 开销，start 时校准（hook 时钟）
+    // continuous profiling：每 window_ns 把聚合轮转成一个窗口，之后从零开始累计
+    uint64_t    window_ns;              // 0 表示不轮转
+    uint64_t    window_start;           // 当前窗口开始的 mono 时间
+    uint64_t    window_seq;
+    struct profile_window*      windows;        // 环形数组，容量 window_cap
+    int         window_cap;
+    int         window_head;            // 下一个写入位置
+    int         window_used;
+    char*       window_dir;             // 非空时窗口写成文件，不进环形数组
+    struct dump_worker*         worker; // 序列化 helper 线程，NULL 时在 vm 线程同步写
+    // callpath 计数的双缓冲，见 struct callpath_stat
+    int         stat_epoch;             // vm 线程正在写的那组
+    struct callpath_node*       node_list;      // 所有节点，新建的在前
+    pthread_mutex_t             fold_lock;
+    struct stackmap*            fold_out;       // 冻结的那组要折算进的栈表，NULL 表示没有待折算的
+    struct callpath_node*       fold_head;      // 冻结时的 node_list，之后新建的节点冻结的那组全为 0
+    int         fold_epoch;
 };
 
-struct callpath_node {
-    struct callpath_node*   parent;
-    const char* source;
-    const char* name;
-    int     line;
-    int     depth;
-    uint64_t last_ret_time;
+/*
+hook 时钟：call_time/leave_time/co_cost/real_cost/last_ret_time/profile_cost 都用它计量，
+use_tsc 时是 TSC tick，导出时才经 hook_ns/hook_mono 换算成 ns；否则就是 mono ns。
+*/
+static inline uint64_t
+hook_now(const struct profile_context* ctx) {
+    return ctx->use_tsc ? ptime_tsc() : get_mono_ns();
+}
+
+// 时间区间 -> ns
+static inline uint64_t
+hook_ns(const struct profile_context* ctx, uint64_t d) {
+    return ctx->use_tsc ? ptime_tsc_to_ns(d) : d;
+}
+
+// 时刻 -> mono ns
+static inline uint64_t
+hook_mono(const struct profile_context* ctx, uint64_t t) {
+    return (ctx->use_tsc && t) ? ptime_tsc_to_mono(t) : t;
+}
+
+/*
+callpath 节点上会被清零的计数。每个节点两组，vm 线程只写 stat_epoch 选中的那组；
+profile_freeze 翻转 stat_epoch（O(1)），冻结的那组由 callpath_fold 折算成窗口的栈表并清零。
+*/
+struct callpath_stat {
     uint64_t call_count;
     uint64_t real_cost;
+    uint64_t child_calls;    // real_cost 期间发生的子孙调用次数，用于扣除 hook 开销
     uint64_t cpu_samples;    // sampling count (leaf samples), aggregated at dump
     uint64_t alloc_bytes;
     uint64_t free_bytes;
@@ -327,44 +897,95 @@ struct callpath_node {
     uint64_t realloc_times;
 };
 
+struct callpath_node {
+    struct callpath_node*   parent;
+    const char* source;
+    const char* name;
+    int     line;
+    int     depth;
+    uint64_t last_ret_time;
+    uint32_t frame_id;      // 与 symbol_map 共用的 frame id，命名时填上，折算时不再查 symbol
+    struct callpath_node* list_next;    // context->node_list，折算冻结的计数时沿它遍历
+    struct callpath_stat stat[2];       // 按 context->stat_epoch 选，见 node_stat
+    uint64_t fold_real;     // 折算时子节点的 real_cost / comp cost 之和，只在 callpath_fold 里用
+    uint64_t fold_comp;
+    struct symbol_info* sym; // 非 NULL 时名字跟随 symbol，见 _snapshot_leaf_node
+};
+
+static inline struct callpath_stat*
+node_stat(const struct profile_context* ctx, struct callpath_node* node) {
+    return &node->stat[ctx->stat_epoch];
+}
+
 struct alloc_node {
-    size_t live_bytes;                // 当前存活字节
+    size_t live_bytes;                // 当前存活字节（sample 模式下为加权估计值）
+    uint64_t live_times;              // sample 模式下该样本代表的对象数
     struct callpath_node* path;       // 当前所有权路径
 };
 
+/*
+Lua 函数的行号表副本（lineinfo + abslineinfo），第一次记录该函数的 pc 位置时从 Proto 拷贝。
+导出时才把 pc 换算成行号，Proto 那时可能已经被回收，helper 线程上也不能碰 Lua 对象。
+*/
+struct line_table {
+    int linedefined;
+    int sizelineinfo;
+    int sizeabslineinfo;
+    signed char* lineinfo;
+    AbsLineInfo* abslineinfo;
+};
+
 struct symbol_info {
     char* name;
     char* source;
     int line;
+    uint32_t id;        // frame id，即在 symbol_dir 中的下标
+    int pc;             // >= 0 时是 func 内一条指令的位置，导出时经 func->lines 换算成行号
+    struct symbol_info* func;       // pc 位置所属的函数 symbol，函数本身为 NULL
+    struct line_table* lines;       // 仅 Lua 函数，首次需要时拷贝
 };
 
 // 简单的字符串 HashMap（链式散列），用于 CPU 抽样折叠栈
 // use external smap
 
-static struct callpath_node*
-callpath_node_create() {
-    struct callpath_node* node = (struct callpath_node*)pmalloc(sizeof(*node));
+// callpath_node 内联存放在 icallpath 节点里，随树一起分配和释放
+static void
+callpath_node_init(struct callpath_node* node) {
     node->parent = NULL;
     node->source = NULL;
     node->name = NULL;
+    node->sym = NULL;
     node->line = 0;
     node->depth = 0;
     node->last_ret_time = 0;
-    node->call_count = 0;
-    node->real_cost = 0;
-    node->cpu_samples = 0;
-    node->alloc_bytes = 0;
-    node->free_bytes = 0;
-    node->alloc_times = 0;
-    node->free_times = 0;
-    node->realloc_times = 0;
-    return node;
+    node->frame_id = 0;
+    node->list_next = NULL;
+    memset(node->stat, 0, sizeof(node->stat));
+    node->fold_real = 0;
+    node->fold_comp = 0;
+}
+
+/*
+hook 开销补偿：每个子孙调用都给祖先帧的 real_cost 带来约 hook_overhead 的额外耗时（call + ret 两次 hook），
+inclusive 扣掉 child_calls * hook_overhead；self = inclusive - 各子节点 inclusive，
+相当于每个直接子调用扣一次。结果是 hook 时钟，导出时再 hook_ns。
+*/
+static inline uint64_t
+stat_comp_cost(const struct profile_context* ctx, const struct callpath_stat* st) {
+    uint64_t overhead = st->child_calls * ctx->hook_overhead;
+    return st->real_cost > overhead ? st->real_cost - overhead : 0;
+}
+
+static inline uint64_t
+node_comp_cost(const struct profile_context* ctx, struct callpath_node* node) {
+    return stat_comp_cost(ctx, node_stat(ctx, node));
 }
 
 static struct alloc_node*
-alloc_node_create() {
-    struct alloc_node* node = (struct alloc_node*)pmalloc(sizeof(*node));
+alloc_node_create(struct profile_context* context) {
+    struct alloc_node* node = (struct alloc_node*)pamalloc(context->arena, sizeof(*node));
     node->live_bytes = 0;
+    node->live_times = 0;
     node->path = NULL;
     return node;
 }
@@ -392,80 +1013,178 @@ static void _init_dump_call_path_arg(struct dump_call_path_arg* arg, struct prof
 }
 
 struct sum_root_stat_arg {
+    const struct profile_context* pcontext;
     uint64_t real_cost_sum;
+    uint64_t comp_cost_sum;
+    uint64_t child_calls_sum;
 };
 
-static void _init_sum_root_stat_arg(struct sum_root_stat_arg* arg) {
+static void _init_sum_root_stat_arg(struct sum_root_stat_arg* arg, const struct profile_context* pcontext) {
+    arg->pcontext = pcontext;
     arg->real_cost_sum = 0;
+    arg->comp_cost_sum = 0;
+    arg->child_calls_sum = 0;
 }
 
-static inline char*
-pstrdup(const char* s) {
-    if (!s) return NULL;
-    size_t n = strlen(s);
-    char* d = (char*)pmalloc(n + 1);
-    memcpy(d, s, n);
-    d[n] = '\0';
-    return d;
+static inline struct symbol_info*
+symbol_get(struct profile_context* context, uint32_t id) {
+    return context->symbol_dir[id >> SYMBOL_CHUNK_SHIFT][id & (SYMBOL_CHUNK_SIZE - 1)];
 }
 
-// free counters stored as smap values (uint64_t*)
-static void _free_counter_cb(const char* key, void* value, void* ud) {
-    (void)key; (void)ud;
-    if (value) pfree(value);
+// name 可能在 vm 线程上被 resolve_names_on_live_stack 替换，helper 线程通过这里读
+// pc 位置跟随所属函数的名字
+static inline const char*
+symbol_name(const struct symbol_info* si) {
+    if (si->func) si = si->func;
+    return __atomic_load_n(&si->name, __ATOMIC_ACQUIRE);
 }
 
-struct smap_dump_ctx {
-    lua_State* L;
-    size_t idx;
+static inline const char*
+callpath_node_name(const struct callpath_node* node) {
+    return node->sym ? symbol_name(node->sym) : node->name;
+}
+
+// 与 luaG_getfuncline 相同的算法：从不超过 pc 的最后一个绝对行号开始累加增量
+static int
+line_table_line(const struct line_table* lt, int pc) {
+    if (lt->sizelineinfo == 0 || pc >= lt->sizelineinfo) return lt->linedefined;
+    int basepc = -1;
+    int line = lt->linedefined;
+    int lo = 0, hi = lt->sizeabslineinfo - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (lt->abslineinfo[mid].pc <= pc) {
+            basepc = lt->abslineinfo[mid].pc;
+            line = lt->abslineinfo[mid].line;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    while (basepc++ < pc) {
+        line += lt->lineinfo[basepc];
+    }
+    return line;
+}
+
+// 导出用的行号：pc 位置换算成源码行，函数本身为 linedefined
+static inline int
+symbol_line(const struct symbol_info* si) {
+    if (si->func && si->func->lines) return line_table_line(si->func->lines, si->pc);
+    return si->line;
+}
+
+// 新建 symbol 并分配 frame id，name/source 由调用方填写
+static struct symbol_info*
+symbol_new(struct profile_context* context, uint64_t sym_key) {
+    uint32_t id = context->symbol_count;
+    if (id == SYMBOL_MAX) {
+        // 极端情况：id 用尽后复用最后一个 symbol，只影响归因
+        struct symbol_info* last = symbol_get(context, id - 1);
+        pmap_insert(context->symbol_map, sym_key, last);
+        return last;
+    }
+    struct symbol_info** chunk = context->symbol_dir[id >> SYMBOL_CHUNK_SHIFT];
+    if (!chunk) {
+        chunk = (struct symbol_info**)pmalloc(sizeof(struct symbol_info*) * SYMBOL_CHUNK_SIZE);
+        context->symbol_dir[id >> SYMBOL_CHUNK_SHIFT] = chunk;
+    }
+    struct symbol_info* si = (struct symbol_info*)pamalloc(context->arena, sizeof(struct symbol_info));
+    si->name = NULL;
+    si->source = NULL;
+    si->line = 0;
+    si->id = id;
+    si->pc = -1;
+    si->func = NULL;
+    si->lines = NULL;
+    chunk[id & (SYMBOL_CHUNK_SIZE - 1)] = si;
+    context->symbol_count = id + 1;
+    pmap_insert(context->symbol_map, sym_key, si);
+    return si;
+}
+
+/*
+折叠栈与 json 只按函数命名：抽样时的 pc 帧（cpu_sample_lines）换回所属函数的 frame id 再聚合，
+否则同一条 Lua 栈会按采到的 pc 拆成几行名字相同的栈。pc 只进 pprof 的行号。
+*/
+struct func_fold_arg {
+    struct profile_context* pcontext;
+    struct stackmap* out;
+    uint32_t* stack;
+    int cap;
 };
 
+static const uint32_t* _func_frames(struct func_fold_arg* arg, const uint32_t* frames, int depth) {
+    if (depth > arg->cap) {
+        arg->cap = depth > 256 ? depth : 256;
+        arg->stack = (uint32_t*)prealloc(arg->stack, sizeof(uint32_t) * arg->cap);
+    }
+    for (int i = 0; i < depth; ++i) {
+        struct symbol_info* si = symbol_get(arg->pcontext, frames[i]);
+        arg->stack[i] = si->func ? si->func->id : frames[i];
+    }
+    return arg->stack;
+}
+
+static void _func_fold_cb(const uint32_t* frames, int depth, uint64_t count, void* ud) {
+    struct func_fold_arg* arg = (struct func_fold_arg*)ud;
+    if (count == 0) return;
+    stackmap_add(arg->out, _func_frames(arg, frames, depth), depth, count);
+}
+
+static void _func_fold_n_cb(const uint32_t* frames, int depth, const uint64_t* values, void* ud) {
+    struct func_fold_arg* arg = (struct func_fold_arg*)ud;
+    stackmap_add_n(arg->out, _func_frames(arg, frames, depth), depth, values);
+}
+
+// 没有 pc 帧时原样返回 sm，否则返回聚合后的新表，调用方用 _func_fold_free 释放
+static struct stackmap* _func_fold(struct profile_context* pcontext, struct stackmap* sm) {
+    if (pcontext->cpu_sample_lines == SAMPLE_LINES_OFF
+        || (pcontext->cpu_mode != MODE_SAMPLE && pcontext->cpu_mode != MODE_COUNT_SAMPLE)) {
+        return sm;
+    }
+    int n = stackmap_nvalues(sm);
+    struct func_fold_arg arg = { .pcontext = pcontext, .stack = NULL, .cap = 0 };
+    if (n > 1) {
+        arg.out = stackmap_create_n(n);
+        stackmap_dump_n(sm, _func_fold_n_cb, &arg);
+    } else {
+        arg.out = stackmap_create();
+        stackmap_dump(sm, _func_fold_cb, &arg);
+    }
+    pfree(arg.stack);
+    return arg.out;
+}
+
+static inline void _func_fold_free(struct stackmap* folded, struct stackmap* sm) {
+    if (folded != sm) stackmap_free(folded);
+}
+
 struct fg_dump_ctx {
     luaL_Buffer* buf;
-    struct imap_context* symbol_map;
+    struct profile_context* context;
 };
 
-static void _fg_dump_cb(const char* key, void* value, void* ud) {
+static void _fg_dump_cb(const uint32_t* frames, int depth, uint64_t samples, void* ud) {
     struct fg_dump_ctx* ctx = (struct fg_dump_ctx*)ud;
     luaL_Buffer* b = ctx->buf;
-    uint64_t samples = value ? *(uint64_t*)value : 0;
     if (samples == 0) return;
-    const char* p = key;
-    char token[64];
-    size_t tlen = 0;
-    int first = 1;
-    while (1) {
-        char c = *p++;
-        if (c == ';' || c == '\0') {
-            token[tlen] = '\0';
-            void* fptr = NULL;
-            sscanf(token, "%p", &fptr);
-            uint64_t sym_key = (uint64_t)((uintptr_t)fptr);
-            struct symbol_info* si = (struct symbol_info*)imap_query(ctx->symbol_map, sym_key);
-            if (!first) luaL_addchar(b, ';');
-            if (si) {
-                char namebuf[512];
-                const char* nm = (si->name && si->name[0]) ? si->name : "anonymous";
-                const char* src = (si->source && si->source[0]) ? si->source : "(source)";
-                int ln = si->line;
-                int n = snprintf(namebuf, sizeof(namebuf)-1, "%s %s:%d", nm, src, ln);
-                if (n > 0) luaL_addlstring(b, namebuf, (size_t)n);
-            } else {
-                luaL_addlstring(b, token, tlen);
-            }
-            tlen = 0;
-            first = 0;
-            if (c == '\0') break;
-        } else {
-            if (tlen + 1 < sizeof(token)) token[tlen++] = c;
-        }
+    for (int i = 0; i < depth; ++i) {
+        struct symbol_info* si = symbol_get(ctx->context, frames[i]);
+        char namebuf[512];
+        const char* name = symbol_name(si);
+        const char* nm = (name && name[0]) ? name : "anonymous";
+        const char* src = (si->source && si->source[0]) ? si->source : "(source)";
+        int n = snprintf(namebuf, sizeof(namebuf)-1, "%s %s:%d", nm, src, si->line);
+        if (i > 0) luaL_addchar(b, ';');
+        if (n > 0) luaL_addlstring(b, namebuf, (size_t)n);
     }
     char tail[64];
     int m = snprintf(tail, sizeof(tail)-1, " %llu\n", (unsigned long long)samples);
     if (m > 0) luaL_addlstring(b, tail, (size_t)m);
 }
 
-/* write c_sample_map entries to file */
+/* write folded C stack entries to file */
 static void _cmap_write_cb(const char* key, void* value, void* ud) {
     FILE* fp = (FILE*)ud;
     if (!fp) return;
@@ -475,136 +1194,394 @@ static void _cmap_write_cb(const char* key, void* value, void* ud) {
 }
 
 /* ---- Dump helpers (refactor) ---- */
-static void fold_c_tls_samples(struct profile_context* context) {
-    if (!context || !context->c_sample_map) return;
-    unsigned cap = C_RB_CAP;
-    for (unsigned i = 0; i < cap; ++i) {
-        c_sample_t* cs = &g_c_rb[i];
-        if (cs->depth == 0) continue;
-        char keybuf[4096];
-        size_t kp = 0;
-        /* choose start index (from leaf side): skip frames belonging to our module or vdso/sig trampolines */
-        int start_idx_leaf = 0;
-        for (int d = 0; d < cs->depth; ++d) { /* leaf -> root scan to find first non-internal leaf */
-            Dl_info info;
-            const char* so = NULL;
-            const char* name = NULL;
-            if (dladdr((void*)cs->pcs[d], &info)) {
-                so = info.dli_fname;
-                name = info.dli_sname;
-            }
-            const char* base = so ? strrchr(so, '/') : NULL;
-            base = base ? base + 1 : so;
-            int is_self = (base && g_self_module[0] && strcmp(base, g_self_module) == 0);
-            int is_vdso = (base && strstr(base, "linux-vdso") != NULL);
-            int is_sigret = (name && (strstr(name, "__restore_rt") || strstr(name, "rt_sigreturn")));
-            if (!(is_self || is_vdso || is_sigret)) {
-                start_idx_leaf = d;
-                break;
-            }
-        }
-        /* build root->leaf order for FlameGraph (reverse from depth-1 down to start_idx_leaf) */
-        for (int d = cs->depth - 1; d >= start_idx_leaf; --d) {
-            Dl_info info;
-            const char* name = NULL;
-            const char* so = NULL;
-            if (dladdr((void*)cs->pcs[d], &info)) {
-                if (info.dli_sname && info.dli_sname[0]) name = info.dli_sname;
-                if (info.dli_fname && info.dli_fname[0]) so = info.dli_fname;
-            }
-            /* build display name */
-            char namebuf[384];
-            if (name && name[0]) {
-                /* module!symbol+offset */
-                uintptr_t baseaddr = info.dli_fbase ? (uintptr_t)info.dli_fbase : 0;
-                uintptr_t off = baseaddr ? (uintptr_t)cs->pcs[d] - baseaddr : 0;
-                const char* modbase = so ? (strrchr(so, '/') ? strrchr(so, '/') + 1 : so) : "unknown";
-                snprintf(namebuf, sizeof(namebuf), "%s!%s+0x%lx", modbase, name, (unsigned long)off);
-            } else if (so && so[0]) {
-                /* basename(so)+offset */
-                const char* base = strrchr(so, '/');
-                base = base ? base + 1 : so;
-                uintptr_t baseaddr = info.dli_fbase ? (uintptr_t)info.dli_fbase : 0;
-                uintptr_t off = baseaddr ? (uintptr_t)cs->pcs[d] - baseaddr : (uintptr_t)cs->pcs[d];
-                snprintf(namebuf, sizeof(namebuf), "%s+0x%lx", base, (unsigned long)off);
-            } else {
-                char hex[2 + sizeof(uintptr_t) * 2 + 1];
-                size_t hn = _hex_ptr(cs->pcs[d], hex);
-                hex[hn] = '\0';
-                snprintf(namebuf, sizeof(namebuf), "%s", hex);
-            }
-            size_t nlen = strlen(namebuf);
-            if (kp + nlen + 1 >= sizeof(keybuf)) break;
-            if (kp > 0) keybuf[kp++] = ';';
-            memcpy(keybuf + kp, namebuf, nlen);
-            kp += nlen;
-        }
-        keybuf[kp] = '\0';
-        if (kp > 0) {
-            uint64_t* cnt = (uint64_t*)smap_get(context->c_sample_map, keybuf);
-            if (!cnt) {
-                char* keydup = pstrdup(keybuf);
-                cnt = (uint64_t*)pmalloc(sizeof(uint64_t));
-                *cnt = 0;
-                smap_set(context->c_sample_map, keydup, cnt);
-            }
-            (*cnt)++;
-        }
-        /* do not clear here; allow other consumers (e.g. raw writer) to read; clear once after both done */
+static struct psym* _symbolizer(struct profile_context* context) {
+    if (!context->symbolizer) {
+        context->symbolizer = psym_create();
     }
+    return context->symbolizer;
 }
 
-static void write_c_samples_file(struct profile_context* context, const char* path) {
-    if (!context || !context->c_sample_map || !path) return;
-    FILE* fp = fopen(path, "w");
-    if (!fp) return;
-    smap_iterate(context->c_sample_map, _cmap_write_cb, fp);
+// 信号处理器自身、vdso 与 sigreturn 跳板不计入 C 栈
+static bool _is_internal_frame(const struct psym_frame* f) {
+    if (g_self_module[0] && strcmp(f->module, g_self_module) == 0) return true;
+    if (strstr(f->module, "vdso") != NULL) return true;
+    return f->name && (strstr(f->name, "__restore_rt") || strstr(f->name, "rt_sigreturn"));
+}
+
+// 折叠栈里的帧名：module!function，找不到符号时为 module+0x偏移
+static int _c_frame_name(const struct psym_frame* f, char* buf, size_t size) {
+    if (f->name) {
+        return snprintf(buf, size, "%s!%s", f->module, f->name);
+    }
+    return snprintf(buf, size, "%s+0x%lx", f->module, (unsigned long)f->offset);
+}
+
+static uint32_t _c_pc_id(c_sampler_t* s, struct psym* sym, uintptr_t pc) {
+    uintptr_t id = (uintptr_t)pmap_query(s->pc_ids, (uint64_t)pc);
+    if (id) return (uint32_t)(id - 1);
+    if (s->pc_count == s->pc_cap) {
+        s->pc_cap = s->pc_cap ? s->pc_cap * 2 : 1024;
+        s->pcs = (uintptr_t*)prealloc(s->pcs, s->pc_cap * sizeof(uintptr_t));
+        s->syms = (c_pc_sym_t*)prealloc(s->syms, s->pc_cap * sizeof(c_pc_sym_t));
+    }
+    const struct psym_frame* f = psym_lookup(sym, pc);
+    s->pcs[s->pc_count] = pc;
+    s->syms[s->pc_count].frame = f;
+    s->syms[s->pc_count].path = psym_module_path(sym, f->module);
+    pmap_insert(s->pc_ids, (uint64_t)pc, (void*)(uintptr_t)(s->pc_count + 1));
+    return s->pc_count++;
+}
+
+static inline uint64_t _c_buf_get(const c_sample_buf_t* buf, uint32_t* p) {
+    uint64_t v = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+        b = buf->data[(*p)++ & (C_BUF_SIZE - 1)];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while ((b & 0x80) && shift < 64);
+    return v;
+}
+
+/* 解码字节环并累加到 stacks，新地址顺带符号化；只在聚合线程上调用 */
+static void c_sampler_drain(c_sampler_t* s, struct psym* sym) {
+    c_sample_buf_t* buf = &s->buf;
+    uint32_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = buf->tail;
+    uint32_t ids[C_MAX_FRAMES];
+    while (tail != head) {
+        int depth = (int)_c_buf_get(buf, &tail);
+        uintptr_t pc = 0;
+        for (int i = 0; i < depth; ++i) {
+            uint64_t z = _c_buf_get(buf, &tail);
+            pc += (uintptr_t)((z >> 1) ^ -(z & 1));
+            if (i < C_MAX_FRAMES) ids[i] = _c_pc_id(s, sym, pc);
+        }
+        if (depth > C_MAX_FRAMES) depth = C_MAX_FRAMES;
+        if (depth > 0) stackmap_add(s->stacks, ids, depth, 1);
+    }
+    __atomic_store_n(&buf->tail, tail, __ATOMIC_RELEASE);
+    s->dropped += __atomic_exchange_n(&buf->dropped, 0, __ATOMIC_RELAXED);
+}
+
+static void _c_copy_cb(const uint32_t* frames, int depth, uint64_t count, void* ud) {
+    stackmap_add((struct stackmap*)ud, frames, depth, count);
+}
+
+static c_sample_copy_t* c_sampler_copy(const c_sampler_t* s) {
+    c_sample_copy_t* c = (c_sample_copy_t*)pmalloc(sizeof(c_sample_copy_t));
+    c->stacks = stackmap_create();
+    stackmap_dump(s->stacks, _c_copy_cb, c->stacks);
+    c->pc_count = s->pc_count;
+    c->pcs = (uintptr_t*)pmalloc((s->pc_count + 1) * sizeof(uintptr_t));
+    c->syms = (c_pc_sym_t*)pmalloc((s->pc_count + 1) * sizeof(c_pc_sym_t));
+    if (s->pc_count > 0) {
+        memcpy(c->pcs, s->pcs, s->pc_count * sizeof(uintptr_t));
+        memcpy(c->syms, s->syms, s->pc_count * sizeof(c_pc_sym_t));
+    }
+    c->dropped = s->dropped;
+    return c;
+}
+
+static void c_sample_copy_free(c_sample_copy_t* c) {
+    if (!c) return;
+    stackmap_free(c->stacks);
+    pfree(c->pcs);
+    pfree(c->syms);
+    pfree(c);
+}
+
+/*
+后台聚合线程：有 c_sampler 登记时运行，最后一个注销时由注销方 join，之后 so 可以被安全卸载；psym 归它所有，随它释放。
+处理某个 c_sampler 时放开 g_agg_lock，用 g_agg_busy 标记，c_sampler_stop 摘下它之后等标记清掉再释放。
+*/
+static pthread_mutex_t g_agg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_agg_cond = PTHREAD_COND_INITIALIZER;    /* 唤醒聚合线程 */
+static pthread_cond_t g_agg_idle = PTHREAD_COND_INITIALIZER;    /* 聚合线程处理完一个 c_sampler */
+static c_sampler_t* g_agg_samplers = NULL;
+static c_sampler_t* g_agg_busy = NULL;
+static uint32_t g_agg_round = 0;
+static bool g_agg_running = false;
+static pthread_t g_agg_thread;
+static uint32_t g_agg_gen = 0;      /* 启动聚合线程时加一；最后一个 c_sampler 注销时再加一，让它退出 */
+
+static bool _agg_flush_pending(void) {
+    for (c_sampler_t* s = g_agg_samplers; s; s = s->next) {
+        if (s->flush) return true;
+    }
+    return false;
+}
+
+static void* sample_agg_main(void* ud) {
+    uint32_t gen = (uint32_t)(uintptr_t)ud;
+    struct psym* sym = psym_create();
+    pthread_mutex_lock(&g_agg_lock);
+    while (gen == g_agg_gen) {
+        // start 之后 require 的 C 模块在这里补上规则；模块集合没变时只读一次计数
+        pthread_mutex_unlock(&g_agg_lock);
+        punwind_load();
+        pthread_mutex_lock(&g_agg_lock);
+        if (gen != g_agg_gen) break;
+        uint32_t round = ++g_agg_round;
+        for (;;) {
+            // 处理期间链表可能变化，每次从头找本轮还没处理的
+            c_sampler_t* s = g_agg_samplers;
+            while (s && s->agg_round == round) s = s->next;
+            if (!s) break;
+            s->agg_round = round;
+            bool flush = s->flush;
+            g_agg_busy = s;
+            pthread_mutex_unlock(&g_agg_lock);
+            c_sampler_drain(s, sym);
+            c_sample_copy_t* copy = flush ? c_sampler_copy(s) : NULL;
+            pthread_mutex_lock(&g_agg_lock);
+            g_agg_busy = NULL;
+            if (flush) {
+                s->copy = copy;
+                s->flush = false;
+            }
+            pthread_cond_broadcast(&g_agg_idle);
+        }
+        if (_agg_flush_pending()) continue;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += SAMPLE_AGG_INTERVAL_MS * 1000000L;
+        if (ts.tv_nsec >= NANOSEC) {
+            ts.tv_sec++;
+            ts.tv_nsec -= NANOSEC;
+        }
+        pthread_cond_timedwait(&g_agg_cond, &g_agg_lock, &ts);
+    }
+    pthread_mutex_unlock(&g_agg_lock);
+    psym_free(sym);
+    return NULL;
+}
+
+static void c_sampler_free(c_sampler_t* s) {
+    stackmap_free(s->stacks);
+    pmap_free(s->pc_ids);
+    pfree(s->pcs);
+    pfree(s->syms);
+    c_sample_copy_free(s->copy);
+    pfree(s);
+}
+
+// 调用方持有 g_agg_lock
+static void _agg_unlink(c_sampler_t* s) {
+    for (c_sampler_t** pp = &g_agg_samplers; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+}
+
+static c_sampler_t* c_sampler_start(void) {
+    c_sampler_t* s = (c_sampler_t*)pmalloc(sizeof(c_sampler_t));
+    if (!s) return NULL;
+    s->buf.head = 0;
+    s->buf.tail = 0;
+    s->buf.dropped = 0;
+    s->stacks = stackmap_create();
+    s->pc_ids = pmap_create();
+    s->pcs = NULL;
+    s->syms = NULL;
+    s->pc_count = 0;
+    s->pc_cap = 0;
+    s->dropped = 0;
+    s->agg_round = 0;
+    s->flush = false;
+    s->copy = NULL;
+    pthread_mutex_lock(&g_agg_lock);
+    s->next = g_agg_samplers;
+    g_agg_samplers = s;
+    if (!g_agg_running) {
+        // 聚合线程不处理 profiler 的采样信号
+        pthread_t tid;
+        sigset_t block, old;
+        sigemptyset(&block);
+        if (g_prof_signo) sigaddset(&block, g_prof_signo);
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        int err = pthread_create(&tid, NULL, sample_agg_main, (void*)(uintptr_t)++g_agg_gen);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err != 0) {
+            // 只有聚合线程消费字节环，起不来就不抽 C 栈
+            printf("luaprofile: start sample aggregation thread fail: %s\n", strerror(err));
+            _agg_unlink(s);
+            pthread_mutex_unlock(&g_agg_lock);
+            c_sampler_free(s);
+            return NULL;
+        }
+        g_agg_thread = tid;
+        g_agg_running = true;
+    }
+    pthread_mutex_unlock(&g_agg_lock);
+    return s;
+}
+
+// 调用前信号处理器已经不会再写 s
+static void c_sampler_stop(c_sampler_t* s) {
+    pthread_mutex_lock(&g_agg_lock);
+    _agg_unlink(s);
+    while (g_agg_busy == s) {
+        pthread_cond_wait(&g_agg_idle, &g_agg_lock);
+    }
+    bool last = g_agg_running && g_agg_samplers == NULL;
+    pthread_t tid = g_agg_thread;
+    if (last) {
+        g_agg_running = false;
+        g_agg_gen++;
+    }
+    pthread_cond_signal(&g_agg_cond);
+    pthread_mutex_unlock(&g_agg_lock);
+    if (last) {
+        pthread_join(tid, NULL);
+    }
+    c_sampler_free(s);
+}
+
+/*
+dump 前请求聚合线程取完剩余记录并复制一份，返回的拷贝用 c_sample_copy_free 释放。
+拷贝里的符号指向聚合线程的 psym：本线程的 c_sampler 在 stop 之前一直登记着，聚合线程不会退出。
+*/
+static c_sample_copy_t* c_sampler_acquire(struct profile_context* context) {
+    c_sampler_t* s = context->c_sampler;
+    if (!s) return NULL;
+    pthread_mutex_lock(&g_agg_lock);
+    s->flush = true;
+    pthread_cond_signal(&g_agg_cond);
+    while (s->flush) {
+        pthread_cond_wait(&g_agg_idle, &g_agg_lock);
+    }
+    c_sample_copy_t* copy = s->copy;
+    s->copy = NULL;
+    pthread_mutex_unlock(&g_agg_lock);
+    return copy;
+}
+
+struct c_fold_ctx {
+    const c_sample_copy_t* samples;
+    smap_t* folded;
+    struct parena* arena;
+};
+
+/* fold one aggregated C stack into folded names; addresses were symbolized by the aggregation thread */
+static void _c_fold_cb(const uint32_t* frames, int depth, uint64_t count, void* ud) {
+    struct c_fold_ctx* ctx = (struct c_fold_ctx*)ud;
+    const c_pc_sym_t* syms = ctx->samples->syms;
+    char keybuf[4096];
+    size_t kp = 0;
+    /* leaf -> root scan to find first non-internal leaf */
+    int start_idx_leaf = 0;
+    for (int d = 0; d < depth; ++d) {
+        if (!_is_internal_frame(syms[frames[d]].frame)) {
+            start_idx_leaf = d;
+            break;
+        }
+    }
+    /* build root->leaf order for FlameGraph */
+    for (int d = depth - 1; d >= start_idx_leaf; --d) {
+        char namebuf[384];
+        int nlen = _c_frame_name(syms[frames[d]].frame, namebuf, sizeof(namebuf));
+        if (nlen <= 0) continue;
+        if (nlen >= (int)sizeof(namebuf)) nlen = (int)sizeof(namebuf) - 1;
+        if (kp + (size_t)nlen + 1 >= sizeof(keybuf)) break;
+        if (kp > 0) keybuf[kp++] = ';';
+        memcpy(keybuf + kp, namebuf, (size_t)nlen);
+        kp += (size_t)nlen;
+    }
+    keybuf[kp] = '\0';
+    if (kp == 0) return;
+    uint64_t* cnt = (uint64_t*)smap_get(ctx->folded, keybuf);
+    if (!cnt) {
+        cnt = (uint64_t*)pamalloc(ctx->arena, sizeof(uint64_t));
+        *cnt = 0;
+        smap_set(ctx->folded, keybuf, cnt);
+    }
+    *cnt += count;
+}
+
+/* 符号化后的折叠栈；不同地址可能折叠成同一个函数栈，所以先聚合再写 */
+static void write_c_samples_file(const c_sample_copy_t* samples, const char* path) {
+    if (!samples || !path) return;
+    FILE* fp = fopen(path, "w");
+    if (!fp) return;
+    struct c_fold_ctx ctx;
+    ctx.samples = samples;
+    ctx.arena = parena_create();
+    ctx.folded = smap_create(2048, ctx.arena);
+    stackmap_dump(samples->stacks, _c_fold_cb, &ctx);
+    smap_iterate(ctx.folded, _cmap_write_cb, fp);
+    smap_free(ctx.folded);
+    parena_free(ctx.arena);
     fclose(fp);
 }
 
 static void push_lua_folded_samples(lua_State* L, struct profile_context* context) {
     luaL_Buffer b;
     luaL_buffinit(L, &b);
-    struct fg_dump_ctx fctx = { .buf = &b, .symbol_map = context->symbol_map };
-    smap_iterate(context->sample_map, _fg_dump_cb, &fctx);
+    struct fg_dump_ctx fctx = { .buf = &b, .context = context };
+    struct stackmap* folded = _func_fold(context, context->sample_map);
+    stackmap_dump(folded, _fg_dump_cb, &fctx);
+    _func_fold_free(folded, context->sample_map);
     luaL_pushresult(&b);
 }
 
-static void write_c_samples_raw(const char* path) {
-    if (!path) return;
+/*
+raw 输出：开头是 "# module <name> <path>" 行，之后每行一条聚合后的栈，root->leaf 的 module!0x偏移，行尾是样本数。
+偏移相对模块加载基址，tools/psym 用开头的模块路径离线符号化。
+*/
+struct c_raw_ctx {
+    const c_sample_copy_t* samples;
+    FILE* fp;
+};
+
+static void _c_raw_cb(const uint32_t* frames, int depth, uint64_t count, void* ud) {
+    struct c_raw_ctx* ctx = (struct c_raw_ctx*)ud;
+    for (int d = depth - 1; d >= 0; --d) {
+        const struct psym_frame* f = ctx->samples->syms[frames[d]].frame;
+        fprintf(ctx->fp, "%s!0x%lx", f->module, (unsigned long)f->offset);
+        if (d > 0) fputc(';', ctx->fp);
+    }
+    fprintf(ctx->fp, " %llu\n", (unsigned long long)count);
+}
+
+static void write_c_samples_raw(const c_sample_copy_t* samples, const char* path) {
+    if (!samples || !path) return;
     FILE* fp = fopen(path, "w");
     if (!fp) return;
-    unsigned cap = C_RB_CAP;
-    for (unsigned i = 0; i < cap; ++i) {
-        c_sample_t* cs = &g_c_rb[i];
-        if (cs->depth == 0) continue;
-        size_t written = 0;
-        /* raw output: module!0xoffset chain in root->leaf order */
-        for (int d = cs->depth - 1; d >= 0; --d) {
-            Dl_info info;
-            const char* so = NULL;
-            if (dladdr((void*)cs->pcs[d], &info)) {
-                if (info.dli_fname && info.dli_fname[0]) so = info.dli_fname;
-            }
-            const char* modbase = "unknown";
-            if (so && so[0]) {
-                const char* base = strrchr(so, '/');
-                modbase = base ? base + 1 : so;
-            }
-            uintptr_t baseaddr = info.dli_fbase ? (uintptr_t)info.dli_fbase : 0;
-            uintptr_t off = baseaddr ? (uintptr_t)cs->pcs[d] - baseaddr : (uintptr_t)cs->pcs[d];
-            fprintf(fp, "%s!0x%lx", modbase, (unsigned long)off);
-            written++;
-            if (d > 0) fputc(';', fp);
-        }
-        if (written > 0) fputc('\n', fp);
+    struct parena* arena = parena_create();
+    smap_t* seen = smap_create(64, arena);
+    for (uint32_t i = 0; i < samples->pc_count; ++i) {
+        const struct psym_frame* f = samples->syms[i].frame;
+        if (smap_get(seen, f->module)) continue;
+        smap_set(seen, f->module, (void*)1);
+        const char* mpath = samples->syms[i].path;
+        if (mpath) fprintf(fp, "# module %s %s\n", f->module, mpath);
     }
+    smap_free(seen);
+    parena_free(arena);
+    struct c_raw_ctx ctx = { .samples = samples, .fp = fp };
+    stackmap_dump(samples->stacks, _c_raw_cb, &ctx);
     fclose(fp);
 }
 
 /* gperftools legacy cpuprofile format writer */
-static void write_c_profile_pprof(struct profile_context* context, const char* path) {
-    if (!path) return;
+static void _c_legacy_cb(const uint32_t* frames, int depth, uint64_t count, void* ud) {
+    struct c_raw_ctx* ctx = (struct c_raw_ctx*)ud;
+    uintptr_t rec[2 + C_MAX_FRAMES];
+    rec[0] = (uintptr_t)count;
+    rec[1] = (uintptr_t)depth;
+    /* leaf-first as stored: pcs[0]=ip, pcs[1]=caller,... */
+    for (int d = 0; d < depth; ++d) {
+        rec[2 + d] = ctx->samples->pcs[frames[d]];
+    }
+    fwrite(rec, sizeof(uintptr_t), 2 + (size_t)depth, ctx->fp);
+}
+
+static void write_c_profile_pprof(struct profile_context* context, const c_sample_copy_t* samples, const char* path) {
+    if (!samples || !path) return;
     FILE* fp = fopen(path, "wb");
     if (!fp) return;
 
@@ -621,21 +1598,9 @@ static void write_c_profile_pprof(struct profile_context* context, const char* p
     hdr[4] = (uintptr_t)0;         /* padding */
     fwrite(hdr, sizeof(uintptr_t), 5, fp);
 
-    /* records: for each TLS sample write [count, depth, pcs...] with pcs leaf-first */
-    unsigned cap = C_RB_CAP;
-    for (unsigned i = 0; i < cap; ++i) {
-        c_sample_t* cs = &g_c_rb[i];
-        if (cs->depth == 0) continue;
-        uintptr_t count = (uintptr_t)1;
-        uintptr_t depth = (uintptr_t)cs->depth;
-        fwrite(&count, sizeof(uintptr_t), 1, fp);
-        fwrite(&depth, sizeof(uintptr_t), 1, fp);
-        /* leaf-first as stored: pcs[0]=ip, pcs[1]=caller,... */
-        for (uint16_t d = 0; d < cs->depth; ++d) {
-            uintptr_t pc = (uintptr_t)cs->pcs[d];
-            fwrite(&pc, sizeof(uintptr_t), 1, fp);
-        }
-    }
+    /* records: for each aggregated stack write [count, depth, pcs...] with pcs leaf-first */
+    struct c_raw_ctx ctx = { .samples = samples, .fp = fp };
+    stackmap_dump(samples->stacks, _c_legacy_cb, &ctx);
 
     /* trailer: 0,1,0 */
     uintptr_t tr[3];
@@ -658,62 +1623,68 @@ static void write_c_profile_pprof(struct profile_context* context, const char* p
     fclose(fp);
 }
 
-static void clear_c_tls_samples(void) {
-    unsigned cap = C_RB_CAP;
-    for (unsigned i = 0; i < cap; ++i) {
-        g_c_rb[i].depth = 0;
-    }
-}
-
 static struct profile_context *
 profile_create() {
     struct profile_context* context = (struct profile_context*)pmalloc(sizeof(*context));
     
+    context->arena = parena_create();
     context->start_time = 0;
     context->is_ready = false;
-    context->cs_map = imap_create();
-    context->alloc_map = imap_create();
-    context->symbol_map = imap_create();
-    context->sample_map = smap_create(2048);
-    context->c_sample_map = smap_create(2048);
+    context->cs_map = pmap_create();
+    context->alloc_map = pmap_create();
+    context->symbol_map = pmap_create();
+    context->sample_map = stackmap_create();
+    context->c_sampler = NULL;
+    context->symbolizer = NULL;
     context->callpath = NULL;
     context->cur_cs = NULL;
+    context->cs_slots = NULL;
+    context->cs_slot_count = 0;
+    context->cs_slot_cap = 0;
+    context->cs_free_slots = NULL;
+    context->cs_free_count = 0;
+    context->cs_free_cap = 0;
+    context->cs_live = 0;
+    context->cs_reclaimed = 0;
+    context->call_overflow = 0;
+    context->session = 0;
     context->running_in_hook = false;
     context->last_alloc_f = NULL;
     context->last_alloc_ud = NULL;
     context->cpu_mode = MODE_PROFILE;       // default: profile
     context->mem_mode = MODE_PROFILE;       // default: profile
     context->cpu_sample_hz = DEFAULT_CPU_SAMPLE_HZ; // default: hz for sample
+    context->cpu_sample_instr = DEFAULT_CPU_SAMPLE_INSTR;
+    context->cpu_clock_wall = false;
+    context->mem_sample_bytes = DEFAULT_MEM_SAMPLE_BYTES;
+    context->mem_sample_remaining = 0;
     context->rng_state = 0;
-    context->profile_cost_ns = 0;
+    context->use_tsc = false;
+    context->profile_cost = 0;
+    context->hook_overhead = 0;
+    context->symbol_dir = (struct symbol_info***)pcalloc(SYMBOL_DIR_SIZE, sizeof(struct symbol_info**));
+    context->symbol_count = 0;
+    context->mem_symbols = 0;
+    context->window_ns = 0;
+    context->window_start = 0;
+    context->window_seq = 0;
+    context->windows = NULL;
+    context->window_cap = 0;
+    context->window_head = 0;
+    context->window_used = 0;
+    context->window_dir = NULL;
+    context->worker = NULL;
+    context->stat_epoch = 0;
+    context->node_list = NULL;
+    pthread_mutex_init(&context->fold_lock, NULL);
+    context->fold_out = NULL;
+    context->fold_head = NULL;
+    context->fold_epoch = 0;
     return context;
 }
 
-static void
-_ob_free_call_state(uint64_t key, void* value, void* ud) {
-    pfree(value);
-}
-
-static void
-_ob_free_symbol(uint64_t key, void* value, void* ud) {
-    (void)key; (void)ud;
-    struct symbol_info* si = (struct symbol_info*)value;
-    if (si) {
-        if (si->name) pfree(si->name);
-        if (si->source) pfree(si->source);
-        pfree(si);
-    }
-}
-
-static void
-_ob_free_alloc_node(uint64_t key, void* value, void* ud) {
-    (void)key; (void)ud;
-    struct alloc_node* an = (struct alloc_node*)value;
-    if (an) {
-        pfree(an);
-    }
-}
-
+// call_state/symbol_info/alloc_node/smap entry 及计数器都在 arena 里，
+// 这里只释放各容器自身的槽位数组，耗时与记录的对象个数无关
 static void
 profile_free(struct profile_context* context) {
     if (context->callpath) {
@@ -721,36 +1692,51 @@ profile_free(struct profile_context* context) {
         context->callpath = NULL;
     }
 
-    imap_dump(context->cs_map, _ob_free_call_state, NULL);
-    imap_free(context->cs_map);
-    imap_dump(context->symbol_map, _ob_free_symbol, NULL);
-    imap_free(context->symbol_map);
-    if (context->sample_map) {
-        // free smap entries' values (uint64_t*)
-        smap_iterate(context->sample_map, _free_counter_cb, NULL);
-        smap_free(context->sample_map);
+    pmap_free(context->cs_map);
+    for (uint32_t i = 0; i < context->cs_slot_count; ++i) {
+        if (context->cs_slots[i]) pfree(context->cs_slots[i]->call_list);
+    }
+    pfree(context->cs_slots);
+    pfree(context->cs_free_slots);
+    pmap_free(context->symbol_map);
+    stackmap_free(context->sample_map);
+    for (uint32_t i = 0; i < SYMBOL_DIR_SIZE && context->symbol_dir[i]; ++i) {
+        pfree(context->symbol_dir[i]);
     }
-    if (context->c_sample_map) {
-        smap_iterate(context->c_sample_map, _free_counter_cb, NULL);
-        smap_free(context->c_sample_map);
+    pfree(context->symbol_dir);
+    psym_free(context->symbolizer);
+    pmap_free(context->alloc_map);
+    for (int i = 0; i < context->window_used; ++i) {
+        int idx = (context->window_head - 1 - i + context->window_cap) % context->window_cap;
+        stackmap_free(context->windows[idx].cpu_samples);
+        stackmap_free(context->windows[idx].stacks);
     }
-    imap_dump(context->alloc_map, _ob_free_alloc_node, NULL);
-    imap_free(context->alloc_map);
+    pfree(context->windows);
+    pthread_mutex_destroy(&context->fold_lock);
+    parena_free(context->arena);
     pfree(context);
 }
 
+// 影子栈按需倍增；到达 MAX_CALL_SIZE 返回 NULL，由调用方降级为只计数
 static inline struct call_frame *
 push_callframe(struct call_state* cs) {
-    if(cs->top >= MAX_CALL_SIZE) {
-        assert(false);
+    if (cs->top >= cs->cap) {
+        if (cs->cap >= MAX_CALL_SIZE) {
+            return NULL;
+        }
+        int cap = cs->cap ? cs->cap * 2 : INIT_CALL_SIZE;
+        if (cap > MAX_CALL_SIZE) cap = MAX_CALL_SIZE;
+        cs->call_list = (struct call_frame*)prealloc(cs->call_list, sizeof(struct call_frame) * cap);
+        cs->cap = cap;
     }
+    if (cs->top >= cs->peak) cs->peak = cs->top + 1;
     return &cs->call_list[cs->top++];
 }
 
 static inline struct call_frame *
 pop_callframe(struct call_state* cs) {
     if(cs->top<=0) {
-        assert(false);
+        return NULL;
     }
     return &cs->call_list[--cs->top];
 }
@@ -765,26 +1751,224 @@ cur_callframe(struct call_state* cs) {
     return &cs->call_list[idx];
 }
 
+// registry 里放一个带 __gc 的 userdata 而不是 lightuserdata：
+// VM 没有 stop 就 lua_close 时由 __gc 收尾，同一地址上新建的 VM 不会命中旧 context
+struct profile_context_box {
+    struct profile_context* ctx;
+};
+
+static void profile_teardown(lua_State* L, struct profile_context* context);
+
 static inline struct profile_context *
 get_profile_context(lua_State* L) {
+    uint32_t gen = __atomic_load_n(&g_ctx_generation, __ATOMIC_ACQUIRE);
+    if (g_ctx_cache_g == (const void*)G(L) && g_ctx_cache_gen == gen) {
+        return g_ctx_cache;
+    }
     struct profile_context* ctx = NULL;
     lua_pushlightuserdata(L, &profile_context_key);
     lua_rawget(L, LUA_REGISTRYINDEX);
-    ctx = (struct profile_context*)lua_touserdata(L, -1);
-        lua_pop(L, 1);
+    struct profile_context_box* box = (struct profile_context_box*)lua_touserdata(L, -1);
+    ctx = box ? box->ctx : NULL;
+    lua_pop(L, 1);
+    g_ctx_cache_g = (const void*)G(L);
+    g_ctx_cache = ctx;
+    g_ctx_cache_gen = gen;
     return ctx;
 }
 
+static int _lcontext_gc(lua_State* L) {
+    struct profile_context_box* box = (struct profile_context_box*)lua_touserdata(L, 1);
+    struct profile_context* context = box->ctx;
+    if (context == NULL) {
+        return 0;   // 已经 stop 过
+    }
+    // 先摘掉：lua_close 里后续 finalizer 触发的 hook 拿到 NULL 后自行退出
+    box->ctx = NULL;
+    __atomic_add_fetch(&g_ctx_generation, 1, __ATOMIC_RELEASE);
+    profile_teardown(L, context);
+    return 0;
+}
+
 static void set_profile_context(lua_State* L, struct profile_context* ctx) {
     lua_pushlightuserdata(L, &profile_context_key);
-    lua_pushlightuserdata(L, (void*)ctx);
+    struct profile_context_box* box = (struct profile_context_box*)lua_newuserdatauv(L, sizeof(*box), 0);
+    box->ctx = ctx;
+    if (luaL_newmetatable(L, "luaprofile.context")) {
+        lua_pushcfunction(L, _lcontext_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
     lua_rawset(L, LUA_REGISTRYINDEX);
+    __atomic_add_fetch(&g_ctx_generation, 1, __ATOMIC_RELEASE);
 }
 
 static void unset_profile_context(lua_State* L) {
+    lua_pushlightuserdata(L, &profile_context_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    struct profile_context_box* box = (struct profile_context_box*)lua_touserdata(L, -1);
+    if (box) {
+        box->ctx = NULL;    // 解除 __gc，之后被回收时什么也不做
+    }
+    lua_pop(L, 1);
     lua_pushlightuserdata(L, &profile_context_key);
     lua_pushnil(L);
     lua_rawset(L, LUA_REGISTRYINDEX);
+    __atomic_add_fetch(&g_ctx_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+协程 -> call_state 的 O(1) 查找：协程的 LUA_EXTRASPACE 里存 tag = session << 32 | (slot + 1)，
+命中时直接取 cs_slots[slot] 并校验 cs->co == L，否则回退到 cs_map。
+extraspace 只在为 0 或带着本次 session 时才写，其他非 0 的值都当作应用自己的数据，这些协程一直走 cs_map。
+lua_newthread 会复制主线程的 extraspace，复制来的 tag 因 co 不匹配而失效，随后被覆盖。
+call_state 回收和 stop 时把仍是自己写的 tag 清零，下次 start 可以重新使用这些协程的 extraspace。
+*/
+_Static_assert(LUA_EXTRASPACE >= sizeof(uint64_t), "LUA_EXTRASPACE too small for call_state tag");
+
+static inline uint64_t
+_cs_tag(struct profile_context* context, struct call_state* cs) {
+    return ((uint64_t)context->session << 32) | ((uint64_t)cs->slot + 1);
+}
+
+static inline void
+_store_cs_tag(struct profile_context* context, lua_State* L, struct call_state* cs) {
+    uint64_t tag;
+    memcpy(&tag, lua_getextraspace(L), sizeof(tag));
+    if (tag == 0 || (uint32_t)(tag >> 32) == context->session) {
+        tag = _cs_tag(context, cs);
+        memcpy(lua_getextraspace(L), &tag, sizeof(tag));
+    }
+}
+
+static inline void
+_clear_cs_tag(struct profile_context* context, struct call_state* cs) {
+    uint64_t tag;
+    memcpy(&tag, lua_getextraspace(cs->co), sizeof(tag));
+    if (tag == _cs_tag(context, cs)) {
+        tag = 0;
+        memcpy(lua_getextraspace(cs->co), &tag, sizeof(tag));
+    }
+}
+
+static inline struct call_state*
+_lookup_call_state(struct profile_context* context, lua_State* L) {
+    uint64_t tag;
+    memcpy(&tag, lua_getextraspace(L), sizeof(tag));
+    if ((uint32_t)(tag >> 32) == context->session) {
+        uint32_t slot = (uint32_t)tag - 1;
+        if (slot < context->cs_slot_count) {
+            struct call_state* cs = context->cs_slots[slot];
+            if (cs && cs->co == L) {
+                return cs;
+            }
+        }
+    }
+    struct call_state* cs = (struct call_state*)pmap_query(context->cs_map, (uint64_t)((uintptr_t)L));
+    if (cs) {
+        _store_cs_tag(context, L, cs);
+    }
+    return cs;
+}
+
+static struct call_state*
+_new_call_state(struct profile_context* context, lua_State* L) {
+    struct call_state* cs = (struct call_state*)pamalloc(context->arena, sizeof(struct call_state));
+    cs->co = L;
+    cs->top = 0;
+    cs->cap = 0;
+    cs->overflow = 0;
+    cs->overflow_tail = false;
+    cs->peak = 0;
+    cs->empties = 0;
+    cs->call_list = NULL;
+    cs->leave_time = 0;
+    cs->co_cost = 0;
+    cs->calls = 0;
+    if (context->cs_free_count > 0) {
+        cs->slot = context->cs_free_slots[--context->cs_free_count];
+    } else {
+        if (context->cs_slot_count == context->cs_slot_cap) {
+            context->cs_slot_cap = context->cs_slot_cap ? context->cs_slot_cap * 2 : 64;
+            context->cs_slots = (struct call_state**)prealloc(context->cs_slots, sizeof(struct call_state*) * context->cs_slot_cap);
+        }
+        cs->slot = context->cs_slot_count++;
+    }
+    context->cs_slots[cs->slot] = cs;
+    context->cs_live++;
+    pmap_insert(context->cs_map, (uint64_t)((uintptr_t)L), cs);
+    _store_cs_tag(context, L, cs);
+    return cs;
+}
+
+static void
+_free_call_state(struct profile_context* context, struct call_state* cs) {
+    if (context->cur_cs == cs) {
+        context->cur_cs = NULL;
+    }
+    pmap_remove(context->cs_map, (uint64_t)((uintptr_t)cs->co));
+    _clear_cs_tag(context, cs);
+    context->cs_slots[cs->slot] = NULL;
+    if (context->cs_free_count == context->cs_free_cap) {
+        context->cs_free_cap = context->cs_free_cap ? context->cs_free_cap * 2 : 64;
+        context->cs_free_slots = (uint32_t*)prealloc(context->cs_free_slots, sizeof(uint32_t) * context->cs_free_cap);
+    }
+    context->cs_free_slots[context->cs_free_count++] = cs->slot;
+    context->cs_live--;
+    context->cs_reclaimed++;
+    pfree(cs->call_list);
+    pafree(context->arena, cs, sizeof(*cs));
+}
+
+/*
+协程被 gc 时回收它的 call_state。lua 5.4 的 luaE_freethread 以 sizeof(LX) 释放 (char*)L - LUA_EXTRASPACE，
+块首就是 extraspace，所以在真正释放前读出 tag 即可 O(1) 判断是不是我们跟踪的协程。
+extraspace 被应用占用（或主线程的 extraspace 未初始化，被 lua_newthread 复制过来）时 tag 不是我们的，退回 cs_map。
+*/
+struct lua_thread_block {
+    lu_byte     extra_[LUA_EXTRASPACE];
+    lua_State   l;
+};
+
+static inline void
+_reclaim_thread_if_need(struct profile_context* context, void* ptr, size_t osize) {
+    if (osize != sizeof(struct lua_thread_block)) {
+        return;
+    }
+    lua_State* co = &((struct lua_thread_block*)ptr)->l;
+    uint64_t tag;
+    memcpy(&tag, ptr, sizeof(tag));
+    struct call_state* cs = NULL;
+    if ((uint32_t)(tag >> 32) == context->session) {
+        uint32_t slot = (uint32_t)tag - 1;
+        if (slot < context->cs_slot_count) {
+            cs = context->cs_slots[slot];
+        }
+    } else if (context->cs_live > 0) {
+        cs = (struct call_state*)pmap_query(context->cs_map, (uint64_t)((uintptr_t)co));
+    }
+    if (cs && cs->co == co) {
+        _free_call_state(context, cs);
+    }
+}
+
+/*
+影子栈退空时计数，每 SHRINK_CALL_EPOCH 次退空看一次这一轮的最大深度：容量超过它的 4 倍才收缩到 2 倍。
+长期存活但多数时候很浅的协程不会一直占着一次深递归留下的大数组，反复深递归的协程也不会每次退空都 realloc。
+*/
+static inline void
+_shrink_call_state(struct call_state* cs) {
+    if (cs->top != 0 || ++cs->empties < SHRINK_CALL_EPOCH) {
+        return;
+    }
+    int want = INIT_CALL_SIZE;
+    while (want < cs->peak * 2) want *= 2;
+    if (cs->cap >= want * 2) {
+        cs->call_list = (struct call_frame*)prealloc(cs->call_list, sizeof(struct call_frame) * want);
+        cs->cap = want;
+    }
+    cs->peak = 0;
+    cs->empties = 0;
 }
 
 // --- Random gap generator (exponential/geometric) ---
@@ -797,49 +1981,76 @@ static inline uint64_t xorshift64(uint64_t* s) {
     return x;
 }
 
-static inline int next_exponential_gap(struct profile_context* ctx) {
-    // mean = ctx->cpu_sample_hz (instructions)
+// exponential draw with the given mean: floor(-ln(u) * mean)
+static inline double _exponential_draw(struct profile_context* ctx, double mean) {
     // u in (0,1], avoid 0
     uint64_t r = xorshift64(&ctx->rng_state);
     double u = ( (r >> 11) * (1.0 / 9007199254740992.0) ); // 53-bit to [0,1)
     if (u <= 0.0) u = 1e-12;
-    int gap = (int)floor(-log(u) * (double)ctx->cpu_sample_hz);
+    return floor(-log(u) * mean);
+}
+
+static inline int next_exponential_gap(struct profile_context* ctx) {
+    // mean = ctx->cpu_sample_instr (instructions)
+    int gap = (int)_exponential_draw(ctx, (double)ctx->cpu_sample_instr);
+    if (gap < 1) gap = 1;
+    return gap;
+}
+
+// 堆采样的字节间隔，均值为 mem_sample_bytes
+static inline int64_t next_exponential_bytes(struct profile_context* ctx) {
+    int64_t gap = (int64_t)_exponential_draw(ctx, (double)ctx->mem_sample_bytes);
     if (gap < 1) gap = 1;
     return gap;
 }
 
 static struct icallpath_context*
-get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, struct icallpath_context* pre_path, struct call_frame* frame) {
+callpath_root(struct profile_context* context) {
     if (!context->callpath) {
-        struct callpath_node* node = callpath_node_create();
+        context->callpath = icallpath_create(0, sizeof(struct callpath_node));
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(context->callpath);
+        callpath_node_init(node);
         node->name = "root";
         node->source = "root";
-        node->call_count = 1;
-        context->callpath = icallpath_create(0, node);
-    }
-    if (!pre_path) {
-        pre_path = context->callpath;
+        node->stat[0].call_count = 1;
+        node->stat[1].call_count = 1;
+        node->list_next = context->node_list;
+        context->node_list = node;
     }
+    return context->callpath;
+}
 
-    struct call_frame* cur_cf = frame;
-    uint64_t k = (uint64_t)((uintptr_t)cur_cf->prototype);
+static struct icallpath_context*
+callpath_child(struct profile_context* context, struct icallpath_context* pre_path, uint64_t k) {
     struct icallpath_context* cur_path = icallpath_get_child(pre_path, k);
     if (!cur_path) {
         struct callpath_node* path_parent = (struct callpath_node*)icallpath_getvalue(pre_path);
-        struct callpath_node* node = callpath_node_create();
-
+        cur_path = icallpath_add_child(pre_path, k);
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(cur_path);
+        callpath_node_init(node);
         node->parent = path_parent;
         node->depth = path_parent->depth + 1;
-        node->last_ret_time = 0;
-        node->real_cost = 0;
-        node->call_count = 0;
-        cur_path = icallpath_add_child(pre_path, k, node);
+        node->list_next = context->node_list;
+        context->node_list = node;
+    }
+    return cur_path;
+}
+
+static struct icallpath_context*
+get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, struct icallpath_context* pre_path, struct call_frame* frame) {
+    struct icallpath_context* root = callpath_root(context);
+    if (!pre_path) {
+        pre_path = root;
     }
 
+    struct call_frame* cur_cf = frame;
+    uint64_t k = (uint64_t)((uintptr_t)cur_cf->prototype);
+    struct icallpath_context* cur_path = callpath_child(context, pre_path, k);
+
     struct callpath_node* cur_node = (struct callpath_node*)icallpath_getvalue(cur_path);
     if (cur_node->name == NULL) {
         uint64_t sym_key = (uint64_t)((uintptr_t)cur_cf->prototype);
-        struct symbol_info* si = (struct symbol_info*)imap_query(context->symbol_map, sym_key);
+        struct symbol_info* si = (struct symbol_info*)pmap_query(context->symbol_map, sym_key);
         if (!si) {
             lua_getinfo(co, "nSl", far);
             const char* name = far->name;
@@ -863,33 +2074,71 @@ get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, s
                     }
                 } while(ret);
             }
-            si = (struct symbol_info*)pmalloc(sizeof(struct symbol_info));
-            si->name = pstrdup(name ? name : "null");
-            si->source = pstrdup(source ? source : "null");
+            si = symbol_new(context, sym_key);
+            si->name = pastrdup(context->arena, name ? name : "null");
+            si->source = pastrdup(context->arena, source ? source : "null");
             si->line = line;
-            imap_set(context->symbol_map, sym_key, si);
         }
         cur_node->name = si->name;
         cur_node->source = si->source;
         cur_node->line = si->line;
+        cur_node->frame_id = si->id;
     }
     
     return cur_path;
 }
 
 // 按路径更新节点（仅更新当前节点的 self 计数，父链累计推迟到 dump 聚合）
-static inline void _mem_update_on_path(struct callpath_node* node,
+static inline void _mem_update_on_path(struct profile_context* context, struct callpath_node* node,
     size_t alloc_bytes, uint64_t alloc_times, size_t free_bytes, uint64_t free_times, uint64_t realloc_times) {
     if (!node) return;
-    if (alloc_bytes) node->alloc_bytes += alloc_bytes;
-    if (alloc_times) node->alloc_times += alloc_times;
-    if (free_bytes) node->free_bytes += free_bytes;
-    if (free_times) node->free_times += free_times;
-    if (realloc_times) node->realloc_times += realloc_times;
+    struct callpath_stat* st = node_stat(context, node);
+    if (alloc_bytes) st->alloc_bytes += alloc_bytes;
+    if (alloc_times) st->alloc_times += alloc_times;
+    if (free_bytes) st->free_bytes += free_bytes;
+    if (free_times) st->free_times += free_times;
+    if (realloc_times) st->realloc_times += realloc_times;
+}
+
+static struct symbol_info* _snapshot_symbol(struct profile_context* context, const lua_frame_t* f);
+
+/*
+cpu = "sample" 不挂 call/ret hook，内存归因时直接读 g_prof_current_L 的 CallInfo 链：与信号处理器一样只做内存读取，
+在分配器里调用也安全。节点 key 与 get_frame_path 相同（Proto* 或 C 函数指针），名字先用快照 symbol 的占位名，
+下一次 drain_lua_snapshots 之后在安全点由 resolve_names_on_live_stack 补上。
+*/
+static struct callpath_node* _snapshot_leaf_node(struct profile_context* context) {
+    lua_State* L = g_prof_current_L;
+    if (!L) return NULL;
+    lua_snapshot_t snap;
+    int depth = fill_lua_snapshot(L, &snap);
+    if (depth == 0) return NULL;
+    struct icallpath_context* path = callpath_root(context);
+    for (int i = depth - 1; i >= 0; --i) {
+        const lua_frame_t* f = &snap.frames[i];
+        path = callpath_child(context, path, (uint64_t)((uintptr_t)f->fn));
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+        if (node->name == NULL) {
+            uint32_t before = context->symbol_count;
+            struct symbol_info* si = _snapshot_symbol(context, f);
+            context->mem_symbols += context->symbol_count - before;
+            node->sym = si;
+            node->frame_id = si->id;
+            node->name = si->name;
+            node->source = si->source;
+            node->line = si->line;
+        }
+    }
+    return (struct callpath_node*)icallpath_getvalue(path);
 }
 
+static inline bool _need_call_hook(struct profile_context* ctx);
+
 // 取当前栈的叶子节点
 static inline struct callpath_node* _current_leaf_node(struct profile_context* context) {
+    if (!_need_call_hook(context)) {
+        return _snapshot_leaf_node(context);
+    }
     struct call_state* cs = context->cur_cs;
     if (!cs) return NULL;
     struct call_frame* leaf = cur_callframe(cs);
@@ -943,44 +2192,115 @@ static const void* _get_prototype(lua_State* L, lua_Debug* ar) {
     return proto;
 }
 
+/*
+按字节指数采样（heap sampling）：
+把分配的字节流看成一条时间轴，每次分配从剩余预算 mem_sample_remaining 中扣除 size，
+预算 <= 0 即命中，并按均值 mem_sample_bytes 的指数分布重新补充预算。
+一次大分配可能命中多次，命中 k 次的样本代表约 k * mem_sample_bytes 字节（无偏估计）。
+只有命中的指针进入活跃样本集合 alloc_map，free 时不在集合中的指针直接忽略。
+*/
+static inline uint64_t
+_mem_sample_hits(struct profile_context* context, size_t size) {
+    uint64_t hits = 0;
+    context->mem_sample_remaining -= (int64_t)size;
+    while (context->mem_sample_remaining <= 0) {
+        context->mem_sample_remaining += next_exponential_bytes(context);
+        hits++;
+    }
+    return hits;
+}
+
+static void
+_hook_alloc_sample(struct profile_context* context, void* ptr, size_t oldsize, size_t newsize, void* alloc_ret) {
+    // free 或 realloc 成功：旧指针若是样本，按其权重扣除（realloc 拆成 free + alloc）
+    if (oldsize > 0 && (newsize == 0 || alloc_ret != NULL)) {
+        struct alloc_node* an = (struct alloc_node*)pmap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+        if (an) {
+            if (an->path) {
+                uint64_t sub_times = (newsize == 0) ? an->live_times : 0;
+                _mem_update_on_path(context, an->path, 0, 0, an->live_bytes, sub_times, 0);
+            }
+            pafree(context->arena, an, sizeof(*an));
+        }
+    }
+    if (newsize == 0 || alloc_ret == NULL) {
+        return;
+    }
+
+    uint64_t hits = _mem_sample_hits(context, newsize);
+    if (hits == 0) {
+        return;
+    }
+    uint64_t weight_bytes = hits * (uint64_t)context->mem_sample_bytes;
+    uint64_t weight_times = weight_bytes / newsize;
+    if (weight_times < 1) weight_times = 1;
+
+    struct callpath_node* leaf = _current_leaf_node(context);
+    if (leaf) {
+        if (oldsize == 0) {
+            _mem_update_on_path(context, leaf, weight_bytes, weight_times, 0, 0, 0);
+        } else {
+            _mem_update_on_path(context, leaf, weight_bytes, 0, 0, 0, weight_times);
+        }
+    }
+
+    struct alloc_node* an = alloc_node_create(context);
+    an->live_bytes = weight_bytes;
+    an->live_times = weight_times;
+    an->path = leaf;
+    pmap_insert(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
+}
+
 // hook alloc/free/realloc 事件
 static void*
 _hook_alloc(void *ud, void *ptr, size_t _osize, size_t _nsize) {   
     struct profile_context* context = (struct profile_context*)ud;
+    if (ptr != NULL && _nsize == 0 && context->is_ready) {
+        _reclaim_thread_if_need(context, ptr, _osize);
+    }
     void* alloc_ret = context->last_alloc_f(context->last_alloc_ud, ptr, _osize, _nsize);
-    if (context->running_in_hook || !context->is_ready) {
+    if (!context->is_ready || context->mem_mode == MODE_OFF) {
+        return alloc_ret;
+    }
+    // 自身在 hook/dump 里触发的分配不归因；释放不依赖调用栈，照常记账，这样 dump 期间不必停 gc
+    if (context->running_in_hook && !(ptr != NULL && _nsize == 0)) {
         return alloc_ret;
     }
 
     size_t oldsize = (ptr == NULL) ? 0 : _osize;
     size_t newsize = _nsize;
 
+    if (context->mem_mode == MODE_SAMPLE) {
+        _hook_alloc_sample(context, ptr, oldsize, newsize, alloc_ret);
+        return alloc_ret;
+    }
+
     if (oldsize == 0 && newsize > 0) {
         // alloc
 
         // 更新节点
         struct callpath_node* leaf = _current_leaf_node(context);
-        if (leaf) _mem_update_on_path(leaf, newsize, 1, 0, 0, 0);
+        if (leaf) _mem_update_on_path(context, leaf, newsize, 1, 0, 0, 0);
 
         // 创建映射
-        struct alloc_node* an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret);
-        if (an == NULL) an = alloc_node_create();
+        struct alloc_node* an = (struct alloc_node*)pmap_query(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret);
+        if (an == NULL) an = alloc_node_create(context);
         an->live_bytes = newsize;
-        an->path = _current_leaf_node(context);
-        imap_set(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
+        an->path = leaf;
+        pmap_insert(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
 
     } else if (oldsize > 0 && newsize == 0) {
         // free
         
-        struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+        struct alloc_node* an = (struct alloc_node*)pmap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
         if (an) {
             // 更新节点
             size_t sub_bytes = an->live_bytes; 
             uint64_t sub_times = (an->live_bytes ? 1 : 0);
             if (an->path && an->live_bytes > 0) {
-                _mem_update_on_path(an->path, 0, 0, sub_bytes, sub_times, 0);
+                _mem_update_on_path(context, an->path, 0, 0, sub_bytes, sub_times, 0);
             }
-            pfree(an);
+            pafree(context->arena, an, sizeof(*an));
             an = NULL;
         }
 
@@ -992,99 +2312,157 @@ _hook_alloc(void *ud, void *ptr, size_t _osize, size_t _nsize) {
         // 2、新 node，alloc_bytes 加上 newsize，realloc_times 加 1；
 
         // 旧路径
-        struct alloc_node* old_an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+        struct alloc_node* old_an = (struct alloc_node*)pmap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
         if (old_an && old_an->path) {
-            _mem_update_on_path(old_an->path, 0, 0, oldsize, 0, 0);
+            _mem_update_on_path(context, old_an->path, 0, 0, oldsize, 0, 0);
         }
 
         // 新路径
         struct callpath_node* leaf = _current_leaf_node(context);
-        if (leaf) _mem_update_on_path(leaf, newsize, 0, 0, 0, 1);
+        if (leaf) _mem_update_on_path(context, leaf, newsize, 0, 0, 0, 1);
 
         // 更新映射（搬移或原地）
         if (alloc_ret != ptr && alloc_ret != NULL) {
-            struct alloc_node* an = (struct alloc_node*)imap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
-            if (!an) an = alloc_node_create();
+            struct alloc_node* an = (struct alloc_node*)pmap_remove(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+            if (!an) an = alloc_node_create(context);
             an->live_bytes = newsize;
-            an->path = _current_leaf_node(context);
-            imap_set(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
+            an->path = leaf;
+            pmap_insert(context->alloc_map, (uint64_t)(uintptr_t)alloc_ret, an);
         } else {
-            struct alloc_node* an = (struct alloc_node*)imap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
+            struct alloc_node* an = (struct alloc_node*)pmap_query(context->alloc_map, (uint64_t)(uintptr_t)ptr);
             bool exists = (an != NULL);
-            if (!exists) an = alloc_node_create();
+            if (!exists) an = alloc_node_create(context);
             an->live_bytes = newsize;
-            an->path = _current_leaf_node(context);
-            if (!exists) imap_set(context->alloc_map, (uint64_t)(uintptr_t)ptr, an);
+            an->path = leaf;
+            if (!exists) pmap_insert(context->alloc_map, (uint64_t)(uintptr_t)ptr, an);
         }
     }
 
     return alloc_ret;
 }
 
+static void profile_maybe_rotate(lua_State* L, struct profile_context* context, uint64_t now);
+
+// cpu tracing 需要 call/ret 计时；内存归因需要知道当前协程和它的栈：cpu = "sample" 时 g_prof_current_L 由 c.resume/c.wrap 维护，
+// 直接读 CallInfo 链（_snapshot_leaf_node），其他模式下由 call/ret 维护影子栈
+static inline bool
+_need_call_hook(struct profile_context* ctx) {
+    return ctx->cpu_mode == MODE_PROFILE || (ctx->mem_mode != MODE_OFF && ctx->cpu_mode != MODE_SAMPLE);
+}
+
+static inline bool
+_need_hook(struct profile_context* ctx) {
+    return _need_call_hook(ctx) || ctx->cpu_mode == MODE_COUNT_SAMPLE;
+}
+
+// call/ret 与 count 共用 _hook_call 一个 hook 函数，按 event 分派
+static inline int
+_hook_mask(struct profile_context* ctx) {
+    int mask = 0;
+    if (_need_call_hook(ctx)) mask |= LUA_MASKCALL | LUA_MASKRET;
+    if (ctx->cpu_mode == MODE_COUNT_SAMPLE) mask |= LUA_MASKCOUNT;
+    return mask;
+}
+
+// 抽样栈存在 sample_map 里的模式
+static inline bool
+_cpu_sampling(const struct profile_context* ctx) {
+    return ctx->cpu_mode == MODE_SAMPLE || ctx->cpu_mode == MODE_COUNT_SAMPLE;
+}
+
+static void _hook_count(lua_State* L, struct profile_context* context);
+
+
 // hook call/ret 事件
 static void
 _hook_call(lua_State* L, lua_Debug* far) {
-    uint64_t begin_time = get_mono_ns();
-
     struct profile_context* context = get_profile_context(L);
-    if (context == NULL) {
-        printf("resolve hook fail, profile not started\n");
+    if (context == NULL || (context->is_ready && !_need_hook(context))) {
+        // stop 只摘掉主线程和当前线程的 hook，其余协程在下一次事件时自己摘掉
+        lua_sethook(L, NULL, 0, 0);
         return;
     }
     if(!context->is_ready) {
         return;
     }
+    if (far->event == LUA_HOOKCOUNT) {
+        if (context->cpu_mode == MODE_COUNT_SAMPLE) {
+            _hook_count(L, context);
+        } else {
+            // 上一次 count_sample 留下、还没自己摘掉的 hook：换成本次的 mask，不产生样本
+            lua_sethook(L, _hook_call, _hook_mask(context), 0);
+        }
+        return;
+    }
 
+    uint64_t begin_time = hook_now(context);
     context->running_in_hook = true;
 
     int event = far->event;
 
     struct call_state* cs = context->cur_cs;
     if (!context->cur_cs || context->cur_cs->co != L) {
-        uint64_t key = (uint64_t)((uintptr_t)L);
-        cs = imap_query(context->cs_map, key);
+        cs = _lookup_call_state(context, L);
         if (cs == NULL) {
-            cs = (struct call_state*)pmalloc(sizeof(struct call_state) + sizeof(struct call_frame)*MAX_CALL_SIZE);
-            cs->co = L; 
-            cs->top = 0;
-            cs->leave_time = 0;
-            imap_set(context->cs_map, key, cs);
+            cs = _new_call_state(context, L);
         }
 
         if (context->cur_cs) {
             context->cur_cs->leave_time = begin_time;
         }
         context->cur_cs = cs;
+        g_prof_current_L = L;
     }
     if (cs->leave_time > 0) {
-        assert(begin_time >= cs->leave_time);
-        uint64_t co_cost = begin_time - cs->leave_time;
-
-        for (int i = 0; i < cs->top; i++) {
-            cs->call_list[i].co_cost += co_cost;
-        }
+        // O(1)：只累加到协程上，各帧在出栈时用 co_base 求差
+        cs->co_cost += begin_time - cs->leave_time;
         cs->leave_time = 0;
     }
     assert(cs->co == L);
 
     if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL) {
+        cs->calls++;
+        if (cs->overflow > 0) {
+            // 已超过深度上限：尾调用替换栈顶帧，不改变深度
+            if (event == LUA_HOOKCALL) cs->overflow++;
+            context->call_overflow++;
+            context->running_in_hook = false;
+            return;
+        }
         struct icallpath_context* pre_callpath = NULL;
         struct call_frame* pre_frame = cur_callframe(cs);
         if (pre_frame) {
             pre_callpath = pre_frame->path;
         }
         struct call_frame* frame = push_callframe(cs);
+        if (!frame) {
+            cs->overflow = 1;
+            cs->overflow_tail = (event == LUA_HOOKTAILCALL);
+            context->call_overflow++;
+            context->running_in_hook = false;
+            return;
+        }
         frame->tail = (event == LUA_HOOKTAILCALL);
-        frame->co_cost = 0;
+        frame->co_base = cs->co_cost;
+        frame->call_base = cs->calls;
         frame->prototype = _get_prototype(L, far);    
         frame->path = get_frame_path(context, L, far, pre_callpath, frame);
         if (frame->path) {
             struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
-            ++node->call_count;
+            ++node_stat(context, node)->call_count;
         }
-        frame->call_time = get_mono_ns();
+        frame->call_time = hook_now(context);
 
     } else if (event == LUA_HOOKRET) {
+        if (cs->overflow > 0) {
+            cs->overflow--;
+            if (cs->overflow > 0 || !cs->overflow_tail) {
+                context->running_in_hook = false;
+                return;
+            }
+            // 未记录的尾调用返回，等同于被它替换的栈顶帧返回，按正常 ret 弹出
+            cs->overflow_tail = false;
+        }
         if (cs->top <= 0) {
             context->running_in_hook = false;
             return;
@@ -1094,17 +2472,22 @@ _hook_call(lua_State* L, lua_Debug* far) {
             struct call_frame* cur_frame = pop_callframe(cs);
             struct callpath_node* cur_path = (struct callpath_node*)icallpath_getvalue(cur_frame->path);
             uint64_t total_cost = begin_time - cur_frame->call_time;
-            uint64_t real_cost = total_cost - cur_frame->co_cost;
-            assert(begin_time >= cur_frame->call_time && total_cost >= cur_frame->co_cost);
+            uint64_t co_cost = cs->co_cost - cur_frame->co_base;
+            uint64_t real_cost = total_cost - co_cost;
+            assert(begin_time >= cur_frame->call_time && total_cost >= co_cost);
             cur_path->last_ret_time = begin_time;
-            cur_path->real_cost += real_cost;
+            struct callpath_stat* st = node_stat(context, cur_path);
+            st->real_cost += real_cost;
+            st->child_calls += cs->calls - cur_frame->call_base;
 
             struct call_frame* pre_frame = cur_callframe(cs);
             tail_call = pre_frame ? cur_frame->tail : false;
         } while(tail_call);
+        _shrink_call_state(cs);
     }
 
-    context->profile_cost_ns += (get_mono_ns() - begin_time);
+    profile_maybe_rotate(L, context, hook_mono(context, begin_time));
+    context->profile_cost += (hook_now(context) - begin_time);
     context->running_in_hook = false;
 }
 
@@ -1130,17 +2513,18 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
     }
 
     struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+    struct callpath_stat* st = node_stat(arg->pcontext, node);
 
     // 本节点的聚合指标=本节点指标+所有子节点的指标
-    uint64_t alloc_bytes_incl = node->alloc_bytes + child_arg.alloc_bytes_sum;
-    uint64_t free_bytes_incl = node->free_bytes + child_arg.free_bytes_sum;
-    uint64_t alloc_times_incl = node->alloc_times + child_arg.alloc_times_sum;
-    uint64_t free_times_incl = node->free_times + child_arg.free_times_sum;
-    uint64_t realloc_times_incl = node->realloc_times + child_arg.realloc_times_sum;
+    uint64_t alloc_bytes_incl = st->alloc_bytes + child_arg.alloc_bytes_sum;
+    uint64_t free_bytes_incl = st->free_bytes + child_arg.free_bytes_sum;
+    uint64_t alloc_times_incl = st->alloc_times + child_arg.alloc_times_sum;
+    uint64_t free_times_incl = st->free_times + child_arg.free_times_sum;
+    uint64_t realloc_times_incl = st->realloc_times + child_arg.realloc_times_sum;
 
     // 本节点的其他指标
-    uint64_t real_cost = node->real_cost;
-    uint64_t call_count = node->call_count;
+    uint64_t real_cost = hook_ns(arg->pcontext, st->real_cost);
+    uint64_t call_count = st->call_count;
     uint64_t inuse_bytes = (alloc_bytes_incl >= free_bytes_incl ? alloc_bytes_incl - free_bytes_incl : 9999999999);
 
     // 累加到父节点
@@ -1152,11 +2536,12 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
 
     // 导出本节点的聚合指标
     char name[512] = {0};
-    snprintf(name, sizeof(name)-1, "%s %s:%d", node->name ? node->name : "", node->source ? node->source : "", node->line);
+    const char* node_name = callpath_node_name(node);
+    snprintf(name, sizeof(name)-1, "%s %s:%d", node_name ? node_name : "", node->source ? node->source : "", node->line);
     lua_pushstring(arg->L, name);
     lua_setfield(arg->L, -2, "name");
 
-    lua_pushinteger(arg->L, node->last_ret_time);
+    lua_pushinteger(arg->L, hook_mono(arg->pcontext, node->last_ret_time));
     lua_setfield(arg->L, -2, "last_ret_time");
 
     if (arg->pcontext->cpu_mode == MODE_PROFILE) {
@@ -1166,9 +2551,13 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
         lua_pushinteger(arg->L, real_cost);
         lua_setfield(arg->L, -2, "cpu_cost_ns");
 
+        uint64_t comp_cost = hook_ns(arg->pcontext, node_comp_cost(arg->pcontext, node));
+        lua_pushinteger(arg->L, comp_cost);
+        lua_setfield(arg->L, -2, "cpu_cost_comp_ns");
+
         uint64_t parent_real_cost = 0;
         if (node->parent) {
-            parent_real_cost = node->parent->real_cost;
+            parent_real_cost = hook_ns(arg->pcontext, node_stat(arg->pcontext, node->parent)->real_cost);
         }
         double percent = parent_real_cost > 0 ? ((double)real_cost / parent_real_cost * 100.0) : 100;
         char percent_str[32] = {0};
@@ -1176,9 +2565,15 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
         lua_pushstring(arg->L, percent_str);
         lua_setfield(arg->L, -2, "cpu_cost_percent");
 
+        uint64_t parent_comp_cost = node->parent ? hook_ns(arg->pcontext, node_comp_cost(arg->pcontext, node->parent)) : 0;
+        percent = parent_comp_cost > 0 ? ((double)comp_cost / parent_comp_cost * 100.0) : 100;
+        snprintf(percent_str, sizeof(percent_str)-1, "%.2f", percent);
+        lua_pushstring(arg->L, percent_str);
+        lua_setfield(arg->L, -2, "cpu_cost_comp_percent");
+
     }
 
-    if (arg->pcontext->mem_mode == MODE_PROFILE) {
+    if (arg->pcontext->mem_mode != MODE_OFF) {
         lua_pushinteger(arg->L, (lua_Integer)alloc_bytes_incl);
         lua_setfield(arg->L, -2, "alloc_bytes");
 
@@ -1199,8 +2594,20 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
     }
 
     if (path == arg->pcontext->callpath) {
-        lua_pushinteger(arg->L, arg->pcontext->profile_cost_ns);
+        lua_pushinteger(arg->L, hook_ns(arg->pcontext, arg->pcontext->profile_cost));
         lua_setfield(arg->L, -2, "profile_cost_ns");
+        lua_pushinteger(arg->L, hook_ns(arg->pcontext, arg->pcontext->hook_overhead));
+        lua_setfield(arg->L, -2, "hook_overhead_ns");
+        lua_pushinteger(arg->L, (lua_Integer)arg->pcontext->cs_live);
+        lua_setfield(arg->L, -2, "co_live");
+        lua_pushinteger(arg->L, (lua_Integer)arg->pcontext->cs_reclaimed);
+        lua_setfield(arg->L, -2, "co_reclaimed");
+        lua_pushinteger(arg->L, (lua_Integer)arg->pcontext->call_overflow);
+        lua_setfield(arg->L, -2, "call_overflow");
+        if (arg->pcontext->mem_mode == MODE_SAMPLE) {
+            lua_pushinteger(arg->L, (lua_Integer)arg->pcontext->mem_sample_bytes);
+            lua_setfield(arg->L, -2, "mem_sample_bytes");
+        }
     }
 }
 
@@ -1208,7 +2615,10 @@ static void sum_root_stat(uint64_t key, void* value, void* ud) {
     struct sum_root_stat_arg* arg = (struct sum_root_stat_arg*)ud;
     struct icallpath_context* path = (struct icallpath_context*)value;
     struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
-    arg->real_cost_sum += node->real_cost;
+    struct callpath_stat* st = node_stat(arg->pcontext, node);
+    arg->real_cost_sum += st->real_cost;
+    arg->comp_cost_sum += node_comp_cost(arg->pcontext, node);
+    arg->child_calls_sum += st->child_calls;
 }
 
 static void update_root_stat(struct profile_context* pcontext, lua_State* L) {
@@ -1217,12 +2627,16 @@ static void update_root_stat(struct profile_context* pcontext, lua_State* L) {
     struct callpath_node* root = (struct callpath_node*)icallpath_getvalue(path);
     if (!root) return;
 
-    root->last_ret_time = get_mono_ns();
+    if (pcontext->use_tsc) {
+        ptime_tsc_recalibrate();
+    }
+    root->last_ret_time = hook_now(pcontext);
     if (icallpath_children_size(path) > 0) {
         struct sum_root_stat_arg arg;
-        _init_sum_root_stat_arg(&arg);
+        _init_sum_root_stat_arg(&arg, pcontext);
         icallpath_dump_children(path, sum_root_stat, &arg);
-        root->real_cost = arg.real_cost_sum;
+        node_stat(pcontext, root)->real_cost = arg.real_cost_sum;
+        node_stat(pcontext, root)->child_calls = arg.child_calls_sum;
     }
 }
 
@@ -1232,20 +2646,667 @@ static void dump_call_path(struct profile_context* pcontext, lua_State* L) {
     _dump_call_path(pcontext->callpath, &arg);
 }
 
-static int 
-get_all_coroutines(lua_State* L, lua_State** result, int maxsize) {
-    int i = 0;
-    struct global_State* lG = L->l_G;
-    result[i++] = lG->mainthread;
+/*
+dump_to_file 的流式写出：边遍历 callpath tree / stackmap 边写 fd，
+不在 lua 堆上创建任何对象，耗时与节点数成线性关系。
+*/
+struct stream_json_arg {
+    struct profile_context* pcontext;
+    struct fwriter* w;
+    uint64_t index;
+    uint64_t alloc_bytes_sum;
+    uint64_t free_bytes_sum;
+    uint64_t alloc_times_sum;
+    uint64_t free_times_sum;
+    uint64_t realloc_times_sum;
+};
+
+static void _init_stream_json_arg(struct stream_json_arg* arg, struct profile_context* pcontext, struct fwriter* w) {
+    memset(arg, 0, sizeof(*arg));
+    arg->pcontext = pcontext;
+    arg->w = w;
+}
+
+static void _stream_json_node(struct icallpath_context* path, struct stream_json_arg* arg);
+
+static void _stream_json_child(uint64_t key, void* value, void* ud) {
+    struct stream_json_arg* arg = (struct stream_json_arg*)ud;
+    if (arg->index++ > 0) {
+        fwriter_putc(arg->w, ',');
+    }
+    _stream_json_node((struct icallpath_context*)value, arg);
+}
+
+static inline void _stream_json_field(struct fwriter* w, const char* key, uint64_t v) {
+    fwriter_printf(w, ",\"%s\":", key);
+    fwriter_u64(w, v);
+}
+
+// 字段与 dump() 返回的 lua table 一致；children 先写出，以便拿到子树的内存聚合值
+static void _stream_json_node(struct icallpath_context* path, struct stream_json_arg* arg) {
+    struct fwriter* w = arg->w;
+    struct profile_context* pcontext = arg->pcontext;
+    fwriter_putc(w, '{');
+
+    struct stream_json_arg child_arg;
+    _init_stream_json_arg(&child_arg, pcontext, w);
+    if (icallpath_children_size(path) > 0) {
+        fwriter_puts(w, "\"children\":[");
+        icallpath_dump_children(path, _stream_json_child, &child_arg);
+        fwriter_puts(w, "],");
+    }
+
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+    struct callpath_stat* st = node_stat(pcontext, node);
+    uint64_t alloc_bytes_incl = st->alloc_bytes + child_arg.alloc_bytes_sum;
+    uint64_t free_bytes_incl = st->free_bytes + child_arg.free_bytes_sum;
+    uint64_t alloc_times_incl = st->alloc_times + child_arg.alloc_times_sum;
+    uint64_t free_times_incl = st->free_times + child_arg.free_times_sum;
+    uint64_t realloc_times_incl = st->realloc_times + child_arg.realloc_times_sum;
+    uint64_t inuse_bytes = (alloc_bytes_incl >= free_bytes_incl ? alloc_bytes_incl - free_bytes_incl : 9999999999);
+
+    arg->alloc_bytes_sum += alloc_bytes_incl;
+    arg->free_bytes_sum += free_bytes_incl;
+    arg->alloc_times_sum += alloc_times_incl;
+    arg->free_times_sum += free_times_incl;
+    arg->realloc_times_sum += realloc_times_incl;
+
+    char name[512] = {0};
+    const char* node_name = callpath_node_name(node);
+    snprintf(name, sizeof(name)-1, "%s %s:%d", node_name ? node_name : "", node->source ? node->source : "", node->line);
+    fwriter_puts(w, "\"name\":");
+    fwriter_json_string(w, name);
+    _stream_json_field(w, "last_ret_time", hook_mono(pcontext, node->last_ret_time));
+
+    if (pcontext->cpu_mode == MODE_PROFILE) {
+        _stream_json_field(w, "call_count", st->call_count);
+        _stream_json_field(w, "cpu_cost_ns", hook_ns(pcontext, st->real_cost));
+        uint64_t parent_real_cost = node->parent ? node_stat(pcontext, node->parent)->real_cost : 0;
+        double percent = parent_real_cost > 0 ? ((double)st->real_cost / parent_real_cost * 100.0) : 100;
+        fwriter_printf(w, ",\"cpu_cost_percent\":\"%.2f\"", percent);
+        uint64_t comp_cost = node_comp_cost(pcontext, node);
+        _stream_json_field(w, "cpu_cost_comp_ns", hook_ns(pcontext, comp_cost));
+        uint64_t parent_comp_cost = node->parent ? node_comp_cost(pcontext, node->parent) : 0;
+        percent = parent_comp_cost > 0 ? ((double)comp_cost / parent_comp_cost * 100.0) : 100;
+        fwriter_printf(w, ",\"cpu_cost_comp_percent\":\"%.2f\"", percent);
+    }
+
+    if (pcontext->mem_mode != MODE_OFF) {
+        _stream_json_field(w, "alloc_bytes", alloc_bytes_incl);
+        _stream_json_field(w, "free_bytes", free_bytes_incl);
+        _stream_json_field(w, "alloc_times", alloc_times_incl);
+        _stream_json_field(w, "free_times", free_times_incl);
+        _stream_json_field(w, "realloc_times", realloc_times_incl);
+        _stream_json_field(w, "inuse_bytes", inuse_bytes);
+    }
+
+    if (path == pcontext->callpath) {
+        _stream_json_field(w, "profile_cost_ns", hook_ns(pcontext, pcontext->profile_cost));
+        _stream_json_field(w, "hook_overhead_ns", hook_ns(pcontext, pcontext->hook_overhead));
+        _stream_json_field(w, "co_live", pcontext->cs_live);
+        _stream_json_field(w, "co_reclaimed", pcontext->cs_reclaimed);
+        _stream_json_field(w, "call_overflow", pcontext->call_overflow);
+        if (pcontext->mem_mode == MODE_SAMPLE) {
+            _stream_json_field(w, "mem_sample_bytes", pcontext->mem_sample_bytes);
+        }
+    }
+    fwriter_putc(w, '}');
+}
+
+struct stream_folded_arg {
+    struct profile_context* pcontext;
+    struct fwriter* w;
+    char*  prefix;      // 当前节点的 root->node 折叠栈，用 ';' 分隔
+    size_t len;
+    size_t cap;
+};
+
+static void _stream_folded_node(struct icallpath_context* path, struct stream_folded_arg* arg);
+
+static void _stream_folded_child(uint64_t key, void* value, void* ud) {
+    _stream_folded_node((struct icallpath_context*)value, (struct stream_folded_arg*)ud);
+}
+
+// callpath tree 的折叠栈：cpu profile 时权重为 self cpu ns，否则为 self alloc bytes；root 不出现在栈里
+static void _stream_folded_node(struct icallpath_context* path, struct stream_folded_arg* arg) {
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+    size_t saved_len = arg->len;
+    if (path != arg->pcontext->callpath) {
+        char frame[512];
+        int n = snprintf(frame, sizeof(frame), "%s%s %s:%d", arg->len > 0 ? ";" : "",
+            callpath_node_name(node) ? callpath_node_name(node) : "anonymous", node->source ? node->source : "(source)", node->line);
+        if (n < 0) n = 0;
+        if ((size_t)n >= sizeof(frame)) n = sizeof(frame) - 1;
+        if (arg->len + (size_t)n + 1 > arg->cap) {
+            size_t cap = arg->cap ? arg->cap : 4096;
+            while (arg->len + (size_t)n + 1 > cap) cap *= 2;
+            arg->prefix = (char*)prealloc(arg->prefix, cap);
+            arg->cap = cap;
+        }
+        memcpy(arg->prefix + arg->len, frame, (size_t)n);
+        arg->len += (size_t)n;
+
+        uint64_t weight;
+        if (arg->pcontext->cpu_mode == MODE_PROFILE) {
+            struct sum_root_stat_arg sum;
+            _init_sum_root_stat_arg(&sum, arg->pcontext);
+            icallpath_dump_children(path, sum_root_stat, &sum);
+            uint64_t comp = node_comp_cost(arg->pcontext, node);
+            weight = comp > sum.comp_cost_sum ? hook_ns(arg->pcontext, comp - sum.comp_cost_sum) : 0;
+        } else {
+            weight = node_stat(arg->pcontext, node)->alloc_bytes;
+        }
+        if (weight > 0) {
+            fwriter_write(arg->w, arg->prefix, arg->len);
+            fwriter_putc(arg->w, ' ');
+            fwriter_u64(arg->w, weight);
+            fwriter_putc(arg->w, '\n');
+        }
+    }
+    icallpath_dump_children(path, _stream_folded_child, arg);
+    arg->len = saved_len;
+}
+
+struct stream_samples_arg {
+    struct profile_context* pcontext;
+    struct fwriter* w;
+    bool json;
+    uint64_t index;
+};
+
+static void _stream_frame_name(struct fwriter* w, const struct symbol_info* si, bool json) {
+    char namebuf[512];
+    const char* name = symbol_name(si);
+    const char* nm = (name && name[0]) ? name : "anonymous";
+    const char* src = (si->source && si->source[0]) ? si->source : "(source)";
+    snprintf(namebuf, sizeof(namebuf), "%s %s:%d", nm, src, si->line);
+    if (json) {
+        fwriter_json_string(w, namebuf);
+    } else {
+        fwriter_puts(w, namebuf);
+    }
+}
+
+// stackmap 的流式输出：folded 为 "f1;f2;f3 count" 行，json 为 {"stack":[...],"count":n} 数组元素
+static void _stream_samples_cb(const uint32_t* frames, int depth, uint64_t samples, void* ud) {
+    struct stream_samples_arg* arg = (struct stream_samples_arg*)ud;
+    struct fwriter* w = arg->w;
+    if (samples == 0) return;
+    if (arg->json) {
+        if (arg->index++ > 0) fwriter_putc(w, ',');
+        fwriter_puts(w, "{\"stack\":[");
+    }
+    for (int i = 0; i < depth; ++i) {
+        if (i > 0) fwriter_putc(w, arg->json ? ',' : ';');
+        _stream_frame_name(w, symbol_get(arg->pcontext, frames[i]), arg->json);
+    }
+    if (arg->json) {
+        fwriter_puts(w, "],\"count\":");
+        fwriter_u64(w, samples);
+        fwriter_putc(w, '}');
+    } else {
+        fwriter_putc(w, ' ');
+        fwriter_u64(w, samples);
+        fwriter_putc(w, '\n');
+    }
+}
+
+static void stream_json(struct profile_context* pcontext, struct fwriter* w, uint64_t profile_time) {
+    fwriter_puts(w, "{\"time\":");
+    fwriter_u64(w, profile_time);
+    if (_cpu_sampling(pcontext)) {
+        fwriter_puts(w, ",\"samples\":[");
+        struct stream_samples_arg sarg = { .pcontext = pcontext, .w = w, .json = true, .index = 0 };
+        struct stackmap* folded = _func_fold(pcontext, pcontext->sample_map);
+        stackmap_dump(folded, _stream_samples_cb, &sarg);
+        _func_fold_free(folded, pcontext->sample_map);
+        fwriter_putc(w, ']');
+        if (pcontext->mem_mode != MODE_OFF && pcontext->callpath) {
+            struct stream_json_arg arg;
+            _init_stream_json_arg(&arg, pcontext, w);
+            fwriter_puts(w, ",\"mem_nodes\":");
+            _stream_json_node(pcontext->callpath, &arg);
+        }
+    } else {
+        fwriter_puts(w, ",\"nodes\":");
+        if (pcontext->callpath) {
+            struct stream_json_arg arg;
+            _init_stream_json_arg(&arg, pcontext, w);
+            _stream_json_node(pcontext->callpath, &arg);
+        } else {
+            fwriter_puts(w, "{}");
+        }
+    }
+    fwriter_puts(w, "}\n");
+}
+
+static void stream_folded(struct profile_context* pcontext, struct fwriter* w) {
+    if (_cpu_sampling(pcontext)) {
+        struct stream_samples_arg sarg = { .pcontext = pcontext, .w = w, .json = false, .index = 0 };
+        struct stackmap* folded = _func_fold(pcontext, pcontext->sample_map);
+        stackmap_dump(folded, _stream_samples_cb, &sarg);
+        _func_fold_free(folded, pcontext->sample_map);
+    } else if (pcontext->callpath) {
+        struct stream_folded_arg arg = { .pcontext = pcontext, .w = w, .prefix = NULL, .len = 0, .cap = 0 };
+        _stream_folded_node(pcontext->callpath, &arg);
+        pfree(arg.prefix);
+    }
+}
+
+/*
+profile.proto 导出：lua cpu 抽样（stackmap）与 callpath tree（tracing 耗时、内存）写进同一个 profile，
+每个 sample 都带全部 sample type，不适用的值为 0。function/location 以 frame id 去重。
+*/
+enum {
+    PPROF_SAMPLES = 0,
+    PPROF_CPU_NS,           // tracing 时已扣除 hook 开销
+    PPROF_CPU_RAW_NS,       // tracing 时未扣除 hook 开销
+    PPROF_ALLOC_SPACE,
+    PPROF_ALLOC_OBJECTS,
+    PPROF_INUSE_SPACE,
+    PPROF_TYPE_COUNT,
+};
+
+static const struct pprof_value_type g_pprof_types[PPROF_TYPE_COUNT] = {
+    { "samples", "count" },
+    { "cpu", "nanoseconds" },
+    { "cpu_raw", "nanoseconds" },
+    { "alloc_space", "bytes" },
+    { "alloc_objects", "count" },
+    { "inuse_space", "bytes" },
+};
+
+// 每个 cpu 样本代表的 ns；count_sample 的样本按指令数计，没有时间权重
+static inline uint64_t _sample_period_ns(const struct profile_context* pcontext) {
+    if (pcontext->cpu_mode != MODE_SAMPLE) return 0;
+    int hz = pcontext->cpu_sample_hz > 0 ? pcontext->cpu_sample_hz : DEFAULT_CPU_SAMPLE_HZ;
+    return NANOSEC / hz;
+}
+
+struct collect_arg {
+    struct profile_context* pcontext;
+    struct stackmap* out;
+    uint64_t period_ns;
+    uint32_t* stack;        // root -> node 的 frame id
+    int depth;
+    int cap;
+};
+
+static void _collect_samples_cb(const uint32_t* frames, int depth, uint64_t samples, void* ud) {
+    struct collect_arg* arg = (struct collect_arg*)ud;
+    if (samples == 0) return;
+    uint64_t values[PPROF_TYPE_COUNT] = {0};
+    values[PPROF_SAMPLES] = samples;
+    values[PPROF_CPU_NS] = samples * arg->period_ns;
+    values[PPROF_CPU_RAW_NS] = values[PPROF_CPU_NS];
+    stackmap_add_n(arg->out, frames, depth, values);
+}
+
+/*
+一个节点一组计数的多值：self cpu = 本节点 inclusive - 各子节点 inclusive（child_real/child_comp），
+全为 0 时返回 false，不入表。
+*/
+static bool _stat_values(struct profile_context* pcontext, const struct callpath_stat* st,
+    uint64_t child_real, uint64_t child_comp, uint64_t* values) {
+    memset(values, 0, sizeof(uint64_t) * PPROF_TYPE_COUNT);
+    if (pcontext->cpu_mode == MODE_PROFILE) {
+        uint64_t comp = stat_comp_cost(pcontext, st);
+        values[PPROF_SAMPLES] = st->call_count;
+        values[PPROF_CPU_NS] = comp > child_comp ? hook_ns(pcontext, comp - child_comp) : 0;
+        values[PPROF_CPU_RAW_NS] = st->real_cost > child_real ? hook_ns(pcontext, st->real_cost - child_real) : 0;
+    }
+    if (pcontext->mem_mode != MODE_OFF) {
+        values[PPROF_ALLOC_SPACE] = st->alloc_bytes;
+        values[PPROF_ALLOC_OBJECTS] = st->alloc_times;
+        values[PPROF_INUSE_SPACE] = st->alloc_bytes - st->free_bytes;
+    }
+    for (int i = 0; i < PPROF_TYPE_COUNT; ++i) {
+        if (values[i] != 0) return true;
+    }
+    return false;
+}
+
+// callpath 节点的 frame id 与 symbol_map 共用（命名时填上），才能和 cpu 抽样的栈合并
+static void _collect_callpath_node(uint64_t key, void* value, void* ud) {
+    struct collect_arg* arg = (struct collect_arg*)ud;
+    struct profile_context* pcontext = arg->pcontext;
+    struct icallpath_context* path = (struct icallpath_context*)value;
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+
+    if (arg->depth == arg->cap) {
+        arg->cap = arg->cap ? arg->cap * 2 : 256;
+        arg->stack = (uint32_t*)prealloc(arg->stack, sizeof(uint32_t) * arg->cap);
+    }
+    arg->stack[arg->depth++] = node->frame_id;
+
+    struct sum_root_stat_arg sum;
+    _init_sum_root_stat_arg(&sum, pcontext);
+    if (pcontext->cpu_mode == MODE_PROFILE) {
+        icallpath_dump_children(path, sum_root_stat, &sum);
+    }
+    uint64_t values[PPROF_TYPE_COUNT];
+    if (_stat_values(pcontext, node_stat(pcontext, node), sum.real_cost_sum, sum.comp_cost_sum, values)) {
+        stackmap_add_n(arg->out, arg->stack, arg->depth, values);
+    }
+    icallpath_dump_children(path, _collect_callpath_node, arg);
+    arg->depth--;
+}
+
+/*
+把 lua cpu 抽样（stackmap）与 callpath tree（tracing 耗时、内存）折算成多值栈表累加进 out，
+pprof 导出与 continuous profiling 的窗口共用这一表示。不适用的值为 0；
+inuse 在窗口里可能为负（区间内释放了之前分配的对象），按补码存放。
+只读 vm 线程正在写的那组计数，冻结的那组见 callpath_fold。
+*/
+static void collect_stacks(struct profile_context* pcontext, struct stackmap* out) {
+    struct collect_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.pcontext = pcontext;
+    arg.out = out;
+    arg.period_ns = _sample_period_ns(pcontext);
+
+    if (_cpu_sampling(pcontext)) {
+        stackmap_dump(pcontext->sample_map, _collect_samples_cb, &arg);
+    }
+    if (pcontext->callpath) {
+        icallpath_dump_children(pcontext->callpath, _collect_callpath_node, &arg);
+    }
+    pfree(arg.stack);
+}
 
+/*
+把 profile_freeze 冻结的那组计数折算进 fold_out 并清零。沿 node_list 遍历，不碰 icallpath 的哈希表，
+helper 线程上也可以调用：节点的 parent/depth/frame_id 创建后不变，冻结之后 vm 线程只写另一组计数。
+先把每个节点的 inclusive 累加到父节点的 fold_real/fold_comp，再逐个算 self 值；root 不入表、不清零。
+*/
+static void callpath_fold(struct profile_context* pcontext) {
+    pthread_mutex_lock(&pcontext->fold_lock);
+    struct stackmap* out = pcontext->fold_out;
+    if (out) {
+        int e = pcontext->fold_epoch;
+        struct callpath_node* node;
+        if (pcontext->cpu_mode == MODE_PROFILE) {
+            for (node = pcontext->fold_head; node; node = node->list_next) {
+                if (!node->parent) continue;
+                node->parent->fold_real += node->stat[e].real_cost;
+                node->parent->fold_comp += stat_comp_cost(pcontext, &node->stat[e]);
+            }
+        }
+        uint32_t* stack = NULL;
+        int cap = 0;
+        uint64_t values[PPROF_TYPE_COUNT];
+        for (node = pcontext->fold_head; node; node = node->list_next) {
+            struct callpath_stat* st = &node->stat[e];
+            if (node->parent) {
+                if (_stat_values(pcontext, st, node->fold_real, node->fold_comp, values)) {
+                    if (node->depth > cap) {
+                        cap = node->depth > 256 ? node->depth : 256;
+                        stack = (uint32_t*)prealloc(stack, sizeof(uint32_t) * cap);
+                    }
+                    for (struct callpath_node* n = node; n->parent; n = n->parent) {
+                        stack[n->depth - 1] = n->frame_id;
+                    }
+                    stackmap_add_n(out, stack, node->depth, values);
+                }
+                memset(st, 0, sizeof(*st));
+            }
+            node->fold_real = 0;
+            node->fold_comp = 0;
+        }
+        pfree(stack);
+        pcontext->fold_out = NULL;
+        pcontext->fold_head = NULL;
+    }
+    pthread_mutex_unlock(&pcontext->fold_lock);
+}
+
+static void _merge_stacks_cb(const uint32_t* frames, int depth, const uint64_t* values, void* ud) {
+    stackmap_add_n((struct stackmap*)ud, frames, depth, values);
+}
+
+// 把一个冻结的窗口累加进多值栈表；只读 window 与不变的配置，helper 线程上也可以调用
+static void window_merge(struct profile_context* pcontext, const struct profile_window* win, struct stackmap* out) {
+    if (win->cpu_samples) {
+        struct collect_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.pcontext = pcontext;
+        arg.out = out;
+        arg.period_ns = _sample_period_ns(pcontext);
+        stackmap_dump(win->cpu_samples, _collect_samples_cb, &arg);
+    }
+    if (win->stacks) {
+        stackmap_dump_n(win->stacks, _merge_stacks_cb, out);
+    }
+}
+
+static void window_release(struct profile_window* win) {
+    stackmap_free(win->cpu_samples);
+    stackmap_free(win->stacks);
+    win->cpu_samples = NULL;
+    win->stacks = NULL;
+}
+
+struct pprof_dump_arg {
+    struct profile_context* pcontext;
+    struct pprof_builder* builder;
+    uint64_t* locations;    // leaf -> root
+    int cap;
+};
+
+static uint64_t _pprof_symbol_location(struct pprof_builder* b, const struct symbol_info* si) {
+    char namebuf[512];
+    const char* name = symbol_name(si);
+    snprintf(namebuf, sizeof(namebuf), "%s %s:%d",
+        (name && name[0]) ? name : "anonymous", (si->source && si->source[0]) ? si->source : "(source)", si->line);
+    if (si->func) {
+        // 同一函数的各个 pc 共用一个 function，pprof -lines / -list 可以按行展开
+        return pprof_line_location(b, si->id, si->func->id, namebuf, si->source, si->line, symbol_line(si));
+    }
+    return pprof_location(b, si->id, namebuf, si->source, si->line);
+}
+
+static void _pprof_stack_cb(const uint32_t* frames, int depth, const uint64_t* values, void* ud) {
+    struct pprof_dump_arg* arg = (struct pprof_dump_arg*)ud;
+    if (depth > arg->cap) {
+        int cap = arg->cap ? arg->cap : 256;
+        while (cap < depth) cap *= 2;
+        arg->locations = (uint64_t*)prealloc(arg->locations, sizeof(uint64_t) * cap);
+        arg->cap = cap;
+    }
+    for (int i = 0; i < depth; ++i) {
+        const struct symbol_info* si = symbol_get(arg->pcontext, frames[depth - 1 - i]);
+        arg->locations[i] = _pprof_symbol_location(arg->builder, si);
+    }
+    pprof_add_sample(arg->builder, arg->locations, depth, (const int64_t*)values);
+}
+
+static int write_stacks_pprof(struct profile_context* pcontext, struct stackmap* stacks, const char* path,
+    uint64_t time_nanos, uint64_t duration) {
+    struct pprof_builder* b = pprof_create(g_pprof_types, PPROF_TYPE_COUNT);
+    struct pprof_dump_arg arg = { .pcontext = pcontext, .builder = b, .locations = NULL, .cap = 0 };
+    stackmap_dump_n(stacks, _pprof_stack_cb, &arg);
+    const char* default_type = "cpu";
+    if (pcontext->cpu_mode == MODE_SAMPLE) {
+        // wall clock 模式下 cpu 值是墙钟时间，按 [on-cpu]/[off-cpu] 根帧区分
+        pprof_set_period(b, pcontext->cpu_clock_wall ? "wall" : "cpu", "nanoseconds", (int64_t)_sample_period_ns(pcontext));
+    } else if (pcontext->cpu_mode == MODE_COUNT_SAMPLE) {
+        pprof_set_period(b, "instructions", "count", pcontext->cpu_sample_instr);
+        default_type = "samples";
+    } else if (pcontext->cpu_mode == MODE_OFF) {
+        default_type = "alloc_space";
+    }
+    pprof_set_time(b, (int64_t)time_nanos, (int64_t)duration);
+    pprof_set_default_sample_type(b, default_type);
+
+    int ret = pprof_write(b, path);
+    pprof_free(b);
+    pfree(arg.locations);
+    return ret;
+}
+
+/*
+行热度图：按函数列出每一行的样本数。self 为该行是叶子帧的样本，total 为栈上任一帧落在该行的样本
+（同一条栈只算一次），只统计细化到 pc 的帧（见 cpu_sample_lines）。函数按 self 从高到低排列。
+*/
+struct line_heat {
+    const struct symbol_info* func;
+    int line;
+    uint64_t self;
+    uint64_t total;
+};
+
+struct line_heat_group {
+    size_t start;
+    size_t n;
+    uint64_t self;
+    uint64_t total;
+};
+
+struct line_heat_arg {
+    struct profile_context* pcontext;
+    struct pmap_context* index;     // func id << 32 | line -> 下标 + 1
+    struct line_heat* list;
+    size_t count;
+    size_t cap;
+    uint64_t keys[LUA_SNAPSHOT_DEPTH + 1];
+};
+
+static void _line_heat_cb(const uint32_t* frames, int depth, const uint64_t* values, void* ud) {
+    struct line_heat_arg* arg = (struct line_heat_arg*)ud;
+    uint64_t samples = values[PPROF_SAMPLES];
+    if (samples == 0) return;
+    int nkeys = 0;
+    for (int i = depth - 1; i >= 0; --i) {
+        const struct symbol_info* si = symbol_get(arg->pcontext, frames[i]);
+        if (si->pc < 0) continue;
+        int line = symbol_line(si);
+        uint64_t key = ((uint64_t)si->func->id << 32) | (uint32_t)line;
+        bool seen = false;
+        for (int k = 0; k < nkeys && !seen; ++k) seen = arg->keys[k] == key;
+        if (seen) continue;
+        if (nkeys < (int)(sizeof(arg->keys) / sizeof(arg->keys[0]))) arg->keys[nkeys++] = key;
+        size_t idx = (size_t)(uintptr_t)pmap_query(arg->index, key);
+        if (idx == 0) {
+            if (arg->count == arg->cap) {
+                arg->cap = arg->cap ? arg->cap * 2 : 256;
+                arg->list = (struct line_heat*)prealloc(arg->list, sizeof(struct line_heat) * arg->cap);
+            }
+            struct line_heat* h = &arg->list[arg->count++];
+            h->func = si->func;
+            h->line = line;
+            h->self = 0;
+            h->total = 0;
+            idx = arg->count;
+            pmap_insert(arg->index, key, (void*)(uintptr_t)idx);
+        }
+        struct line_heat* h = &arg->list[idx - 1];
+        h->total += samples;
+        if (i == depth - 1) h->self += samples;
+    }
+}
+
+static int _line_heat_cmp(const void* a, const void* b) {
+    const struct line_heat* x = (const struct line_heat*)a;
+    const struct line_heat* y = (const struct line_heat*)b;
+    if (x->func->id != y->func->id) return x->func->id < y->func->id ? -1 : 1;
+    return x->line < y->line ? -1 : (x->line > y->line);
+}
+
+static int _line_heat_group_cmp(const void* a, const void* b) {
+    const struct line_heat_group* x = (const struct line_heat_group*)a;
+    const struct line_heat_group* y = (const struct line_heat_group*)b;
+    if (x->self != y->self) return x->self > y->self ? -1 : 1;
+    return x->total > y->total ? -1 : (x->total < y->total);
+}
+
+static void stream_lines(struct profile_context* pcontext, struct fwriter* w) {
+    struct stackmap* stacks = stackmap_create_n(PPROF_TYPE_COUNT);
+    collect_stacks(pcontext, stacks);
+    struct line_heat_arg arg = { .pcontext = pcontext, .index = pmap_create(), .list = NULL, .count = 0, .cap = 0 };
+    stackmap_dump_n(stacks, _line_heat_cb, &arg);
+    stackmap_free(stacks);
+    pmap_free(arg.index);
+
+    qsort(arg.list, arg.count, sizeof(struct line_heat), _line_heat_cmp);
+    struct line_heat_group* groups = (struct line_heat_group*)pmalloc(sizeof(struct line_heat_group) * (arg.count + 1));
+    size_t ngroups = 0;
+    for (size_t i = 0; i < arg.count; ++i) {
+        if (i == 0 || arg.list[i].func != arg.list[i - 1].func) {
+            groups[ngroups++] = (struct line_heat_group){ .start = i, .n = 0, .self = 0, .total = 0 };
+        }
+        struct line_heat_group* g = &groups[ngroups - 1];
+        g->n++;
+        g->self += arg.list[i].self;
+        if (arg.list[i].total > g->total) g->total = arg.list[i].total;
+    }
+    qsort(groups, ngroups, sizeof(struct line_heat_group), _line_heat_group_cmp);
+    for (size_t gi = 0; gi < ngroups; ++gi) {
+        const struct line_heat_group* g = &groups[gi];
+        const struct symbol_info* fsi = arg.list[g->start].func;
+        const char* name = symbol_name(fsi);
+        fwriter_printf(w, "%s %s:%d self %llu\n", (name && name[0]) ? name : "anonymous",
+            (fsi->source && fsi->source[0]) ? fsi->source : "(source)", fsi->line, (unsigned long long)g->self);
+        for (size_t i = g->start; i < g->start + g->n; ++i) {
+            const struct line_heat* h = &arg.list[i];
+            fwriter_printf(w, "%8d %10llu %10llu\n", h->line, (unsigned long long)h->self, (unsigned long long)h->total);
+        }
+    }
+    pfree(groups);
+    pfree(arg.list);
+}
+
+static int write_pprof(struct profile_context* pcontext, const char* path, uint64_t profile_time) {
+    struct stackmap* stacks = stackmap_create_n(PPROF_TYPE_COUNT);
+    collect_stacks(pcontext, stacks);
+    int ret = write_stacks_pprof(pcontext, stacks, path, get_realtime_ns() - profile_time, profile_time);
+    stackmap_free(stacks);
+    return ret;
+}
+
+struct stacks_folded_arg {
+    struct profile_context* pcontext;
+    struct fwriter* w;
+    int index;
+};
+
+static void _stacks_folded_cb(const uint32_t* frames, int depth, const uint64_t* values, void* ud) {
+    struct stacks_folded_arg* arg = (struct stacks_folded_arg*)ud;
+    int64_t v = (int64_t)values[arg->index];
+    if (v <= 0) return;
+    for (int i = 0; i < depth; ++i) {
+        if (i > 0) fwriter_putc(arg->w, ';');
+        _stream_frame_name(arg->w, symbol_get(arg->pcontext, frames[i]), false);
+    }
+    fwriter_putc(arg->w, ' ');
+    fwriter_u64(arg->w, (uint64_t)v);
+    fwriter_putc(arg->w, '\n');
+}
+
+// 多值栈表的折叠栈：cpu 抽样取样本数，tracing 取 self cpu ns，只开内存时取 alloc bytes
+static int write_stacks_folded(struct profile_context* pcontext, struct stackmap* stacks, const char* path) {
+    struct fwriter* w = fwriter_open(path);
+    if (!w) return -1;
+    struct stacks_folded_arg arg = { .pcontext = pcontext, .w = w, .index = PPROF_ALLOC_SPACE };
+    if (_cpu_sampling(pcontext)) arg.index = PPROF_SAMPLES;
+    else if (pcontext->cpu_mode == MODE_PROFILE) arg.index = PPROF_CPU_NS;
+    struct stackmap* folded = _func_fold(pcontext, stacks);
+    stackmap_dump_n(folded, _stacks_folded_cb, &arg);
+    _func_fold_free(folded, stacks);
+    return fwriter_close(w);
+}
+
+// 遍历所有协程，没有数量上限；遍历期间不分配内存
+static void
+foreach_coroutine(lua_State* L, lua_Hook hook, int mask, int count) {
+    struct global_State* lG = L->l_G;
     struct GCObject* obj = lG->allgc;
-    while (obj && i < maxsize) {
+    while (obj) {
         if (obj->tt == LUA_TTHREAD) {
-            result[i++] = gco2th(obj);
+            lua_sethook(gco2th(obj), hook, mask, count);
         }
         obj = obj->next;
     }
-    return i;
+    lua_sethook(lG->mainthread, hook, mask, count);
 }
 
 static int _stop_gc_if_need(lua_State* L) {
@@ -1259,29 +3320,36 @@ static void _restart_gc_if_need(lua_State* L, int gc_was_running) {
     if (gc_was_running) { lua_gc(L, LUA_GCRESTART, 0); }
 }
 
+/*
+lua_newthread 会把创建者的 hook 复制给新协程，之后创建的协程天然带 hook，不必包装 coroutine.create。
+start 之前已存在的协程默认不遍历：只挂主线程和当前线程，start 是 O(1) 的，
+已有协程在第一次经过 c.resume / c.wrap 时才挂上（_auxresume）。hook_existing = true 时遍历一次 allgc。
+*/
 static void
-_set_hook_all_co(lua_State* L) {
+_set_hook_all_co(lua_State* L, bool hook_existing) {
     struct profile_context* ctx = get_profile_context(L);
     if (!ctx) {
         printf("hook all co fail, profile not started\n");
         return;
     }
-    if (ctx->cpu_mode == MODE_OFF) {
+    if (!_need_hook(ctx)) {
         return;
     }
-    // stop gc before set hook
-    int gc_was_running = _stop_gc_if_need(L);
-    lua_State* states[MAX_CO_SIZE] = {0};
-    int i = get_all_coroutines(L, states, MAX_CO_SIZE);
-    for (i = i - 1; i >= 0; i--) {
-        if (ctx && ctx->cpu_mode == MODE_PROFILE) {
-            // profiling (full call/ret)
-            lua_sethook(states[i], _hook_call, LUA_MASKCALL | LUA_MASKRET, 0);
-        }
+    // profiling (full call/ret), shadow stack for memory attribution, and/or count sampling
+    int mask = _hook_mask(ctx);
+    int count = (mask & LUA_MASKCOUNT) ? next_exponential_gap(ctx) : 0;
+    if (hook_existing) {
+        // stop gc before set hook
+        int gc_was_running = _stop_gc_if_need(L);
+        foreach_coroutine(L, _hook_call, mask, count);
+        _restart_gc_if_need(L, gc_was_running);
+    } else {
+        lua_sethook(G(L)->mainthread, _hook_call, mask, count);
     }
-    _restart_gc_if_need(L, gc_was_running);
+    lua_sethook(L, _hook_call, mask, count);
 }
 
+// 其余协程在下一次 call/ret 时发现 profile 已停止，自己摘掉 hook，见 _hook_call
 static void 
 _unset_hook_all_co(lua_State* L) {
     struct profile_context* ctx = get_profile_context(L);
@@ -1289,18 +3357,76 @@ _unset_hook_all_co(lua_State* L) {
         printf("unhook all co fail, profile not started\n");
         return;
     }
-    if (ctx->cpu_mode == MODE_OFF) {
+    if (!_need_hook(ctx)) {
         return;
     }    
-    // stop gc before unset hook
-    int gc_was_running = _stop_gc_if_need(L); 
-    lua_State* states[MAX_CO_SIZE] = {0};
-    int sz = get_all_coroutines(L, states, MAX_CO_SIZE);
-    int i;
-    for (i = sz - 1; i >= 0; i--) {
-        lua_sethook(states[i], NULL, 0, 0);
+    lua_sethook(G(L)->mainthread, NULL, 0, 0);
+    lua_sethook(L, NULL, 0, 0);
+}
+
+/*
+校准 hook 开销：在一个临时协程上分别不带/带 hook 跑同一个空函数调用循环，
+差值除以调用次数即每次调用的 hook 开销，取几轮里的最小值。
+hook 记到一个临时 context 上，在真正的 context 注册、alloc hook 挂上之前完成，
+校准产生的 callpath、symbol 和 call_state 随临时 context 一起释放，不会留在结果里。
+*/
+#define CALIBRATE_CALLS     20000
+#define CALIBRATE_ROUNDS    3
+
+static uint64_t
+_calibrate_run(lua_State* co, int loop_idx, lua_State* L, struct profile_context* context) {
+    lua_pushvalue(L, loop_idx);
+    lua_xmove(L, co, 1);
+    lua_pushinteger(co, CALIBRATE_CALLS);
+    uint64_t t = hook_now(context);
+    if (lua_pcall(co, 1, 0, 0) != LUA_OK) {
+        lua_pop(co, 1);
+        return 0;
     }
-    _restart_gc_if_need(L, gc_was_running);
+    return hook_now(context) - t;
+}
+
+static void
+calibrate_hook_overhead(lua_State* L, struct profile_context* context) {
+    struct profile_context* scratch = profile_create();
+    scratch->is_ready = true;
+    scratch->cpu_mode = MODE_PROFILE;
+    scratch->mem_mode = MODE_OFF;
+    scratch->use_tsc = context->use_tsc;
+    scratch->session = context->session ^ 1;
+    lua_State* prev_L = g_prof_current_L;
+    set_profile_context(L, scratch);
+
+    int top = lua_gettop(L);
+    if (luaL_loadstring(L, "local function f() end return function(n) for i = 1, n do f() end end") == LUA_OK) {
+        lua_call(L, 0, 1);
+        int loop_idx = lua_gettop(L);
+        lua_State* co = lua_newthread(L);
+        lua_sethook(co, NULL, 0, 0);
+
+        uint64_t best = UINT64_MAX;
+        for (int r = 0; r < CALIBRATE_ROUNDS; ++r) {
+            uint64_t base = _calibrate_run(co, loop_idx, L, scratch);
+            lua_sethook(co, _hook_call, LUA_MASKCALL | LUA_MASKRET, 0);
+            uint64_t hooked = _calibrate_run(co, loop_idx, L, scratch);
+            lua_sethook(co, NULL, 0, 0);
+            if (base && hooked > base) {
+                uint64_t per = (hooked - base) / CALIBRATE_CALLS;
+                if (per < best) best = per;
+            }
+        }
+        context->hook_overhead = (best == UINT64_MAX) ? 0 : best;
+        // 清掉协程 extraspace 里临时 context 的 tag
+        struct call_state* cs = _lookup_call_state(scratch, co);
+        if (cs) {
+            _free_call_state(scratch, cs);
+        }
+    }
+    lua_settop(L, top);
+
+    unset_profile_context(L);
+    profile_free(scratch);
+    g_prof_current_L = prev_L;
 }
 
 static int
@@ -1312,16 +3438,20 @@ _lstart(lua_State* L) {
     }
 
     // parse options: start([opts]), opts is a table
-    int cpu_mode = MODE_PROFILE; // default profile
-    int mem_mode = MODE_PROFILE; // default profile
-    int cpu_sample_hz = DEFAULT_CPU_SAMPLE_HZ;
-    bool read_ok = read_arg(L, &cpu_mode, &mem_mode, &cpu_sample_hz);
+    struct profile_opts opts;
+    bool read_ok = read_arg(L, &opts);
     if (!read_ok) {
         printf("start fail, invalid options\n");
         return 0;
     }
+    int cpu_mode = opts.cpu_mode;
+    int mem_mode = opts.mem_mode;
+    int cpu_sample_hz = opts.cpu_sample_hz;
 
-    lua_gc(L, LUA_GCCOLLECT, 0);  // full gc
+    // start 前的对象不在 alloc_map 里，释放时会被忽略，所以不需要先 full gc
+    if (opts.full_gc) {
+        lua_gc(L, LUA_GCCOLLECT, 0);
+    }
 
     context = profile_create();
     context->running_in_hook = true;
@@ -1330,27 +3460,66 @@ _lstart(lua_State* L) {
     context->cpu_mode = cpu_mode;
     context->mem_mode = mem_mode;
     context->cpu_sample_hz = cpu_sample_hz;
+    context->cpu_sample_instr = opts.cpu_sample_instr;
+    context->cpu_clock_wall = (cpu_mode == MODE_SAMPLE) && opts.cpu_clock_wall;
+    context->cpu_sample_lines = opts.cpu_sample_lines;
+    context->mem_sample_bytes = opts.mem_sample_bytes;
+    context->use_tsc = opts.tsc && ptime_tsc_available();
+    context->window_start = context->start_time;
+    if (opts.window_sec > 0) {
+        context->window_ns = (uint64_t)opts.window_sec * NANOSEC;
+        if (opts.window_dir) {
+            context->window_dir = pastrdup(context->arena, opts.window_dir);
+        } else {
+            context->window_cap = opts.window_count;
+            context->windows = (struct profile_window*)pcalloc(context->window_cap, sizeof(struct profile_window));
+        }
+    }
+    if (opts.dump_thread) {
+        context->worker = dump_worker_start();
+    }
     // seed rng with time xor state pointer
     context->rng_state = get_mono_ns() ^ (uint64_t)(uintptr_t)context;
+    context->session = (uint32_t)(xorshift64(&context->rng_state) >> 32) | 0x80000000u;
+    context->mem_sample_remaining = next_exponential_bytes(context);
     
+    // 先于 alloc hook 和 set_profile_context，校准用的是临时 context
+    if (cpu_mode == MODE_PROFILE) {
+        calibrate_hook_overhead(L, context);
+    }
+
     context->last_alloc_f = lua_getallocf(L, &context->last_alloc_ud);
-    if (mem_mode != MODE_OFF) {
+    // 只开 cpu tracing 时也挂 alloc hook，用来在协程被 gc 时回收 call_state
+    if (mem_mode != MODE_OFF || _need_call_hook(context)) {
         lua_setallocf(L, _hook_alloc, context);
     }
     set_profile_context(L, context);
 
+    // 快照环在 arm 定时器时清空，stop 时随定时器释放，其他 cpu 模式不会留下快照
     if (cpu_mode == MODE_SAMPLE) {
         g_prof_current_L = L;
-        lua_prof_set_cb_n(_on_prof_trap_n);        
-        if (start_thread_timer_hz(cpu_sample_hz) != 0) {
+#ifdef LUA_PROF_TRAP
+        lua_prof_set_cb_n(_on_prof_trap_n);
+#endif
+        // CFI 规则表在信号处理器之外预先展开
+        if (punwind_load() < 0) {
+            printf("eh_frame unwind tables unavailable, C stacks fall back to frame pointers\n");
+        }
+        g_sample_mixed = opts.cpu_sample_mixed && find_vm_execute();
+        if (opts.cpu_sample_mixed && !g_sample_mixed) {
+            printf("luaV_execute not found in dynamic symbols, mixed stacks disabled\n");
+        }
+        if (start_thread_timer_hz(cpu_sample_hz, context->cpu_clock_wall, opts.cpu_sample_poisson, xorshift64(&context->rng_state)) != 0) {
             printf("start thread timer fail\n");
         }
-    } else if (cpu_mode == MODE_PROFILE || mem_mode != MODE_OFF) {
-        _set_hook_all_co(L);
+        context->c_sampler = g_c_sampler;
+    }
+    if (_need_hook(context)) {
+        _set_hook_all_co(L, opts.hook_existing);
     }
     
     context->running_in_hook = false;
-    printf("luaprofile started, cpu_mode = %d, mem_mode = %d, cpu_sample_hz = %d, last_alloc_ud = %p\n", context->cpu_mode, context->mem_mode, context->cpu_sample_hz, context->last_alloc_ud);    
+    printf("luaprofile started, cpu_mode = %d, mem_mode = %d, cpu_sample_hz = %d, mem_sample_bytes = %zu, window_sec = %d, last_alloc_ud = %p\n", context->cpu_mode, context->mem_mode, context->cpu_sample_hz, context->mem_sample_bytes, opts.window_sec, context->last_alloc_ud);    
     return 0;
 }
 
@@ -1364,18 +3533,33 @@ _lstop(lua_State* L) {
     
     context->running_in_hook = true;
     context->is_ready = false;
-    lua_setallocf(L, context->last_alloc_f, context->last_alloc_ud);
     _unset_hook_all_co(L);
     unset_profile_context(L);
+    profile_teardown(L, context);
+    printf("luaprofile stopped\n");
+    return 0;
+}
+
+// stop 与 lua_close 时的 __gc 共用的收尾：调用方已经把 context 从 registry 摘掉
+static void
+profile_teardown(lua_State* L, struct profile_context* context) {
+    context->running_in_hook = true;
+    context->is_ready = false;
+    lua_setallocf(L, context->last_alloc_f, context->last_alloc_ud);
+    if (context->worker) {
+        dump_worker_stop(context->worker);
+        context->worker = NULL;
+    }
+    // 仍存活的协程带着本次的 tag，清掉，不留给应用或下次 start
+    for (uint32_t i = 0; i < context->cs_slot_count; ++i) {
+        if (context->cs_slots[i]) _clear_cs_tag(context, context->cs_slots[i]);
+    }
     profile_free(context);
-    context = NULL;
     // stop sampler
-    if (g_prof_timerid) {
+    if (g_prof_timer_created) {
         stop_thread_timer();
     }
     g_prof_current_L = NULL;
-    printf("luaprofile stopped\n");
-    return 0;
 }
 
 static int
@@ -1389,14 +3573,100 @@ _lmark(lua_State* L) {
     if(co == NULL) {
         co = L;
     }
-    if(context->is_ready) {
-        lua_sethook(co, _hook_call, LUA_MASKCALL | LUA_MASKRET, 0);
+    if(context->is_ready && _need_hook(context)) {
+        int mask = _hook_mask(context);
+        lua_sethook(co, _hook_call, mask, (mask & LUA_MASKCOUNT) ? next_exponential_gap(context) : 0);
     }
     g_prof_current_L = co;
     lua_pushboolean(L, context->is_ready);
     return 1;
 }
 
+/*
+与 lcorolib 的 auxresume 相同，另外让 cpu 抽样跟随正在运行的协程，每次 resume 没有额外分配。
+成功时结果已在 L 栈顶，返回结果个数；失败返回 -1，错误信息在 L 栈顶。
+*/
+static int
+_auxresume(lua_State* L, lua_State* co, int narg) {
+    if (!lua_checkstack(co, narg)) {
+        lua_pushliteral(L, "too many arguments to resume");
+        return -1;
+    }
+    lua_xmove(L, co, narg);
+    // start 之前创建、还没挂 hook 的协程：第一次 resume 时补上
+    struct profile_context* context = get_profile_context(L);
+    if (context && context->is_ready && _need_hook(context) && lua_gethook(co) != _hook_call) {
+        int mask = _hook_mask(context);
+        lua_sethook(co, _hook_call, mask, (mask & LUA_MASKCOUNT) ? next_exponential_gap(context) : 0);
+    }
+    lua_State* prev = g_prof_current_L;
+    g_prof_current_L = co;
+    int nres = 0;
+    int status = lua_resume(co, L, narg, &nres);
+    g_prof_current_L = prev;
+    if (status == LUA_OK || status == LUA_YIELD) {
+        if (!lua_checkstack(L, nres + 1)) {
+            lua_pop(co, nres);
+            lua_pushliteral(L, "too many results to resume");
+            return -1;
+        }
+        lua_xmove(co, L, nres);
+        return nres;
+    }
+    lua_xmove(co, L, 1);
+    return -1;
+}
+
+/*
+resume(co, ...) / wrap(f)：与 coroutine.resume / coroutine.wrap 语义相同。
+cpu = "sample" 或 hook_existing = false 时由 profile.lua 替换，wrap 出来的函数也经过 _auxresume。
+*/
+static int
+_lresume(lua_State* L) {
+    lua_State* co = lua_tothread(L, 1);
+    luaL_argexpected(L, co, 1, "coroutine");
+    int r = _auxresume(L, co, lua_gettop(L) - 1);
+    if (r < 0) {
+        lua_pushboolean(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    lua_insert(L, -(r + 1));
+    return r + 1;
+}
+
+static int
+_lauxwrap(lua_State* L) {
+    lua_State* co = lua_tothread(L, lua_upvalueindex(1));
+    int r = _auxresume(L, co, lua_gettop(L));
+    if (r < 0) {
+        int stat = lua_status(co);
+        if (stat != LUA_OK && stat != LUA_YIELD) {
+            // 协程内出错：关闭它的 to-be-closed 变量
+            stat = lua_closethread(co, L);
+            lua_xmove(co, L, 1);
+        }
+        if (stat != LUA_ERRMEM && lua_type(L, -1) == LUA_TSTRING) {
+            luaL_where(L, 1);
+            lua_insert(L, -2);
+            lua_concat(L, 2);
+        }
+        return lua_error(L);
+    }
+    return r;
+}
+
+static int
+_lwrap(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_State* co = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_xmove(L, co, 1);
+    lua_pushcclosure(L, _lauxwrap, 1);
+    return 1;
+}
+
 static int
 _lunmark(lua_State* L) {
     struct profile_context* context = get_profile_context(L);
@@ -1412,33 +3682,537 @@ _lunmark(lua_State* L) {
     return 0;
 }
 
+// 取快照中一帧对应的 symbol；首次见到时从 Proto 读取 source/linedefined，名字先用占位符
+static struct symbol_info* _snapshot_symbol(struct profile_context* context, const lua_frame_t* f) {
+    uint64_t sym_key = (uint64_t)((uintptr_t)f->fn);
+    struct symbol_info* si = (struct symbol_info*)pmap_query(context->symbol_map, sym_key);
+    if (si) {
+        return si;
+    }
+    si = symbol_new(context, sym_key);
+    if (f->is_lua) {
+        const Proto* p = (const Proto*)f->fn;
+        const char* src = p->source ? getstr(p->source) : "null";
+        si->name = pastrdup(context->arena, "(lua)");
+        si->source = pastrdup(context->arena, src ? src : "null");
+        si->line = p->linedefined;
+    } else {
+        si->name = pastrdup(context->arena, "(C)");
+        si->source = pastrdup(context->arena, "(C)");
+        si->line = -1;
+    }
+    return si;
+}
+
+static struct line_table* _copy_line_table(struct profile_context* context, const Proto* p) {
+    struct line_table* lt = (struct line_table*)pamalloc(context->arena, sizeof(struct line_table));
+    lt->linedefined = p->linedefined;
+    lt->sizelineinfo = p->lineinfo ? p->sizelineinfo : 0;
+    lt->sizeabslineinfo = p->abslineinfo ? p->sizeabslineinfo : 0;
+    lt->lineinfo = NULL;
+    lt->abslineinfo = NULL;
+    if (lt->sizelineinfo > 0) {
+        lt->lineinfo = (signed char*)pamalloc(context->arena, (size_t)lt->sizelineinfo);
+        memcpy(lt->lineinfo, p->lineinfo, (size_t)lt->sizelineinfo);
+    }
+    if (lt->sizeabslineinfo > 0) {
+        lt->abslineinfo = (AbsLineInfo*)pamalloc(context->arena, sizeof(AbsLineInfo) * lt->sizeabslineinfo);
+        memcpy(lt->abslineinfo, p->abslineinfo, sizeof(AbsLineInfo) * lt->sizeabslineinfo);
+    }
+    return lt;
+}
+
+/*
+Lua 帧的 (Proto*, pc) 位置，symbol_map 的 key 为 最高位 | 函数 frame id << 32 | pc，不会与指针冲突。
+savedpc 指向下一条要执行的指令；信号抽样时叶子帧的 savedpc 只在可能出错或调用的指令前更新，
+所以定位到的是最近一条这样的指令，通常与真实位置在同一行或同一个循环体里。
+每个样本只多一次 pmap 查询，行号换算留到导出时进行。
+*/
+#define PC_SYMBOL_KEY_BIT   ((uint64_t)1 << 63)
+static struct symbol_info* _pc_symbol(struct profile_context* context, struct symbol_info* fsi, const lua_frame_t* f) {
+    const Proto* p = (const Proto*)f->fn;
+    if (p->sizecode <= 0 || context->symbol_count >= SYMBOL_MAX - 1) {
+        return fsi;
+    }
+    ptrdiff_t pc = f->savedpc ? f->savedpc - p->code - 1 : 0;
+    if (pc < 0) pc = 0;
+    if (pc >= p->sizecode) pc = p->sizecode - 1;
+    uint64_t sym_key = PC_SYMBOL_KEY_BIT | ((uint64_t)fsi->id << 32) | (uint64_t)pc;
+    struct symbol_info* si = (struct symbol_info*)pmap_query(context->symbol_map, sym_key);
+    if (si) {
+        return si;
+    }
+    if (!fsi->lines) {
+        fsi->lines = _copy_line_table(context, p);
+    }
+    si = symbol_new(context, sym_key);
+    si->name = fsi->name;
+    si->source = fsi->source;
+    si->line = fsi->line;
+    si->pc = (int)pc;
+    si->func = fsi;
+    return si;
+}
+
+// frames[i] 是快照里第 i 帧（leaf 为 0）
+static inline struct symbol_info* _sample_frame_symbol(struct profile_context* context, const lua_frame_t* f, int i) {
+    struct symbol_info* si = _snapshot_symbol(context, f);
+    if (f->is_lua && (context->cpu_sample_lines == SAMPLE_LINES_ALL
+        || (context->cpu_sample_lines == SAMPLE_LINES_LEAF && i == 0))) {
+        si = _pc_symbol(context, si, f);
+    }
+    return si;
+}
+
+/*
+消费信号处理器写入的快照：符号化后以 root->leaf 的 frame id 数组入去重表。
+只在 vm 线程的安全点调用（trap 回调、dump），Proto 在被采样后到这里之间仍在栈上或刚返回，
+所以第一次见到时读取它的字段是安全的。返回本次新建的 symbol 个数。
+*/
+// wall clock 模式下栈根的伪帧，folded/pprof 可按它区分 on-cpu 与 off-cpu
+#define WALL_TAG_ON_CPU     ((uint64_t)1)
+#define WALL_TAG_OFF_CPU    ((uint64_t)2)
+static struct symbol_info* _wall_tag_symbol(struct profile_context* context, bool off_cpu) {
+    uint64_t sym_key = off_cpu ? WALL_TAG_OFF_CPU : WALL_TAG_ON_CPU;
+    struct symbol_info* si = (struct symbol_info*)pmap_query(context->symbol_map, sym_key);
+    if (!si) {
+        si = symbol_new(context, sym_key);
+        si->name = pastrdup(context->arena, off_cpu ? "[off-cpu]" : "[on-cpu]");
+        si->source = pastrdup(context->arena, "[wall]");
+        si->line = 0;
+    }
+    return si;
+}
+
+/*
+本地帧的 symbol：每个返回地址一个（key 为 NATIVE_PC_KEY_BIT | pc），名字按所在函数共用一个函数 symbol
+（key 为 NATIVE_FUNC_KEY_BIT | 函数起始地址），pprof 里同一函数的各个地址归到一个 function 下。
+符号来自 psym（ELF 符号表，含 static 函数），每个地址只查一次。
+*/
+#define NATIVE_PC_KEY_BIT   ((uint64_t)1 << 62)
+#define NATIVE_FUNC_KEY_BIT ((uint64_t)1 << 61)
+static struct symbol_info* _native_symbol(struct profile_context* context, uintptr_t pc) {
+    uint64_t sym_key = NATIVE_PC_KEY_BIT | (uint64_t)pc;
+    struct symbol_info* si = (struct symbol_info*)pmap_query(context->symbol_map, sym_key);
+    if (si) {
+        return si;
+    }
+    if (context->symbol_count >= SYMBOL_MAX - 2) {
+        return symbol_new(context, sym_key);
+    }
+    const struct psym_frame* pf = psym_lookup(_symbolizer(context), pc);
+    struct symbol_info* fsi = NULL;
+    if (pf->name) {
+        uint64_t func_key = NATIVE_FUNC_KEY_BIT | (uint64_t)pf->func;
+        fsi = (struct symbol_info*)pmap_query(context->symbol_map, func_key);
+        if (!fsi) {
+            fsi = symbol_new(context, func_key);
+            fsi->name = pastrdup(context->arena, pf->name);
+            fsi->source = pastrdup(context->arena, pf->module);
+            fsi->line = 0;
+        }
+    }
+    si = symbol_new(context, sym_key);
+    if (fsi && si != fsi) {
+        si->name = fsi->name;
+        si->source = fsi->source;
+        si->func = fsi;
+    } else if (!fsi) {
+        char namebuf[64];
+        snprintf(namebuf, sizeof(namebuf), "0x%lx", (unsigned long)pf->offset);
+        si->name = pastrdup(context->arena, namebuf);
+        si->source = pastrdup(context->arena, pf->module);
+    }
+    si->line = 0;
+    return si;
+}
+
+/*
+混合栈：C 帧与 Lua 帧都从叶子往根对齐。遇到 luaV_execute 里的地址时，先跳过快照中已经由本地帧表示的
+C 函数帧，再把连续的一段 Lua 帧放在这个位置，到第一个带 CIST_FRESH 的帧为止：Lua 调 Lua 在同一个
+luaV_execute 里进行，而 __index 等元方法函数、for ... in 的迭代器函数由 luaD_call 重新进入 luaV_execute，
+中间没有 C 函数帧，只有入口帧带 CIST_FRESH。本地栈没能走到根部时，剩余的 Lua 帧接在根上。
+out 为 leaf -> root，返回帧数。
+*/
+#define MIXED_STACK_DEPTH   (LUA_SNAPSHOT_DEPTH + C_MAX_FRAMES)
+static int _mixed_stack(struct profile_context* context, const lua_snapshot_t* snap, uint32_t* out) {
+    int n = 0;
+    int li = 0;
+    for (int d = 0; d < snap->c_depth && n < MIXED_STACK_DEPTH; ++d) {
+        uintptr_t pc = snap->c_pcs[d];
+        if (pc >= g_vm_exec_lo && pc < g_vm_exec_hi) {
+            while (li < snap->depth && !snap->frames[li].is_lua) li++;
+            int taken = 0;
+            while (li < snap->depth && snap->frames[li].is_lua && n < MIXED_STACK_DEPTH) {
+                const lua_frame_t* f = &snap->frames[li];
+                out[n++] = _sample_frame_symbol(context, f, li)->id;
+                li++;
+                taken++;
+                if (f->callstatus & CIST_FRESH) break;
+            }
+            if (taken > 0) continue;
+        }
+        out[n++] = _native_symbol(context, pc)->id;
+    }
+    for (; li < snap->depth && n < MIXED_STACK_DEPTH; ++li) {
+        out[n++] = _sample_frame_symbol(context, &snap->frames[li], li)->id;
+    }
+    return n;
+}
+
+static uint32_t drain_lua_snapshots(struct profile_context* context) {
+    /* 环里只有 sample 模式的快照；count_sample 没有时间周期，不能按 weight_ns / period 折算 */
+    lua_snapshot_ring_t* rb = g_lua_rb;
+    // 分配器里新建的 symbol 也要在这个安全点解析名字
+    uint32_t pending = context->mem_symbols;
+    context->mem_symbols = 0;
+    if (context->cpu_mode != MODE_SAMPLE || !rb) return pending;
+    uint32_t symbols_before = context->symbol_count;
+    uint32_t stack[MIXED_STACK_DEPTH + 1];
+    uint32_t mixed[MIXED_STACK_DEPTH];
+    uint64_t period = _sample_period_ns(context);
+    unsigned head = rb->head;
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    unsigned tail = rb->tail;
+    for (; tail != head; ++tail) {
+        const lua_snapshot_t* snap = &rb->snaps[tail % LUA_RB_CAP];
+        /* 权重折算成样本数，余数按概率进位，期望值与 weight_ns / period 相等 */
+        uint64_t count = snap->weight_ns / period;
+        uint64_t rem = snap->weight_ns % period;
+        if (rem && xorshift64(&context->rng_state) % period < rem) count++;
+        if (count == 0) continue;
+        int depth = snap->depth;
+        int base = 0;
+        if (context->cpu_clock_wall) {
+            stack[0] = _wall_tag_symbol(context, snap->off_cpu)->id;
+            base = 1;
+        }
+        if (snap->c_depth > 0) {
+            depth = _mixed_stack(context, snap, mixed);
+            for (int i = 0; i < depth; ++i) {
+                stack[base + depth - 1 - i] = mixed[i];
+            }
+            stackmap_add(context->sample_map, stack, base + depth, count);
+            continue;
+        }
+        for (int i = 0; i < depth; ++i) {
+            struct symbol_info* si = _sample_frame_symbol(context, &snap->frames[i], i);
+            stack[base + depth - 1 - i] = si->id;
+        }
+        stackmap_add(context->sample_map, stack, base + depth, count);
+    }
+    rb->tail = tail;
+    return context->symbol_count - symbols_before + pending;
+}
+
+// 为活跃栈上仍是占位名的函数补齐名字（需要 debug API），仅在出现新 symbol 后调用
+static void resolve_names_on_live_stack(lua_State* L, struct profile_context* context) {
+    lua_Debug ar;
+    for (int lvl = 0; lvl < LUA_SNAPSHOT_DEPTH && lua_getstack(L, lvl, &ar); ++lvl) {
+        const void* proto = _get_prototype(L, &ar);
+        struct symbol_info* si = (struct symbol_info*)pmap_query(context->symbol_map, (uint64_t)((uintptr_t)proto));
+        if (!si || (si->name && si->name[0] != '(')) {
+            continue; /* 未采到或已有人类可读的函数名，跳过 */
+        }
+        if (lua_getinfo(L, "n", &ar) && ar.name && ar.name[0]) {
+            /* 旧的占位名不释放：callpath node 与 helper 线程可能仍引用着它 */
+            __atomic_store_n(&si->name, pastrdup(context->arena, ar.name), __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+count_sample：每隔按指数分布抽取的指令数（均值 cpu_sample_instr）触发一次 LUA_HOOKCOUNT，
+在 hook 里同步读取当前协程的 CallInfo 链计入 sample_map，再用新的间隔重新 arm。
+随机间隔避免与循环体长度同步造成的偏差；每个样本代表约 cpu_sample_instr 条指令。
+*/
+static void _hook_count(lua_State* L, struct profile_context* context) {
+    if (context->running_in_hook) {
+        return;
+    }
+    context->running_in_hook = true;
+    lua_snapshot_t snap;
+    int depth = fill_lua_snapshot(L, &snap);
+    if (depth > 0) {
+        uint32_t stack[LUA_SNAPSHOT_DEPTH];
+        uint32_t symbols_before = context->symbol_count;
+        for (int i = 0; i < depth; ++i) {
+            struct symbol_info* si = _sample_frame_symbol(context, &snap.frames[i], i);
+            stack[depth - 1 - i] = si->id;
+        }
+        stackmap_add(context->sample_map, stack, depth, 1);
+        if (context->symbol_count != symbols_before) {
+            resolve_names_on_live_stack(L, context);
+        }
+    }
+    lua_sethook(L, _hook_call, _hook_mask(context), next_exponential_gap(context));
+    profile_maybe_rotate(L, context, get_mono_ns());
+    context->running_in_hook = false;
+}
+
+/*
+双缓冲：冻结时 sample_map 整表换成新表，callpath 节点的计数翻转 stat_epoch，都是 O(1)。
+冻结那组计数的折算（callpath_fold）、符号化、protobuf 编码、gzip 与写文件都在冻结之后进行，
+配置了 dump_thread 时放到 helper 线程上。helper 线程只读冻结的窗口与计数、symbol_dir 里已发布的 symbol
+和不变的配置；stop 时先 join 再释放 context。
+*/
+static void profile_freeze(lua_State* L, struct profile_context* context, uint64_t now, struct profile_window* win) {
+    win->cpu_samples = NULL;
+    win->stacks = NULL;
+    if (context->use_tsc) {
+        ptime_tsc_recalibrate();
+    }
+    if (_cpu_sampling(context)) {
+        if (drain_lua_snapshots(context) > 0) {
+            resolve_names_on_live_stack(L, context);
+        }
+        win->cpu_samples = context->sample_map;
+        context->sample_map = stackmap_create();
+    }
+    if (context->callpath) {
+        // 上一次冻结的计数通常早已由 helper 线程折算完，这里只是确认；没有的话先做掉，要切回去的那组必须已清零
+        callpath_fold(context);
+        win->stacks = stackmap_create_n(PPROF_TYPE_COUNT);
+        pthread_mutex_lock(&context->fold_lock);
+        context->fold_out = win->stacks;
+        context->fold_head = context->node_list;
+        context->fold_epoch = context->stat_epoch;
+        pthread_mutex_unlock(&context->fold_lock);
+        context->stat_epoch ^= 1;
+    }
+    win->seq = context->window_seq++;
+    win->duration = now - context->window_start;
+    win->start_realtime = get_realtime_ns() - win->duration;
+    context->window_start = now;
+}
+
+static int write_window(struct profile_context* context, const struct profile_window* win, const char* path, int format) {
+    struct stackmap* merged = stackmap_create_n(PPROF_TYPE_COUNT);
+    window_merge(context, win, merged);
+    int ret;
+    if (format == DUMP_FORMAT_PPROF) {
+        ret = write_stacks_pprof(context, merged, path, win->start_realtime, win->duration);
+    } else {
+        ret = write_stacks_folded(context, merged, path);
+    }
+    stackmap_free(merged);
+    return ret;
+}
+
+struct dump_job {
+    struct dump_job* next;
+    struct profile_context* context;
+    struct profile_window win;
+    int format;
+    char path[];
+};
+
+struct dump_worker {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dump_job* head;
+    struct dump_job* tail;
+    bool quit;
+};
+
+static struct dump_job* dump_job_new(struct profile_context* context, const char* path, int format) {
+    size_t len = strlen(path);
+    struct dump_job* job = (struct dump_job*)pmalloc(sizeof(*job) + len + 1);
+    job->next = NULL;
+    job->context = context;
+    job->format = format;
+    memcpy(job->path, path, len + 1);
+    return job;
+}
+
+// 执行并释放 job，返回值与 errno 同 write_window
+static int dump_job_run(struct dump_job* job) {
+    callpath_fold(job->context);
+    if (job->format == DUMP_FORMAT_FOLD) {
+        pfree(job);
+        return 0;
+    }
+    int ret = write_window(job->context, &job->win, job->path, job->format);
+    int err = errno;
+    if (ret != 0) {
+        printf("luaprofile: write %s fail: %s\n", job->path, strerror(err));
+    }
+    window_release(&job->win);
+    pfree(job);
+    errno = err;
+    return ret;
+}
+
+static void* dump_worker_main(void* ud) {
+    struct dump_worker* worker = (struct dump_worker*)ud;
+    for (;;) {
+        pthread_mutex_lock(&worker->lock);
+        while (!worker->head && !worker->quit) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        struct dump_job* job = worker->head;
+        if (job) {
+            worker->head = job->next;
+            if (!worker->head) worker->tail = NULL;
+        }
+        pthread_mutex_unlock(&worker->lock);
+        if (!job) break;    // quit 且队列已空
+        dump_job_run(job);
+    }
+    return NULL;
+}
+
+static struct dump_worker* dump_worker_start() {
+    struct dump_worker* worker = (struct dump_worker*)pmalloc(sizeof(*worker));
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->head = NULL;
+    worker->tail = NULL;
+    worker->quit = false;
+    // helper 线程不处理 profiler 的采样信号
+    sigset_t block, old;
+    sigemptyset(&block);
+    if (g_prof_signo) sigaddset(&block, g_prof_signo);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int err = pthread_create(&worker->tid, NULL, dump_worker_main, worker);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        printf("luaprofile: start dump thread fail: %s\n", strerror(err));
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->lock);
+        pfree(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+// 写完队列中剩余的 job 后退出
+static void dump_worker_stop(struct dump_worker* worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->quit = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->tid, NULL);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    pfree(worker);
+}
+
+// 有 helper 线程时入队并返回 0，否则在当前线程同步执行
+static int dump_job_submit(struct profile_context* context, struct dump_job* job) {
+    struct dump_worker* worker = context->worker;
+    if (!worker) {
+        return dump_job_run(job);
+    }
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+    worker->tail = job;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    return 0;
+}
+
+// 结束当前窗口：冻结后放进环形数组，或交给 dump job 写成带时间戳的文件
+static void profile_rotate(lua_State* L, struct profile_context* context, uint64_t now) {
+    if (context->window_dir) {
+        char ts[32];
+        char path[1024];
+        time_t sec = (time_t)((get_realtime_ns() - (now - context->window_start)) / NANOSEC);
+        struct tm tmv;
+        localtime_r(&sec, &tmv);
+        strftime(ts, sizeof(ts), "%Y%m%d-%H%M%S", &tmv);
+        snprintf(path, sizeof(path), "%s/luaprofile-%s-%llu.pb.gz", context->window_dir, ts, (unsigned long long)context->window_seq);
+        struct dump_job* job = dump_job_new(context, path, DUMP_FORMAT_PPROF);
+        profile_freeze(L, context, now, &job->win);
+        dump_job_submit(context, job);
+        return;
+    }
+
+    struct profile_window win;
+    profile_freeze(L, context, now, &win);
+    if (win.stacks) {
+        // 窗口留在内存里，冻结的计数交给 helper 线程折算；没有 helper 线程时就地折算
+        dump_job_submit(context, dump_job_new(context, "", DUMP_FORMAT_FOLD));
+    }
+    struct profile_window* slot = &context->windows[context->window_head];
+    if (context->window_used == context->window_cap) {
+        window_release(slot);   // 覆盖最旧的窗口
+    } else {
+        context->window_used++;
+    }
+    *slot = win;
+    context->window_head = (context->window_head + 1) % context->window_cap;
+}
+
+static void profile_maybe_rotate(lua_State* L, struct profile_context* context, uint64_t now) {
+    if (context->window_ns && now - context->window_start >= context->window_ns) {
+        profile_rotate(L, context, now);
+    }
+}
+
+#ifdef LUA_PROF_TRAP
+// n 为两次 trap 之间的 tick 数；每个 tick 已由对应的快照表示，这里只负责消费
+static void _on_prof_trap_n(lua_State* L, unsigned int n) {
+    (void)n;
+    struct profile_context* context = get_profile_context(L);
+    if (!context || context->cpu_mode != MODE_SAMPLE || context->running_in_hook) return;
+    context->running_in_hook = true;
+    if (drain_lua_snapshots(context) > 0) {
+        resolve_names_on_live_stack(L, context);
+    }
+    profile_maybe_rotate(L, context, get_mono_ns());
+    context->running_in_hook = false;
+}
+#endif
+
+// dump([full_gc])：默认不做 full gc，也不停 gc（dump 期间的释放照常记账，见 _hook_alloc）
 static int
 _ldump(lua_State* L) {
     struct profile_context* context = get_profile_context(L);
     if (context) {
-        /* fold C stack TLS buffer into c_sample_map using dladdr */
-        fold_c_tls_samples(context);
-        // full gc
-        lua_gc(L, LUA_GCCOLLECT, 0);
-
-        // stop gc before dump
-        int gc_was_running = _stop_gc_if_need(L); 
+        if (lua_toboolean(L, 1)) {
+            lua_gc(L, LUA_GCCOLLECT, 0);
+        }
         context->running_in_hook = true;
         uint64_t cur_time = get_mono_ns();
         uint64_t profile_time = cur_time - context->start_time;
         lua_pushinteger(L, profile_time);
 
-        if (context->cpu_mode == MODE_SAMPLE) {
+        if (_cpu_sampling(context)) {
+            /* consume pending signal-time snapshots first */
+            if (drain_lua_snapshots(context) > 0) {
+                resolve_names_on_live_stack(L, context);
+            }
+            if (g_lua_rb && g_lua_rb->dropped > 0) {
+                printf("luaprofile: %u lua stack snapshots dropped\n", g_lua_rb->dropped);
+            }
             /* dump Lua folded stacks */
             push_lua_folded_samples(L, context);
-            /* also write C stacks (names already resolved in keys) to a file */
-            write_c_samples_file(context, "cpu-c-samples.txt");
-            /* and emit raw addresses for offline symbolization */
-            write_c_samples_raw("cpu-c-samples.raw");
-            /* and emit legacy pprof file for pprof toolchain */
-            write_c_profile_pprof(context, "cpu-c-profile.pprof");
-            /* now it's safe to clear TLS buffer once */
-            clear_c_tls_samples();
+            c_sample_copy_t* samples = context->cpu_mode == MODE_SAMPLE ? c_sampler_acquire(context) : NULL;
+            if (samples) {
+                if (samples->dropped > 0) {
+                    printf("luaprofile: %llu C stack samples dropped\n", (unsigned long long)samples->dropped);
+                }
+                /* also write symbolized C stacks to a file */
+                write_c_samples_file(samples, "cpu-c-samples.txt");
+                /* and emit raw addresses for offline symbolization */
+                write_c_samples_raw(samples, "cpu-c-samples.raw");
+                /* and emit legacy pprof file for pprof toolchain */
+                write_c_profile_pprof(context, samples, "cpu-c-profile.pprof");
+                c_sample_copy_free(samples);
+            }
+            /* heap samples are attributed on the shadow-stack callpath tree */
+            if (context->mem_mode != MODE_OFF && context->callpath) {
+                update_root_stat(context, L);
+                dump_call_path(context, L);
+                context->running_in_hook = false;
+                return 3;
+            }
         } else {
             // tracing dump
             if (context->callpath) {
@@ -1449,129 +4223,168 @@ _ldump(lua_State* L) {
             }
         }
         context->running_in_hook = false;
-        _restart_gc_if_need(L, gc_was_running);
         return 2;
     }
     return 0;
 }
 
-static int _lget_mono_ns(lua_State* L) {
-    lua_pushinteger(L, get_mono_ns());
+// dump_to_file(path, format="json"|"folded"|"pprof"|"lines") -> true | nil, err
+static int
+_ldump_to_file(lua_State* L) {
+    static const char* const formats[] = { "json", "folded", "pprof", "lines", NULL };
+    const char* path = luaL_checkstring(L, 1);
+    int format = luaL_checkoption(L, 2, "json", formats);
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        lua_pushnil(L);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
+    context->running_in_hook = true;
+    uint64_t profile_time = get_mono_ns() - context->start_time;
+    if (context->cpu_mode == MODE_SAMPLE) {
+        if (drain_lua_snapshots(context) > 0) {
+            resolve_names_on_live_stack(L, context);
+        }
+    }
+    if (context->callpath) {
+        update_root_stat(context, L);
+    }
+    int ret;
+    if (format == 2) {
+        ret = write_pprof(context, path, profile_time);
+    } else {
+        struct fwriter* w = fwriter_open(path);
+        if (w) {
+            if (format == 0) {
+                stream_json(context, w, profile_time);
+            } else if (format == 3) {
+                stream_lines(context, w);
+            } else {
+                stream_folded(context, w);
+            }
+            ret = fwriter_close(w);
+        } else {
+            ret = -1;
+        }
+    }
+    context->running_in_hook = false;
+
+    if (ret != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
     return 1;
 }
 
-// -------- CPU sampling (timer + trap callback) --------
-
-
-// Construct folded key and ensure symbol info
-/* Safe stack sampler: does NOT call Lua debug API; walks CallInfo chain */
-static void record_lua_sample_weight(lua_State* L, unsigned int weight) {
+// rotate(): 立即结束当前窗口（continuous profiling）
+static int
+_lrotate(lua_State* L) {
     struct profile_context* context = get_profile_context(L);
-    if (!context || context->cpu_mode != MODE_SAMPLE || context->running_in_hook) return;
+    if (!context || !context->window_ns) {
+        printf("rotate fail, continuous profiling not started\n");
+        return 0;
+    }
     context->running_in_hook = true;
-    char keybuf[4096];
-    size_t kp = 0;
-    const void* protos[MAX_SAMPLE_DEPTH];
-    int nframes = 0;
-
-    /* 1) 遍历 CallInfo 链，采集自叶到根的 Proto/函数指针，并为每一帧写入符号信息（source/line，占位名） */
-    {
-        CallInfo* ci = L->ci;
-        while (ci && nframes < MAX_SAMPLE_DEPTH) {
-            const TValue* tv = s2v(ci->func.p);
-            const void* proto = NULL;
-            const Proto* lua_p = NULL;
-
-            if (ttislcf(tv)) {
-                proto = (const void*)fvalue(tv); /* 轻量 C 函数 */
-            } else if (ttisclosure(tv)) {
-                const Closure* cl = clvalue(tv);
-                if (cl->c.tt == LUA_VLCL) {
-                    lua_p = cl->l.p;            /* Lua 函数 */
-                    proto = (const void*)lua_p;
-                } else if (cl->c.tt == LUA_VCCL) {
-                    proto = (const void*)cl->c.f; /* C 闭包 */
-                }
-            }
+    profile_rotate(L, context, get_mono_ns());
+    context->running_in_hook = false;
+    return 0;
+}
 
-            if (proto) {
-                uint64_t sym_key = (uint64_t)((uintptr_t)proto);
-                struct symbol_info* si = (struct symbol_info*)imap_query(context->symbol_map, sym_key);
-                if (!si) {
-                    si = (struct symbol_info*)pmalloc(sizeof(struct symbol_info));
-                    if (lua_p) {
-                        const char* src = lua_p->source ? getstr(lua_p->source) : "null";
-                        si->name = pstrdup("(lua)");
-                        si->source = pstrdup(src ? src : "null");
-                        si->line = lua_p->linedefined;
-                    } else {
-                        si->name = pstrdup("(C)");
-                        si->source = pstrdup("(C)");
-                        si->line = -1;
-                    }
-                    imap_set(context->symbol_map, sym_key, si);
-                }
-                protos[nframes++] = proto;
-            }
-            ci = ci->previous;
-        }
+// snapshot(path, format = "pprof"|"folded") -> true | nil, err
+// 冻结自上次 snapshot（或 start）以来的增量并写入 path；有 helper 线程时立即返回，写文件的错误只打印
+static int
+_lsnapshot(lua_State* L) {
+    static const char* const formats[] = { "pprof", "folded", NULL };
+    const char* path = luaL_checkstring(L, 1);
+    int format = luaL_checkoption(L, 2, "pprof", formats);
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        lua_pushnil(L);
+        lua_pushstring(L, "profile not started");
+        return 2;
     }
-
-    /* 2) 为每一帧按需补齐函数名：仅当缓存里是占位名时，才调用 debug API 获取 name */
-    {
-        lua_Debug ar;
-        for (int lvl = 0; lvl < nframes; ++lvl) {
-            uint64_t sk = (uint64_t)((uintptr_t)protos[lvl]);
-            struct symbol_info* si = (struct symbol_info*)imap_query(context->symbol_map, sk);
-            if (si && si->name && si->name[0] != '(') {
-                continue; /* 缓存已有人类可读的函数名，跳过 */
-            }
-            if (!lua_getstack(L, lvl, &ar)) break;
-            int ok = lua_getinfo(L, "n", &ar);
-            if (ok && ar.name && ar.name[0]) {
-                if (!si) {
-                    si = (struct symbol_info*)pmalloc(sizeof(struct symbol_info));
-                    si->source = pstrdup("unknown");
-                    si->line = -1;
-                    imap_set(context->symbol_map, sk, si);
-                } else if (si->name) {
-                    pfree(si->name);
-                }
-                si->name = pstrdup(ar.name);
-            }
-        }
+    if (context->windows) {
+        lua_pushnil(L);
+        lua_pushstring(L, "continuous profiling keeps windows in memory, use dump_windows");
+        return 2;
+    }
+    context->running_in_hook = true;
+    struct dump_job* job = dump_job_new(context, path, format);
+    profile_freeze(L, context, get_mono_ns(), &job->win);
+    int ret = dump_job_submit(context, job);
+    context->running_in_hook = false;
+    if (ret != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, strerror(errno));
+        return 2;
     }
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    // Build folded key as root->...->leaf (FlameGraph expected order)
+// dump_windows(path, last_sec = 0, format = "pprof"|"folded") -> true | nil, err
+// 合并最近 last_sec 秒内结束的窗口和当前未结束的窗口；last_sec <= 0 表示环形数组里的全部窗口
+static int
+_ldump_windows(lua_State* L) {
+    static const char* const formats[] = { "pprof", "folded", NULL };
+    const char* path = luaL_checkstring(L, 1);
+    lua_Number last_sec = luaL_optnumber(L, 2, 0);
+    int format = luaL_checkoption(L, 3, "pprof", formats);
+    struct profile_context* context = get_profile_context(L);
+    if (!context) {
+        lua_pushnil(L);
+        lua_pushstring(L, "profile not started");
+        return 2;
+    }
 
-    for (int idx = nframes - 1; idx >= 0; --idx) {
-        char token[32];
-        int n = snprintf(token, sizeof(token), "%p", protos[idx]);
-        if (n > 0) {
-            if (kp + (size_t)n + 1 < sizeof(keybuf)) {
-                if (kp > 0) keybuf[kp++] = ';';
-                memcpy(keybuf + kp, token, (size_t)n);
-                kp += (size_t)n;
-            } else break;
-        }
+    context->running_in_hook = true;
+    uint64_t now = get_mono_ns();
+    uint64_t now_real = get_realtime_ns();
+    uint64_t since = last_sec > 0 ? now_real - (uint64_t)(last_sec * NANOSEC) : 0;
+    uint64_t begin_real = now_real - (now - context->window_start);
+    callpath_fold(context);     // 最近一个窗口的栈表可能还在 helper 线程上折算
+    struct stackmap* merged = stackmap_create_n(PPROF_TYPE_COUNT);
+    for (int i = context->window_used; i > 0; --i) {
+        int idx = (context->window_head - i + context->window_cap) % context->window_cap;
+        struct profile_window* win = &context->windows[idx];
+        if (win->start_realtime + win->duration < since) continue;
+        window_merge(context, win, merged);
+        if (win->start_realtime < begin_real) begin_real = win->start_realtime;
     }
-    keybuf[kp] = '\0';
-    if (kp > 0) {
-        uint64_t* cnt = (uint64_t*)smap_get(context->sample_map, keybuf);
-        if (!cnt) {
-            cnt = (uint64_t*)pmalloc(sizeof(uint64_t));
-            *cnt = 0;
-            smap_set(context->sample_map, keybuf, cnt);
-        }
-        (*cnt) += (uint64_t)(weight ? weight : 1);
+    if (context->cpu_mode == MODE_SAMPLE && drain_lua_snapshots(context) > 0) {
+        resolve_names_on_live_stack(L, context);
+    }
+    collect_stacks(context, merged);
+
+    int ret;
+    if (format == 0) {
+        ret = write_stacks_pprof(context, merged, path, begin_real, now_real - begin_real);
+    } else {
+        ret = write_stacks_folded(context, merged, path);
     }
+    stackmap_free(merged);
     context->running_in_hook = false;
+
+    if (ret != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
-static void _on_prof_trap_n(lua_State* L, unsigned int n) {
-    record_lua_sample_weight(L, n);
+static int _lget_mono_ns(lua_State* L) {
+    lua_pushinteger(L, get_mono_ns());
+    return 1;
 }
 
+// -------- CPU sampling (timer + trap callback) --------
+
+
 // sleep(seconds): 使用 POSIX nanosleep，支持小数秒，自动处理被信号打断
 static int _lsleep(lua_State* L) {
     lua_Number sec = luaL_checknumber(L, 1);
@@ -1604,7 +4417,13 @@ luaopen_luaprofilec(lua_State* L) {
         {"stop", _lstop},
         {"mark", _lmark},
         {"unmark", _lunmark},
+        {"resume", _lresume},
+        {"wrap", _lwrap},
         {"dump", _ldump},
+        {"dump_to_file", _ldump_to_file},
+        {"rotate", _lrotate},
+        {"snapshot", _lsnapshot},
+        {"dump_windows", _ldump_windows},
         {"getnanosec", _lget_mono_ns},
         {"sleep", _lsleep},
         {NULL, NULL},
@@ -17,4 +17,10 @@
 #define pfree  free
 #define pcalloc calloc
 
+// profile context 内部的小对象走 context 私有的 arena，stop 时整体释放
+#include "parena.h"
+#define pamalloc(arena, sz)     parena_alloc((arena), (sz))
+#define pafree(arena, p, sz)    parena_release((arena), (p), (sz))
+#define pastrdup(arena, s)      parena_strdup((arena), (s))
+
 #endif
\ No newline at end of file
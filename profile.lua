@@ -3,28 +3,34 @@ local c = require "luaprofilec"
 local M = {
 }
 
--- luacheck: ignore coroutine on_coroutine_destory
-local old_co_create = coroutine.create
+-- luacheck: ignore coroutine
+-- 新协程由 lua_newthread 继承创建者的 hook，不再需要包装 coroutine.create/wrap；
+-- cpu = "sample" 时用 c.resume / c.wrap 替换 coroutine.resume / coroutine.wrap，让抽样跟随正在运行的协程；
+-- hook_existing = false（默认）时也替换，start 之前的协程在第一次 resume 时才挂 hook
+local old_co_resume = coroutine.resume
 local old_co_wrap = coroutine.wrap
 
-local function my_coroutine_create(f)
-    return old_co_create(function (...)
-            c.mark()
-            return f(...)
-        end)
-end
-
-local function my_coroutine_wrap(f)
-    return old_co_wrap(function (...)
-            c.mark()
-            return f(...)
-        end)
-end
-
 local g_profile_started = false
 local g_opts = nil
 
--- opts = { cpu = "off|profile|sample", mem = "off|profile|sample", cpu_sample_hz = 250 }
+-- opts = { cpu = "off|profile|sample|count_sample", mem = "off|profile|sample", cpu_clock = "cpu", cpu_sample_hz = 250,
+--         cpu_sample_poisson = true, cpu_sample_lines = "leaf", cpu_sample_mixed = false, cpu_sample_instr = 10000,
+--         mem_sample_bytes = 512*1024,
+--         full_gc = false, window_sec = 0, window_count = 60, window_dir = nil, dump_thread = false, hook_existing = false,
+--         tsc = false }
+-- window_sec > 0 开启 continuous profiling：每 window_sec 秒把聚合轮转成一个只含增量的窗口，
+-- 内存里保留最近 window_count 个；设置 window_dir 时改为每个窗口写一个带时间戳的 pprof 文件。
+-- dump_thread = true 时窗口文件与 snapshot 的序列化在 helper 线程上进行，vm 线程只做 O(1) 的交换。
+-- cpu = "sample" 时 cpu_clock = "wall" 改用墙钟定时器，阻塞时间也会被抽到，栈根上带 [on-cpu]/[off-cpu] 标记帧。
+-- cpu = "sample" 默认按指数分布的随机间隔抽样（每个样本按实际间隔加权），避免与定周期的帧循环锁相；cpu_sample_poisson = false 退回固定周期。
+-- 抽样模式下 cpu_sample_lines = "leaf"（默认）把叶子帧记录到 (Proto*, pc)，"all" 每个 Lua 帧都记录调用点，"off" 只到函数；
+-- 导出时才换算成行号：pprof 的 location 带行号，dump_to_file(path, "lines") 输出按函数分组的行热度。
+-- cpu = "sample" 时 cpu_sample_mixed = true 把信号时的 C 帧与 Lua 帧拼成一条栈：luaV_execute 帧替换成它正在执行的 Lua 函数。
+-- cpu = "sample" 时不挂 call/ret hook，mem 归因直接读当前协程的 CallInfo 链。
+-- cpu = "count_sample" 用 LUA_MASKCOUNT 按平均 cpu_sample_instr 条指令（指数分布的随机间隔）抽样，不需要打补丁的 vm。
+-- tsc = true 时 tracing 用 TSC 计时（dump 时才换算成 ns），CPU 没有 invariant TSC 时自动回退到 clock_gettime。
+-- start 默认是 O(1) 的：已有协程在第一次经过 coroutine.resume / coroutine.wrap 时才挂 hook；
+-- hook_existing = true 时在 start 里遍历一次整个 gc 对象链表，给所有已有协程挂上。
 function M.start(opts)
     if g_profile_started then
         print("profile start fail, already started")
@@ -33,22 +39,60 @@ function M.start(opts)
     g_profile_started = true
     g_opts = opts or { cpu = "profile", mem = "profile", cpu_sample_hz = 250 }
     c.start(g_opts)
-    coroutine.create = my_coroutine_create
-    coroutine.wrap = my_coroutine_wrap
+    if g_opts.cpu == "sample" or not g_opts.hook_existing then
+        coroutine.resume = c.resume
+        coroutine.wrap = c.wrap
+    end
 end
 
-function M.stop()
+-- full_gc = true 时 dump 前先做一次 full gc，inuse 不再包含尚未回收的垃圾
+function M.stop(full_gc)
     if not g_profile_started then
         print("profile stop fail, not started")
         return
     end
-    coroutine.create = old_co_create
-    coroutine.wrap = old_co_wrap    
-    local record_time, nodes = c.dump()
+    coroutine.resume = old_co_resume
+    coroutine.wrap = old_co_wrap
+    local record_time, nodes, mem_nodes = c.dump(full_gc)
     c.stop()
     g_profile_started = false
     g_opts = nil
-    return {time = record_time, nodes = nodes}
+    return {time = record_time, nodes = nodes, mem_nodes = mem_nodes}
+end
+
+-- 直接从 C 把当前结果流式写入文件，不在 lua 堆上构建结果 table，适合很大的 callpath tree
+-- format = "json"(默认) | "folded" | "pprof"(gzip 压缩的 profile.proto) | "lines"(抽样的行热度)；成功返回 true，失败返回 nil, err
+function M.dump_to_file(path, format)
+    if not g_profile_started then
+        return nil, "profile not started"
+    end
+    return c.dump_to_file(path, format)
+end
+
+-- 冻结自上次 snapshot（或 start）以来的增量并写入文件，不需要 stop，也不会触发 gc
+-- format = "pprof"(默认) | "folded"；成功返回 true，失败返回 nil, err
+function M.snapshot(path, format)
+    if not g_profile_started then
+        return nil, "profile not started"
+    end
+    return c.snapshot(path, format)
+end
+
+-- continuous profiling：立即结束当前窗口
+function M.rotate()
+    if not g_profile_started then
+        return
+    end
+    c.rotate()
+end
+
+-- continuous profiling：把最近 last_sec 秒的窗口（含当前窗口）合并写入文件，不需要 stop
+-- format = "pprof"(默认) | "folded"；成功返回 true，失败返回 nil, err
+function M.dump_windows(path, last_sec, format)
+    if not g_profile_started then
+        return nil, "profile not started"
+    end
+    return c.dump_windows(path, last_sec, format)
 end
 
 return M
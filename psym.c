@@ -0,0 +1,402 @@
+#include "psym.h"
+#include "profile.h"
+#include "pmap.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAPS_RELOAD_NS      (1000 * 1000 * 1000)    // 未知地址触发重读 /proc/self/maps 的最小间隔
+#define DEBUG_BUILD_ID_DIR  "/usr/lib/debug/.build-id"
+
+struct psym_sym {
+    uint64_t addr;
+    uint64_t size;
+    const char* name;       // 指向 mmap 的字符串表
+};
+
+struct psym_elf {
+    char* path;
+    char* module;
+    int loaded;
+    uintptr_t load_base;    // 进程内：文件偏移 0 的映射的起始地址，_load_maps 时更新
+    uint64_t vaddr_base;    // 加载基址对应的链接地址：符号地址 = 偏移 + vaddr_base
+    struct psym_sym* syms;
+    size_t nsyms;
+    void* maps[2];          // 模块文件与调试文件
+    size_t map_sizes[2];
+};
+
+struct psym_range {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t base;         // 模块最低映射的起始地址
+    struct psym_elf* elf;
+};
+
+struct psym {
+    struct parena* arena;
+    struct pmap_context* cache;     // 进程内 key 为地址；离线 key 为 (模块下标 + 1) << 48 | 偏移
+    struct psym_elf** elfs;
+    size_t nelfs;
+    size_t elf_cap;
+    struct psym_range* ranges;      // 按 start 排序
+    size_t nranges;
+    int offline;
+    uint64_t maps_time;
+};
+
+static uint64_t
+_mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void*
+_map_file(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* p = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Elf64_Ehdr)) {
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            p = NULL;
+        } else {
+            *size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+    return p;
+}
+
+// 只支持本机字节序的 ELF64
+static const Elf64_Ehdr*
+_elf_header(const void* data, size_t size) {
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)data;
+    if (!data || size < sizeof(*eh)) return NULL;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64) return NULL;
+    if (eh->e_shoff == 0 || eh->e_shentsize != sizeof(Elf64_Shdr)) return NULL;
+    if (eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > size) return NULL;
+    return eh;
+}
+
+static uint64_t
+_elf_vaddr_base(const void* data, size_t size) {
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)data;
+    if (eh->e_phoff == 0 || eh->e_phentsize != sizeof(Elf64_Phdr)) return 0;
+    if (eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr) > size) return 0;
+    const Elf64_Phdr* ph = (const Elf64_Phdr*)((const char*)data + eh->e_phoff);
+    uint64_t base = UINT64_MAX;
+    for (int i = 0; i < eh->e_phnum; ++i) {
+        if (ph[i].p_type != PT_LOAD) continue;
+        uint64_t b = (ph[i].p_vaddr - ph[i].p_offset) & ~(uint64_t)0xfff;
+        if (b < base) base = b;
+    }
+    return base == UINT64_MAX ? 0 : base;
+}
+
+// 返回找到的 build-id 长度，写入 out（最多 cap 字节）
+static size_t
+_elf_build_id(const void* data, size_t size, uint8_t* out, size_t cap) {
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)data;
+    const Elf64_Shdr* sh = (const Elf64_Shdr*)((const char*)data + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; ++i) {
+        if (sh[i].sh_type != SHT_NOTE || sh[i].sh_offset + sh[i].sh_size > size) continue;
+        const char* p = (const char*)data + sh[i].sh_offset;
+        const char* end = p + sh[i].sh_size;
+        while (p + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr* nh = (const Elf64_Nhdr*)p;
+            const char* name = p + sizeof(*nh);
+            const char* desc = name + ((nh->n_namesz + 3) & ~3u);
+            const char* next = desc + ((nh->n_descsz + 3) & ~3u);
+            if (next > end) break;
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                size_t n = nh->n_descsz < cap ? nh->n_descsz : cap;
+                memcpy(out, desc, n);
+                return n;
+            }
+            p = next;
+        }
+    }
+    return 0;
+}
+
+// 收集 type 类型符号表里的函数符号，返回收集到的个数
+static size_t
+_elf_collect(struct psym_elf* e, const void* data, size_t size, uint32_t type, size_t* cap) {
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)data;
+    const Elf64_Shdr* sh = (const Elf64_Shdr*)((const char*)data + eh->e_shoff);
+    size_t found = 0;
+    for (int i = 0; i < eh->e_shnum; ++i) {
+        if (sh[i].sh_type != type || sh[i].sh_link >= eh->e_shnum) continue;
+        const Elf64_Shdr* strsh = &sh[sh[i].sh_link];
+        if (sh[i].sh_offset + sh[i].sh_size > size || strsh->sh_offset + strsh->sh_size > size) continue;
+        if (sh[i].sh_type == SHT_NOBITS || strsh->sh_type == SHT_NOBITS) continue;
+        const Elf64_Sym* sym = (const Elf64_Sym*)((const char*)data + sh[i].sh_offset);
+        size_t n = sh[i].sh_size / sizeof(Elf64_Sym);
+        const char* strtab = (const char*)data + strsh->sh_offset;
+        for (size_t k = 0; k < n; ++k) {
+            int st = ELF64_ST_TYPE(sym[k].st_info);
+            if ((st != STT_FUNC && st != STT_GNU_IFUNC) || sym[k].st_shndx == SHN_UNDEF || sym[k].st_value == 0) continue;
+            if (sym[k].st_name == 0 || sym[k].st_name >= strsh->sh_size) continue;
+            if (e->nsyms == *cap) {
+                *cap = *cap ? *cap * 2 : 1024;
+                e->syms = (struct psym_sym*)prealloc(e->syms, sizeof(struct psym_sym) * *cap);
+            }
+            struct psym_sym* s = &e->syms[e->nsyms++];
+            s->addr = sym[k].st_value;
+            s->size = sym[k].st_size;
+            s->name = strtab + sym[k].st_name;
+            found++;
+        }
+    }
+    return found;
+}
+
+static int
+_sym_cmp(const void* a, const void* b) {
+    const struct psym_sym* x = (const struct psym_sym*)a;
+    const struct psym_sym* y = (const struct psym_sym*)b;
+    if (x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+    // 同一地址的别名保留有大小的那个，其次是前导下划线少的（printf 而不是 _IO_printf）
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    return (int)strspn(x->name, "_") - (int)strspn(y->name, "_");
+}
+
+// 第一次查找该模块时才解析，.symtab 优先；被 strip 的库再找 build-id 对应的调试文件
+static void
+_elf_load(struct psym_elf* e) {
+    e->loaded = 1;
+    if (!e->path) return;
+    e->maps[0] = _map_file(e->path, &e->map_sizes[0]);
+    if (!_elf_header(e->maps[0], e->map_sizes[0])) return;
+    e->vaddr_base = _elf_vaddr_base(e->maps[0], e->map_sizes[0]);
+    size_t cap = 0;
+    if (_elf_collect(e, e->maps[0], e->map_sizes[0], SHT_SYMTAB, &cap) == 0) {
+        uint8_t id[64];
+        size_t n = _elf_build_id(e->maps[0], e->map_sizes[0], id, sizeof(id));
+        if (n > 1) {
+            char path[256];
+            int p = snprintf(path, sizeof(path), "%s/%02x/", DEBUG_BUILD_ID_DIR, id[0]);
+            for (size_t i = 1; i < n && p + 3 < (int)sizeof(path); ++i) {
+                p += snprintf(path + p, sizeof(path) - p, "%02x", id[i]);
+            }
+            snprintf(path + p, sizeof(path) - p, ".debug");
+            e->maps[1] = _map_file(path, &e->map_sizes[1]);
+            if (_elf_header(e->maps[1], e->map_sizes[1])) {
+                _elf_collect(e, e->maps[1], e->map_sizes[1], SHT_SYMTAB, &cap);
+            }
+        }
+        _elf_collect(e, e->maps[0], e->map_sizes[0], SHT_DYNSYM, &cap);
+    }
+    if (e->nsyms == 0) return;
+    qsort(e->syms, e->nsyms, sizeof(struct psym_sym), _sym_cmp);
+    size_t w = 0;
+    for (size_t i = 0; i < e->nsyms; ++i) {
+        if (w > 0 && e->syms[w - 1].addr == e->syms[i].addr) continue;
+        e->syms[w++] = e->syms[i];
+    }
+    e->nsyms = w;
+}
+
+static const struct psym_sym*
+_elf_find(const struct psym_elf* e, uint64_t vaddr) {
+    size_t lo = 0, hi = e->nsyms;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (e->syms[mid].addr <= vaddr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return NULL;
+    const struct psym_sym* s = &e->syms[lo - 1];
+    // 没有大小的符号（汇编函数）一直延伸到下一个符号
+    if (s->size > 0 && vaddr >= s->addr + s->size) return NULL;
+    return s;
+}
+
+static struct psym_elf*
+_elf_get(struct psym* s, const char* module, const char* path) {
+    for (size_t i = 0; i < s->nelfs; ++i) {
+        struct psym_elf* e = s->elfs[i];
+        if (path ? (e->path && strcmp(e->path, path) == 0) : strcmp(e->module, module) == 0) return e;
+    }
+    if (s->nelfs == s->elf_cap) {
+        s->elf_cap = s->elf_cap ? s->elf_cap * 2 : 32;
+        s->elfs = (struct psym_elf**)prealloc(s->elfs, sizeof(struct psym_elf*) * s->elf_cap);
+    }
+    struct psym_elf* e = (struct psym_elf*)pcalloc(1, sizeof(struct psym_elf));
+    e->path = path ? pastrdup(s->arena, path) : NULL;
+    e->module = pastrdup(s->arena, module);
+    s->elfs[s->nelfs++] = e;
+    return e;
+}
+
+static int
+_range_cmp(const void* a, const void* b) {
+    const struct psym_range* x = (const struct psym_range*)a;
+    const struct psym_range* y = (const struct psym_range*)b;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+// 重建地址区间表；已解析的符号表保留，地址缓存作废（模块可能被卸载后重新加载到别处）
+static void
+_load_maps(struct psym* s) {
+    s->maps_time = _mono_ns();
+    for (size_t i = 0; i < s->nelfs; ++i) {
+        s->elfs[i]->load_base = 0;
+    }
+    FILE* fp = fopen("/proc/self/maps", "r");
+    if (!fp) return;
+    size_t cap = s->nranges ? s->nranges : 64;
+    struct psym_range* ranges = (struct psym_range*)pmalloc(sizeof(struct psym_range) * cap);
+    size_t n = 0;
+    char line[4096 + 128];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long start, end, off;
+        char perms[8];
+        int pos = 0;
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &off, &pos) < 4 || pos == 0) continue;
+        char* path = line + pos;
+        size_t len = strlen(path);
+        while (len > 0 && (path[len - 1] == '\n' || path[len - 1] == ' ')) path[--len] = '\0';
+        if (len == 0) continue;
+        const char* module = strrchr(path, '/');
+        module = module ? module + 1 : path;
+        if (n == cap) {
+            cap *= 2;
+            ranges = (struct psym_range*)prealloc(ranges, sizeof(struct psym_range) * cap);
+        }
+        struct psym_elf* e = _elf_get(s, module, path[0] == '/' ? path : NULL);
+        if (off == 0 && (e->load_base == 0 || start < e->load_base)) e->load_base = start;
+        // 只有可执行的映射会出现在栈上
+        if (perms[2] != 'x') continue;
+        ranges[n].start = start;
+        ranges[n].end = end;
+        ranges[n].base = start - off;
+        ranges[n].elf = e;
+        n++;
+    }
+    fclose(fp);
+    // 偏移相对模块最低映射（与 dladdr 的 dli_fbase 一致），这样 .raw 里的偏移与离线查找通用
+    for (size_t i = 0; i < n; ++i) {
+        if (ranges[i].elf->load_base) ranges[i].base = ranges[i].elf->load_base;
+    }
+    qsort(ranges, n, sizeof(struct psym_range), _range_cmp);
+    pfree(s->ranges);
+    s->ranges = ranges;
+    s->nranges = n;
+    pmap_free(s->cache);
+    s->cache = pmap_create();
+}
+
+static const struct psym_range*
+_find_range(struct psym* s, uintptr_t addr) {
+    size_t lo = 0, hi = s->nranges;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->ranges[mid].start <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0 || addr >= s->ranges[lo - 1].end) return NULL;
+    return &s->ranges[lo - 1];
+}
+
+static struct psym_frame*
+_new_frame(struct psym* s, struct psym_elf* e, uint64_t offset) {
+    struct psym_frame* f = (struct psym_frame*)pamalloc(s->arena, sizeof(struct psym_frame));
+    f->module = e ? e->module : "unknown";
+    f->name = NULL;
+    f->offset = offset;
+    f->func = 0;
+    if (e) {
+        if (!e->loaded) _elf_load(e);
+        const struct psym_sym* sym = _elf_find(e, offset + e->vaddr_base);
+        if (sym) {
+            f->name = sym->name;
+            f->func = sym->addr - e->vaddr_base;
+        }
+    }
+    return f;
+}
+
+struct psym*
+psym_create(void) {
+    struct psym* s = psym_create_offline();
+    s->offline = 0;
+    _load_maps(s);
+    return s;
+}
+
+struct psym*
+psym_create_offline(void) {
+    struct psym* s = (struct psym*)pcalloc(1, sizeof(struct psym));
+    s->arena = parena_create();
+    s->cache = pmap_create();
+    s->offline = 1;
+    return s;
+}
+
+void
+psym_free(struct psym* s) {
+    if (!s) return;
+    for (size_t i = 0; i < s->nelfs; ++i) {
+        struct psym_elf* e = s->elfs[i];
+        for (int k = 0; k < 2; ++k) {
+            if (e->maps[k]) munmap(e->maps[k], e->map_sizes[k]);
+        }
+        pfree(e->syms);
+        pfree(e);
+    }
+    pfree(s->elfs);
+    pfree(s->ranges);
+    pmap_free(s->cache);
+    parena_free(s->arena);
+    pfree(s);
+}
+
+void
+psym_add_module(struct psym* s, const char* module, const char* path) {
+    struct psym_elf* e = _elf_get(s, module, NULL);
+    if (!e->path && path) {
+        e->path = pastrdup(s->arena, path);
+    }
+}
+
+const struct psym_frame*
+psym_lookup(struct psym* s, uintptr_t addr) {
+    struct psym_frame* f = (struct psym_frame*)pmap_query(s->cache, (uint64_t)addr);
+    if (f) return f;
+    const struct psym_range* r = _find_range(s, addr);
+    if (!r && !s->offline && _mono_ns() - s->maps_time > MAPS_RELOAD_NS) {
+        _load_maps(s);
+        r = _find_range(s, addr);
+    }
+    f = _new_frame(s, r ? r->elf : NULL, r ? addr - r->base : addr);
+    if (f->name) f->func += r->base;
+    pmap_insert(s->cache, (uint64_t)addr, f);
+    return f;
+}
+
+const struct psym_frame*
+psym_lookup_module(struct psym* s, const char* module, uint64_t offset) {
+    struct psym_elf* e = _elf_get(s, module, NULL);
+    size_t idx = 0;
+    while (s->elfs[idx] != e) idx++;
+    uint64_t key = ((uint64_t)(idx + 1) << 48) | (offset & 0xffffffffffffULL);
+    struct psym_frame* f = (struct psym_frame*)pmap_query(s->cache, key);
+    if (f) return f;
+    f = _new_frame(s, e, offset);
+    pmap_insert(s->cache, key, f);
+    return f;
+}
+
+const char*
+psym_module_path(struct psym* s, const char* module) {
+    for (size_t i = 0; i < s->nelfs; ++i) {
+        if (strcmp(s->elfs[i]->module, module) == 0 && s->elfs[i]->path) return s->elfs[i]->path;
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef _PSYM_H_
+#define _PSYM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+进程内的 ELF 符号化：每个模块读一次 .symtab（没有时用 .dynsym，以及 /usr/lib/debug/.build-id 下的调试文件），
+按地址排序后二分查找，能解析 dladdr 看不到的 static 函数。每个地址的结果都缓存，重复出现的地址只查一次 pmap。
+进程内从 /proc/self/maps 得到模块与加载基址；离线时由调用方登记模块路径，地址为相对加载基址的偏移。
+非线程安全。
+*/
+struct psym;
+
+struct psym_frame {
+    const char* module;     // 模块文件名（basename），未知时为 "unknown"
+    const char* name;       // 函数名，找不到时为 NULL
+    uint64_t offset;        // 相对模块加载基址的偏移
+    uint64_t func;          // 函数的唯一标识（进程内为起始地址，离线为模块内地址），name 为 NULL 时为 0
+};
+
+// 进程内：读取 /proc/self/maps，遇到未知地址时按需重读
+struct psym* psym_create(void);
+// 离线：模块由 psym_add_module 登记
+struct psym* psym_create_offline(void);
+void psym_free(struct psym* s);
+
+void psym_add_module(struct psym* s, const char* module, const char* path);
+
+// 返回的指针在 psym_free 前有效
+const struct psym_frame* psym_lookup(struct psym* s, uintptr_t addr);
+const struct psym_frame* psym_lookup_module(struct psym* s, const char* module, uint64_t offset);
+
+// 当前已知模块的完整路径，module 为 basename；未知时返回 NULL
+const char* psym_module_path(struct psym* s, const char* module);
+
+#endif
@@ -0,0 +1,105 @@
+#include "ptime.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define CALIBRATE_NS        (2 * 1000 * 1000)       // 首次校准忙等 2ms
+#define RECALIBRATE_MIN_NS  (100 * 1000 * 1000)     // 区间太短时不修正
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static int g_available = 0;
+static uint64_t g_base_tsc = 0;
+static uint64_t g_base_ns = 0;
+static uint64_t g_mult = 0;     // ns per tick，32.32 定点
+
+static uint64_t
+mono_ns(void) {
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    return (uint64_t)ti.tv_sec * 1000000000ULL + (uint64_t)ti.tv_nsec;
+}
+
+static int
+tsc_invariant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return 0;
+    }
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 27))) {
+        return 0;   // 没有 rdtscp
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1u << 8)) != 0;
+#else
+    return 0;
+#endif
+}
+
+static uint64_t
+calc_mult(uint64_t dtsc, uint64_t dns) {
+    if (dtsc == 0) return 0;
+    return (uint64_t)(((unsigned __int128)dns << 32) / dtsc);
+}
+
+static void
+calibrate(void) {
+    if (!tsc_invariant()) {
+        return;
+    }
+    uint64_t ns0 = mono_ns();
+    uint64_t tsc0 = ptime_tsc();
+    uint64_t ns1;
+    do {
+        ns1 = mono_ns();
+    } while (ns1 - ns0 < CALIBRATE_NS);
+    uint64_t tsc1 = ptime_tsc();
+    uint64_t mult = calc_mult(tsc1 - tsc0, ns1 - ns0);
+    if (mult == 0) {
+        return;
+    }
+    g_base_tsc = tsc0;
+    g_base_ns = ns0;
+    __atomic_store_n(&g_mult, mult, __ATOMIC_RELAXED);
+    g_available = 1;
+}
+
+int
+ptime_tsc_available(void) {
+    pthread_once(&g_once, calibrate);
+    return g_available;
+}
+
+uint64_t
+ptime_tsc_to_ns(uint64_t ticks) {
+    uint64_t mult = __atomic_load_n(&g_mult, __ATOMIC_RELAXED);
+    return (uint64_t)(((unsigned __int128)ticks * mult) >> 32);
+}
+
+uint64_t
+ptime_tsc_to_mono(uint64_t tsc) {
+    if (tsc >= g_base_tsc) {
+        return g_base_ns + ptime_tsc_to_ns(tsc - g_base_tsc);
+    }
+    return g_base_ns - ptime_tsc_to_ns(g_base_tsc - tsc);
+}
+
+void
+ptime_tsc_recalibrate(void) {
+    if (!g_available) {
+        return;
+    }
+    uint64_t ns = mono_ns();
+    uint64_t tsc = ptime_tsc();
+    if (ns - g_base_ns < RECALIBRATE_MIN_NS || tsc <= g_base_tsc) {
+        return;
+    }
+    uint64_t mult = calc_mult(tsc - g_base_tsc, ns - g_base_ns);
+    if (mult) {
+        __atomic_store_n(&g_mult, mult, __ATOMIC_RELAXED);
+    }
+}
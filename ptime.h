@@ -0,0 +1,38 @@
+#ifndef _PTIME_H_
+#define _PTIME_H_
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+tracing 模式的计时源：invariant TSC。
+hook 里只读 TSC（不陷入 vdso/clock_gettime），累计的耗时保持为 tick，dump 时才换算成 ns。
+换算系数在首次使用时对照 CLOCK_MONOTONIC 校准，之后每次 ptime_tsc_recalibrate 用更长的区间修正。
+CPU 不支持 invariant TSC（或不是 x86）时 ptime_tsc_available 返回 0，调用方回退到 clock_gettime。
+*/
+
+// 1 表示可用（已校准）；线程安全，只校准一次
+int ptime_tsc_available(void);
+
+static inline uint64_t ptime_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+    return __rdtscp(&aux);
+#else
+    return 0;
+#endif
+}
+
+// tick 区间 -> ns
+uint64_t ptime_tsc_to_ns(uint64_t ticks);
+
+// tick 时刻 -> CLOCK_MONOTONIC ns
+uint64_t ptime_tsc_to_mono(uint64_t tsc);
+
+// 用校准基点到现在的整段区间重新计算换算系数
+void ptime_tsc_recalibrate(void);
+
+#endif
@@ -0,0 +1,700 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "punwind.h"
+#include "profile.h"
+
+#include <link.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#if defined(__x86_64__)
+
+// DWARF 寄存器编号（x86_64）
+#define DW_REG_RBP          6
+#define DW_REG_RSP          7
+#define DW_REG_RA           16
+
+#define DW_EH_PE_omit       0xff
+#define DW_EH_PE_absptr     0x00
+#define DW_EH_PE_uleb128    0x01
+#define DW_EH_PE_udata2     0x02
+#define DW_EH_PE_udata4     0x03
+#define DW_EH_PE_udata8     0x04
+#define DW_EH_PE_sleb128    0x09
+#define DW_EH_PE_sdata2     0x0a
+#define DW_EH_PE_sdata4     0x0b
+#define DW_EH_PE_sdata8     0x0c
+#define DW_EH_PE_pcrel      0x10
+#define DW_EH_PE_datarel    0x30
+#define DW_EH_PE_indirect   0x80
+
+#define UW_NONE             0       // 没有可用规则，调用方退回帧指针
+#define UW_CFA_RSP          1
+#define UW_CFA_RBP          2
+#define UW_END              3       // 返回地址 undefined：最外层帧（_start、clone）
+
+#define RBP_SAME            0
+#define RBP_UNKNOWN         INT16_MIN
+#define STATE_STACK_DEPTH   8
+
+struct uw_row {
+    uint32_t pc;            // 相对模块 lo 的偏移，本行规则一直生效到下一行
+    int32_t cfa_off;
+    int16_t rbp_off;        // rbp 保存在 CFA + rbp_off；RBP_SAME 表示不变
+    int8_t ra_off;          // 返回地址保存在 CFA + ra_off，通常是 -8
+    uint8_t kind;
+};
+
+struct uw_module {
+    uintptr_t lo;           // 可执行段的地址范围
+    uintptr_t hi;
+    const void* eh_hdr;     // .eh_frame_hdr 地址，和 lo/hi 一起识别同一个模块
+    struct uw_row* rows;
+    uint32_t nrows;
+    uint32_t cap;
+};
+
+struct uw_table {
+    struct uw_module* mods; // 按 lo 排序
+    size_t nmods;
+    size_t cap;
+    unsigned long long adds;
+    unsigned long long subs;
+    struct uw_row** dead;   // 退休时记下的、新表里已经没有的模块的规则
+    size_t ndead;
+    struct uw_table* next;  // 退休链表
+};
+
+// 当前规则表，只在 punwind_load 里替换
+static struct uw_table* g_table = NULL;
+// 被替换、还没释放的旧表；没有信号处理器在回溯时才释放
+static struct uw_table* g_retired = NULL;
+// 正在 punwind_enter/punwind_leave 之间的回溯数
+static int g_readers = 0;
+// punwind_load 可能同时在 VM 线程（start）和聚合线程上调用
+static pthread_mutex_t g_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 执行 CFA 指令时的寄存器规则
+struct uw_state {
+    uint8_t cfa_reg;        // 0 表示 CFA 由表达式给出
+    int64_t cfa_off;
+    int rbp_saved;          // 0 不变，1 保存在 CFA + rbp_off，-1 无法表示
+    int64_t rbp_off;
+    int ra_rule;            // 1 保存在 CFA + ra_off，0 undefined，-1 无法表示
+    int64_t ra_off;
+};
+
+struct uw_cie {
+    uint64_t code_align;
+    int64_t data_align;
+    uint64_t ra_reg;
+    uint8_t fde_enc;
+    int has_aug;
+    const uint8_t* insns;
+    const uint8_t* end;
+};
+
+static uint64_t
+_uleb(const uint8_t** pp, const uint8_t* end) {
+    uint64_t v = 0;
+    int shift = 0;
+    const uint8_t* p = *pp;
+    while (p < end) {
+        uint8_t b = *p++;
+        if (shift < 64) v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)) break;
+    }
+    *pp = p;
+    return v;
+}
+
+static int64_t
+_sleb(const uint8_t** pp, const uint8_t* end) {
+    int64_t v = 0;
+    int shift = 0;
+    uint8_t b = 0;
+    const uint8_t* p = *pp;
+    while (p < end) {
+        b = *p++;
+        if (shift < 64) v |= (int64_t)((uint64_t)(b & 0x7f) << shift);
+        shift += 7;
+        if (!(b & 0x80)) break;
+    }
+    if (shift < 64 && (b & 0x40)) v |= -((int64_t)1 << shift);
+    *pp = p;
+    return v;
+}
+
+// 读取按 DW_EH_PE_* 编码的指针，datarel 相对 .eh_frame_hdr 起始；失败返回 0
+static int
+_read_encoded(const uint8_t** pp, const uint8_t* end, uint8_t enc, uintptr_t datarel, uintptr_t* out) {
+    const uint8_t* p = *pp;
+    uintptr_t base = (uintptr_t)p;
+    uint64_t v = 0;
+    if (enc == DW_EH_PE_omit) return 0;
+    switch (enc & 0x0f) {
+    case DW_EH_PE_absptr:
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8:
+        if (end - p < 8) return 0;
+        memcpy(&v, p, 8); p += 8;
+        break;
+    case DW_EH_PE_udata4: {
+        uint32_t x;
+        if (end - p < 4) return 0;
+        memcpy(&x, p, 4); p += 4; v = x;
+        break;
+    }
+    case DW_EH_PE_sdata4: {
+        int32_t x;
+        if (end - p < 4) return 0;
+        memcpy(&x, p, 4); p += 4; v = (uint64_t)(int64_t)x;
+        break;
+    }
+    case DW_EH_PE_udata2: {
+        uint16_t x;
+        if (end - p < 2) return 0;
+        memcpy(&x, p, 2); p += 2; v = x;
+        break;
+    }
+    case DW_EH_PE_sdata2: {
+        int16_t x;
+        if (end - p < 2) return 0;
+        memcpy(&x, p, 2); p += 2; v = (uint64_t)(int64_t)x;
+        break;
+    }
+    case DW_EH_PE_uleb128: v = _uleb(&p, end); break;
+    case DW_EH_PE_sleb128: v = (uint64_t)_sleb(&p, end); break;
+    default: return 0;
+    }
+    switch (enc & 0x70) {
+    case 0: break;
+    case DW_EH_PE_pcrel: v += base; break;
+    case DW_EH_PE_datarel: v += datarel; break;
+    default: return 0;
+    }
+    if ((enc & DW_EH_PE_indirect) && v) v = *(const uintptr_t*)(uintptr_t)v;
+    *pp = p;
+    *out = (uintptr_t)v;
+    return 1;
+}
+
+// 读取一条 CIE/FDE 的长度，返回内容起点，*next 为下一条记录
+static const uint8_t*
+_record(const uint8_t* p, const uint8_t** next) {
+    uint32_t len32;
+    memcpy(&len32, p, 4);
+    p += 4;
+    uint64_t len = len32;
+    if (len32 == 0xffffffffu) {
+        memcpy(&len, p, 8);
+        p += 8;
+    }
+    if (len == 0) return NULL;
+    *next = p + len;
+    return p;
+}
+
+static int
+_parse_cie(const uint8_t* p, struct uw_cie* cie) {
+    const uint8_t* end;
+    p = _record(p, &end);
+    if (!p) return 0;
+    uint32_t id;
+    memcpy(&id, p, 4);
+    p += 4;
+    if (id != 0) return 0;
+    uint8_t version = *p++;
+    const char* aug = (const char*)p;
+    p += strlen(aug) + 1;
+    if (aug[0] && aug[0] != 'z') return 0;     // 不认识的增强串无法跳过
+    memset(cie, 0, sizeof(*cie));
+    cie->fde_enc = DW_EH_PE_absptr;
+    cie->code_align = _uleb(&p, end);
+    cie->data_align = _sleb(&p, end);
+    cie->ra_reg = version == 1 ? *p++ : _uleb(&p, end);
+    if (aug[0] == 'z') {
+        cie->has_aug = 1;
+        uint64_t aug_len = _uleb(&p, end);
+        const uint8_t* aug_end = p + aug_len;
+        for (const char* a = aug + 1; *a && p < aug_end; ++a) {
+            uintptr_t dummy;
+            switch (*a) {
+            case 'R': cie->fde_enc = *p++; break;
+            case 'L': p++; break;
+            case 'P': {
+                uint8_t enc = *p++;
+                // personality 可能是 indirect，这里只需要跳过，不解引用
+                if (!_read_encoded(&p, aug_end, enc & ~DW_EH_PE_indirect, 0, &dummy)) return 0;
+                break;
+            }
+            case 'S': case 'B': break;
+            default: p = aug_end; break;
+            }
+        }
+        p = aug_end;
+    }
+    cie->insns = p;
+    cie->end = end;
+    return p <= end;
+}
+
+static void
+_emit_row(struct uw_module* m, uintptr_t pc, const struct uw_state* st) {
+    if (pc < m->lo || pc >= m->hi || pc - m->lo > UINT32_MAX) return;
+    struct uw_row r;
+    memset(&r, 0, sizeof(r));
+    r.pc = (uint32_t)(pc - m->lo);
+    r.kind = UW_NONE;
+    if (st->ra_rule == 0) {
+        r.kind = UW_END;
+    } else if (st->ra_rule > 0 && st->cfa_reg && st->ra_off >= INT8_MIN && st->ra_off <= INT8_MAX
+        && st->cfa_off >= INT32_MIN && st->cfa_off <= INT32_MAX) {
+        if (st->cfa_reg == DW_REG_RSP) r.kind = UW_CFA_RSP;
+        else if (st->cfa_reg == DW_REG_RBP) r.kind = UW_CFA_RBP;
+        if (r.kind != UW_NONE) {
+            r.cfa_off = (int32_t)st->cfa_off;
+            r.ra_off = (int8_t)st->ra_off;
+            if (st->rbp_saved == 0) r.rbp_off = RBP_SAME;
+            else if (st->rbp_saved > 0 && st->rbp_off > INT16_MIN && st->rbp_off <= INT16_MAX && st->rbp_off != 0) r.rbp_off = (int16_t)st->rbp_off;
+            else r.rbp_off = RBP_UNKNOWN;
+        }
+    }
+    if (m->nrows > 0) {
+        struct uw_row* last = &m->rows[m->nrows - 1];
+        // .eh_frame_hdr 按起始地址排好序；同一地址后写的覆盖前面的（上一个函数的结束行）
+        if (last->pc == r.pc) {
+            *last = r;
+            if (m->nrows > 1) {
+                struct uw_row* prev = &m->rows[m->nrows - 2];
+                if (prev->kind == r.kind && prev->cfa_off == r.cfa_off && prev->rbp_off == r.rbp_off && prev->ra_off == r.ra_off) m->nrows--;
+            }
+            return;
+        }
+        if (last->pc > r.pc) return;
+        if (last->kind == r.kind && last->cfa_off == r.cfa_off && last->rbp_off == r.rbp_off && last->ra_off == r.ra_off) return;
+    }
+    if (m->nrows == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 256;
+        m->rows = (struct uw_row*)prealloc(m->rows, m->cap * sizeof(struct uw_row));
+    }
+    m->rows[m->nrows++] = r;
+}
+
+static void
+_set_reg(struct uw_state* st, uint64_t reg, int rule, int64_t off) {
+    if (reg == DW_REG_RBP) {
+        st->rbp_saved = rule;
+        st->rbp_off = off;
+    } else if (reg == DW_REG_RA) {
+        st->ra_rule = rule;
+        st->ra_off = off;
+    }
+}
+
+/*
+执行一段 CFA 指令。emit 为 NULL 时只更新 state（CIE 的初始指令），否则每次 advance 前输出当前行。
+*/
+static void
+_run_cfa(const struct uw_cie* cie, const uint8_t* p, const uint8_t* end, uintptr_t* loc,
+        struct uw_state* st, const struct uw_state* init, struct uw_module* emit) {
+    struct uw_state stack[STATE_STACK_DEPTH];
+    int sp = 0;
+    while (p < end) {
+        uint8_t op = *p++;
+        uint8_t low = op & 0x3f;
+        uint64_t delta = 0, reg;
+        int64_t off;
+        switch (op >> 6) {
+        case 1:     // DW_CFA_advance_loc
+            delta = low;
+            goto advance;
+        case 2:     // DW_CFA_offset
+            off = (int64_t)_uleb(&p, end) * cie->data_align;
+            _set_reg(st, low, 1, off);
+            continue;
+        case 3:     // DW_CFA_restore
+            if (low == DW_REG_RBP) { st->rbp_saved = init->rbp_saved; st->rbp_off = init->rbp_off; }
+            else if (low == DW_REG_RA) { st->ra_rule = init->ra_rule; st->ra_off = init->ra_off; }
+            continue;
+        default:
+            break;
+        }
+        switch (op) {
+        case 0x00: continue;                                        // nop
+        case 0x01: {                                                // set_loc
+            uintptr_t v;
+            if (!_read_encoded(&p, end, cie->fde_enc, 0, &v)) return;
+            if (emit) _emit_row(emit, *loc, st);
+            *loc = v;
+            continue;
+        }
+        case 0x02: delta = *p++; goto advance;                     // advance_loc1
+        case 0x03: { uint16_t d; memcpy(&d, p, 2); p += 2; delta = d; goto advance; }
+        case 0x04: { uint32_t d; memcpy(&d, p, 4); p += 4; delta = d; goto advance; }
+        case 0x05:                                                  // offset_extended
+            reg = _uleb(&p, end);
+            off = (int64_t)_uleb(&p, end) * cie->data_align;
+            _set_reg(st, reg, 1, off);
+            continue;
+        case 0x06:                                                  // restore_extended
+            reg = _uleb(&p, end);
+            if (reg == DW_REG_RBP) { st->rbp_saved = init->rbp_saved; st->rbp_off = init->rbp_off; }
+            else if (reg == DW_REG_RA) { st->ra_rule = init->ra_rule; st->ra_off = init->ra_off; }
+            continue;
+        case 0x07:                                                  // undefined
+            reg = _uleb(&p, end);
+            if (reg == DW_REG_RA) _set_reg(st, reg, 0, 0);
+            else if (reg == DW_REG_RBP) _set_reg(st, reg, -1, 0);
+            continue;
+        case 0x08:                                                  // same_value
+            reg = _uleb(&p, end);
+            if (reg == DW_REG_RBP) _set_reg(st, reg, 0, 0);
+            continue;
+        case 0x09:                                                  // register
+            reg = _uleb(&p, end);
+            _uleb(&p, end);
+            _set_reg(st, reg, -1, 0);
+            continue;
+        case 0x0a:                                                  // remember_state
+            if (sp < STATE_STACK_DEPTH) stack[sp] = *st;
+            sp++;
+            continue;
+        case 0x0b:                                                  // restore_state
+            if (sp > 0 && --sp < STATE_STACK_DEPTH) *st = stack[sp];
+            continue;
+        case 0x0c:                                                  // def_cfa
+            st->cfa_reg = (uint8_t)_uleb(&p, end);
+            st->cfa_off = (int64_t)_uleb(&p, end);
+            continue;
+        case 0x0d:                                                  // def_cfa_register
+            st->cfa_reg = (uint8_t)_uleb(&p, end);
+            continue;
+        case 0x0e:                                                  // def_cfa_offset
+            st->cfa_off = (int64_t)_uleb(&p, end);
+            continue;
+        case 0x0f:                                                  // def_cfa_expression
+            p += _uleb(&p, end);
+            st->cfa_reg = 0;
+            continue;
+        case 0x10:                                                  // expression
+        case 0x16:                                                  // val_expression
+            reg = _uleb(&p, end);
+            p += _uleb(&p, end);
+            _set_reg(st, reg, -1, 0);
+            continue;
+        case 0x11:                                                  // offset_extended_sf
+            reg = _uleb(&p, end);
+            off = _sleb(&p, end) * cie->data_align;
+            _set_reg(st, reg, 1, off);
+            continue;
+        case 0x12:                                                  // def_cfa_sf
+            st->cfa_reg = (uint8_t)_uleb(&p, end);
+            st->cfa_off = _sleb(&p, end) * cie->data_align;
+            continue;
+        case 0x13:                                                  // def_cfa_offset_sf
+            st->cfa_off = _sleb(&p, end) * cie->data_align;
+            continue;
+        case 0x14:                                                  // val_offset
+        case 0x15:                                                  // val_offset_sf
+            reg = _uleb(&p, end);
+            if (op == 0x14) _uleb(&p, end); else _sleb(&p, end);
+            _set_reg(st, reg, -1, 0);
+            continue;
+        case 0x2e:                                                  // GNU_args_size
+            _uleb(&p, end);
+            continue;
+        case 0x2f:                                                  // GNU_negative_offset_extended
+            reg = _uleb(&p, end);
+            off = -(int64_t)_uleb(&p, end) * cie->data_align;
+            _set_reg(st, reg, 1, off);
+            continue;
+        default:                                                    // 不认识的指令，后面的规则都不可信
+            st->cfa_reg = 0;
+            if (emit) _emit_row(emit, *loc, st);
+            return;
+        }
+    advance:
+        if (emit) _emit_row(emit, *loc, st);
+        *loc += delta * cie->code_align;
+    }
+}
+
+static void
+_add_fde(struct uw_module* m, const uint8_t* fde) {
+    const uint8_t* end;
+    const uint8_t* p = _record(fde, &end);
+    if (!p) return;
+    int32_t cie_off;
+    memcpy(&cie_off, p, 4);
+    if (cie_off == 0) return;       // 是 CIE
+    struct uw_cie cie;
+    if (!_parse_cie(p - cie_off, &cie)) return;
+    p += 4;
+    uintptr_t start, range;
+    if (!_read_encoded(&p, end, cie.fde_enc, 0, &start)) return;
+    if (!_read_encoded(&p, end, cie.fde_enc & 0x0f, 0, &range)) return;
+    if (cie.has_aug) {
+        uint64_t n = _uleb(&p, end);
+        p += n;
+    }
+    if (cie.ra_reg != DW_REG_RA) return;
+
+    struct uw_state init;
+    memset(&init, 0, sizeof(init));
+    init.ra_rule = -1;
+    uintptr_t loc = start;
+    _run_cfa(&cie, cie.insns, cie.end, &loc, &init, &init, NULL);
+    struct uw_state st = init;
+    loc = start;
+    _run_cfa(&cie, p, end, &loc, &st, &init, m);
+    _emit_row(m, loc, &st);
+    // 函数结束之后到下一个 FDE 之前没有规则
+    struct uw_state none;
+    memset(&none, 0, sizeof(none));
+    none.ra_rule = -1;
+    _emit_row(m, start + range, &none);
+}
+
+static int
+_count_cb(struct dl_phdr_info* info, size_t size, void* ud) {
+    (void)info;
+    unsigned long long* v = (unsigned long long*)ud;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        v[0] = info->dlpi_adds;
+        v[1] = info->dlpi_subs;
+    }
+    return 1;   // 只看第一个模块
+}
+
+struct uw_load {
+    struct uw_table* t;
+    const struct uw_table* cur;
+};
+
+// 旧表里同一个模块（lo、hi、.eh_frame_hdr 都相同）
+static const struct uw_module*
+_find_module(const struct uw_table* cur, uintptr_t lo, uintptr_t hi, const void* eh_hdr) {
+    if (!cur) return NULL;
+    size_t l = 0, r = cur->nmods;
+    while (l < r) {
+        size_t mid = (l + r) / 2;
+        if (cur->mods[mid].lo < lo) l = mid + 1; else r = mid;
+    }
+    for (; l < cur->nmods && cur->mods[l].lo == lo; ++l) {
+        if (cur->mods[l].hi == hi && cur->mods[l].eh_hdr == eh_hdr) return &cur->mods[l];
+    }
+    return NULL;
+}
+
+static void
+_push_module(struct uw_table* t, const struct uw_module* m) {
+    if (t->nmods == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 16;
+        t->mods = (struct uw_module*)prealloc(t->mods, t->cap * sizeof(struct uw_module));
+    }
+    t->mods[t->nmods++] = *m;
+}
+
+static int
+_load_cb(struct dl_phdr_info* info, size_t size, void* ud) {
+    (void)size;
+    struct uw_load* ld = (struct uw_load*)ud;
+    const ElfW(Phdr)* hdr = NULL;
+    uintptr_t lo = UINTPTR_MAX, hi = 0;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_GNU_EH_FRAME) {
+            hdr = ph;
+        } else if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {
+            uintptr_t a = info->dlpi_addr + ph->p_vaddr;
+            if (a < lo) lo = a;
+            if (a + ph->p_memsz > hi) hi = a + ph->p_memsz;
+        }
+    }
+    if (!hdr || lo >= hi) return 0;
+
+    // 已经展开过的模块直接共用规则，只解析新加载的
+    const struct uw_module* old = _find_module(ld->cur, lo, hi, (const void*)(info->dlpi_addr + hdr->p_vaddr));
+    if (old) {
+        _push_module(ld->t, old);
+        return 0;
+    }
+
+    /* .eh_frame_hdr: version, eh_frame_ptr_enc, fde_count_enc, table_enc, eh_frame_ptr, fde_count, table */
+    const uint8_t* base = (const uint8_t*)(info->dlpi_addr + hdr->p_vaddr);
+    const uint8_t* end = base + hdr->p_memsz;
+    const uint8_t* p = base + 4;
+    uintptr_t eh_frame, count;
+    if (base[0] != 1 || base[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) return 0;
+    if (!_read_encoded(&p, end, base[1], (uintptr_t)base, &eh_frame)) return 0;
+    if (!_read_encoded(&p, end, base[2], (uintptr_t)base, &count)) return 0;
+    if ((uintptr_t)(end - p) / 8 < count) return 0;
+
+    struct uw_module m;
+    memset(&m, 0, sizeof(m));
+    m.lo = lo;
+    m.hi = hi;
+    m.eh_hdr = base;
+    for (uintptr_t i = 0; i < count; ++i) {
+        int32_t fde_off;
+        memcpy(&fde_off, p + i * 8 + 4, 4);
+        _add_fde(&m, base + fde_off);
+    }
+    if (m.nrows == 0) {
+        pfree(m.rows);
+        return 0;
+    }
+    m.rows = (struct uw_row*)prealloc(m.rows, m.nrows * sizeof(struct uw_row));
+    _push_module(ld->t, &m);
+    return 0;
+}
+
+static int
+_mod_cmp(const void* a, const void* b) {
+    uintptr_t x = ((const struct uw_module*)a)->lo;
+    uintptr_t y = ((const struct uw_module*)b)->lo;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// 记下旧表里新表不再引用的规则，旧表释放时一起释放
+static void
+_retire(struct uw_table* old, const struct uw_table* t) {
+    old->dead = old->nmods ? (struct uw_row**)pmalloc(old->nmods * sizeof(struct uw_row*)) : NULL;
+    for (size_t i = 0; old->dead && i < old->nmods; ++i) {
+        const struct uw_module* m = &old->mods[i];
+        if (!_find_module(t, m->lo, m->hi, m->eh_hdr)) old->dead[old->ndead++] = m->rows;
+    }
+    old->next = g_retired;
+    g_retired = old;
+}
+
+// 调用方持有 g_load_lock。g_table 已经换掉，之后进入的回溯只会读到新表
+static void
+_reclaim(void) {
+    if (!g_retired || __atomic_load_n(&g_readers, __ATOMIC_SEQ_CST) != 0) return;
+    struct uw_table* t = g_retired;
+    g_retired = NULL;
+    while (t) {
+        struct uw_table* next = t->next;
+        for (size_t i = 0; i < t->ndead; ++i) pfree(t->dead[i]);
+        pfree(t->dead);
+        pfree(t->mods);
+        pfree(t);
+        t = next;
+    }
+}
+
+int
+punwind_load(void) {
+    unsigned long long gen[2] = {0, 0};
+    dl_iterate_phdr(_count_cb, gen);
+    pthread_mutex_lock(&g_load_lock);
+    _reclaim();
+    struct uw_table* cur = g_table;
+    if (cur && (gen[0] | gen[1]) && cur->adds == gen[0] && cur->subs == gen[1]) {
+        pthread_mutex_unlock(&g_load_lock);
+        return (int)cur->nmods;
+    }
+    struct uw_table* t = (struct uw_table*)pcalloc(1, sizeof(struct uw_table));
+    if (!t) {
+        pthread_mutex_unlock(&g_load_lock);
+        return -1;
+    }
+    t->adds = gen[0];
+    t->subs = gen[1];
+    struct uw_load ld = { t, cur };
+    dl_iterate_phdr(_load_cb, &ld);
+    qsort(t->mods, t->nmods, sizeof(struct uw_module), _mod_cmp);
+    __atomic_store_n(&g_table, t, __ATOMIC_SEQ_CST);
+    if (cur) _retire(cur, t);
+    _reclaim();
+    pthread_mutex_unlock(&g_load_lock);
+    return (int)t->nmods;
+}
+
+void
+punwind_enter(void) {
+    __atomic_add_fetch(&g_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+punwind_leave(void) {
+    __atomic_sub_fetch(&g_readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline int
+_read_word(uintptr_t addr, uintptr_t lo, uintptr_t hi, uintptr_t* out) {
+    if (addr < lo || addr > hi - sizeof(uintptr_t) || (addr & (sizeof(uintptr_t) - 1))) return 0;
+    *out = *(const uintptr_t*)addr;
+    return 1;
+}
+
+int
+punwind_step(uintptr_t* pc, uintptr_t* sp, uintptr_t* bp, uintptr_t lo, uintptr_t hi, int leaf) {
+    // 和 punwind_load 的换表、读 g_readers 配对：先登记再读表
+    const struct uw_table* t = __atomic_load_n(&g_table, __ATOMIC_SEQ_CST);
+    if (!t || t->nmods == 0) return 0;
+    uintptr_t addr = leaf ? *pc : *pc - 1;
+
+    size_t l = 0, r = t->nmods;
+    while (l < r) {
+        size_t mid = (l + r) / 2;
+        if (t->mods[mid].lo <= addr) l = mid + 1; else r = mid;
+    }
+    if (l == 0) return 0;
+    const struct uw_module* m = &t->mods[l - 1];
+    if (addr >= m->hi) return 0;
+
+    uint32_t off = (uint32_t)(addr - m->lo);
+    l = 0; r = m->nrows;
+    while (l < r) {
+        size_t mid = (l + r) / 2;
+        if (m->rows[mid].pc <= off) l = mid + 1; else r = mid;
+    }
+    if (l == 0) return 0;
+    const struct uw_row* row = &m->rows[l - 1];
+    if (row->kind == UW_NONE) return 0;
+    if (row->kind == UW_END) return -1;
+
+    uintptr_t cfa = (row->kind == UW_CFA_RSP ? *sp : *bp) + (intptr_t)row->cfa_off;
+    uintptr_t ra, nbp = *bp;
+    if (cfa <= *sp || cfa > hi) return -1;
+    if (!_read_word(cfa + (intptr_t)row->ra_off, lo, hi, &ra)) return -1;
+    if (row->rbp_off == RBP_UNKNOWN) {
+        nbp = 0;
+    } else if (row->rbp_off != RBP_SAME && !_read_word(cfa + (intptr_t)row->rbp_off, lo, hi, &nbp)) {
+        return -1;
+    }
+    if (ra == 0) return -1;
+    *pc = ra;
+    *sp = cfa;
+    *bp = nbp;
+    return 1;
+}
+
+#else
+
+int
+punwind_load(void) {
+    return -1;
+}
+
+void
+punwind_enter(void) {
+}
+
+void
+punwind_leave(void) {
+}
+
+int
+punwind_step(uintptr_t* pc, uintptr_t* sp, uintptr_t* bp, uintptr_t lo, uintptr_t hi, int leaf) {
+    (void)pc; (void)sp; (void)bp; (void)lo; (void)hi; (void)leaf;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _PUNWIND_H_
+#define _PUNWIND_H_
+
+#include <stdint.h>
+
+/*
+基于 .eh_frame CFI 的 C 栈回溯（x86_64）：punwind_load 在信号处理器之外遍历已加载模块，
+通过 .eh_frame_hdr 找到每个 FDE，执行 CFA 指令，预先展开成按 pc 排序的紧凑规则表
+（CFA = rsp/rbp + off，rbp 与返回地址保存在 CFA 的哪个偏移）。
+punwind_step 只做二分查找和有界的栈内存读取，可以在信号处理器里调用。
+模块集合变化（dlpi_adds/dlpi_subs）时换一张新表：仍在的模块共用原来的规则，只解析新加载的模块。
+旧表退休后，等没有回溯在 punwind_enter/punwind_leave 之间时才释放。
+*/
+
+// 模块集合（dlopen/dlclose）变化时更新规则表；没变化时只读一次计数。返回已覆盖的模块数，失败返回 -1
+int punwind_load(void);
+
+// 包住一次完整的回溯（信号处理器里可用），期间读到的规则表不会被释放
+void punwind_enter(void);
+void punwind_leave(void);
+
+/*
+把 (pc, sp, bp) 从当前帧推到调用者帧。leaf 为 0 时 pc 是返回地址，按 pc - 1 查找规则。
+栈读取限制在 [lo, hi) 内。返回 1 成功；返回 0 表示没有可用规则（地址不在任何模块的 CFI 里，
+或规则是 DWARF 表达式），调用方可以退回帧指针回溯；返回 -1 表示已到最外层帧或栈数据无效。
+*/
+int punwind_step(uintptr_t* pc, uintptr_t* sp, uintptr_t* bp, uintptr_t lo, uintptr_t hi, int leaf);
+
+#endif
@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# If invoked by /bin/sh, re-exec with bash to support 'pipefail'
+if [ -z "${BASH_VERSION:-}" ]; then exec /bin/bash "$0" "$@"; fi
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+LUA_BIN="$ROOT/3rd/lua-5.4.8/install/bin/lua"
+
+rm -f continuous-last2s.pb.gz continuous-last2s.folded continuous-all.folded
+
+"$LUA_BIN" example_continuous.lua
+
+echo "== last 2s =="
+awk '{print $NF"\t"$0}' continuous-last2s.folded | sort -nr | head -n 5 | cut -f2-
+echo "== all windows =="
+awk '{print $NF"\t"$0}' continuous-all.folded | sort -nr | head -n 5 | cut -f2-
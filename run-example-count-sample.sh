@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# If invoked by /bin/sh, re-exec with bash to support 'pipefail'
+if [ -z "${BASH_VERSION:-}" ]; then exec /bin/bash "$0" "$@"; fi
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+LUA_BIN="${LUA_BIN:-$ROOT/3rd/lua-5.4.8/install/bin/lua}"
+FLAME="$HOME/software/FlameGraph/flamegraph.pl"
+
+# LUA_MASKCOUNT 抽样不依赖 LUA_PROF_TRAP，LUA_BIN 可以指向原版 lua 5.4（配合 make stock 编译的 luaprofilec.so）
+"$LUA_BIN" example_sample.lua count_sample
+
+echo "$FLAME cpu-samples.txt > cpu-samples.svg"
+"$FLAME" cpu-samples.txt > cpu-samples.svg
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+./3rd/lua-5.4.8/install/bin/lua example_hook_cost.lua
\ No newline at end of file
@@ -0,0 +1,16 @@
+#!/bin/bash
+
+# If invoked by /bin/sh, re-exec with bash to support 'pipefail'
+if [ -z "${BASH_VERSION:-}" ]; then exec /bin/bash "$0" "$@"; fi
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+LUA_BIN="${LUA_BIN:-$ROOT/3rd/lua-5.4.8/install/bin/lua}"
+FLAME="$HOME/software/FlameGraph/flamegraph.pl"
+
+# 混合栈：C 栈按 .eh_frame 回溯，lua 不需要带帧指针编译
+"$LUA_BIN" example_sample.lua sample mixed
+
+echo "$FLAME cpu-samples.txt > cpu-samples-mixed.svg"
+"$FLAME" cpu-samples.txt > cpu-samples-mixed.svg
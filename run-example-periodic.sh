@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# If invoked by /bin/sh, re-exec with bash to support 'pipefail'
+if [ -z "${BASH_VERSION:-}" ]; then exec /bin/bash "$0" "$@"; fi
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+LUA_BIN="${LUA_BIN:-$ROOT/3rd/lua-5.4.8/install/bin/lua}"
+
+# 同一个周期性负载分别用固定周期与 Poisson 间隔抽样，对比 hotspot 的占比
+"$LUA_BIN" example_periodic.lua fixed
+"$LUA_BIN" example_periodic.lua poisson
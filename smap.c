@@ -12,6 +12,7 @@ typedef struct smap_entry {
 struct smap {
     size_t bucket_count;
     smap_entry_t** buckets;
+    struct parena* arena;
 };
 
 static inline uint64_t hash64_str(const char* s) {
@@ -25,8 +26,9 @@ static inline uint64_t hash64_str(const char* s) {
     return h;
 }
 
-static inline char* pstrdup_local(const char* s) {
+static inline char* pstrdup_local(struct smap* m, const char* s) {
     if (!s) return NULL;
+    if (m->arena) return pastrdup(m->arena, s);
     size_t n = strlen(s);
     char* d = (char*)pmalloc(n + 1);
     memcpy(d, s, n);
@@ -36,7 +38,7 @@ static inline char* pstrdup_local(const char* s) {
 
 static inline size_t smap_index(struct smap* m, uint64_t h) { return (size_t)(h & (m->bucket_count - 1)); }
 
-smap_t* smap_create(size_t bucket_count) {
+smap_t* smap_create(size_t bucket_count, struct parena* arena) {
     if (bucket_count == 0) bucket_count = 1024;
     size_t b = 1;
     while (b < bucket_count) b <<= 1;
@@ -44,12 +46,14 @@ smap_t* smap_create(size_t bucket_count) {
     m->bucket_count = b;
     m->buckets = (smap_entry_t**)pmalloc(sizeof(smap_entry_t*) * b);
     memset(m->buckets, 0, sizeof(smap_entry_t*) * b);
+    m->arena = arena;
     return m;
 }
 
 void smap_free(smap_t* m) {
     if (!m) return;
-    for (size_t i = 0; i < m->bucket_count; i++) {
+    // entries in an arena are released together with the arena
+    for (size_t i = 0; m->arena == NULL && i < m->bucket_count; i++) {
         smap_entry_t* e = m->buckets[i];
         while (e) {
             smap_entry_t* next = e->next;
@@ -75,9 +79,9 @@ void* smap_set(smap_t* m, const char* key, void* value) {
         }
         e = e->next;
     }
-    smap_entry_t* ne = (smap_entry_t*)pmalloc(sizeof(*ne));
+    smap_entry_t* ne = m->arena ? (smap_entry_t*)pamalloc(m->arena, sizeof(*ne)) : (smap_entry_t*)pmalloc(sizeof(*ne));
     ne->hash = h;
-    ne->key = pstrdup_local(key);
+    ne->key = pstrdup_local(m, key);
     ne->value = value;
     ne->next = m->buckets[bi];
     m->buckets[bi] = ne;
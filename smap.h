@@ -3,8 +3,10 @@
 #include <stdint.h>
 
 typedef struct smap smap_t;
+struct parena;
 
-smap_t* smap_create(size_t bucket_count);
+// arena 非空时 entry 与 key 从 arena 分配，smap_free 不再逐个释放
+smap_t* smap_create(size_t bucket_count, struct parena* arena);
 void    smap_free(smap_t* m);
 
 // set/replace value for key; returns previous value (or NULL)
@@ -0,0 +1,176 @@
+#include "stackmap.h"
+#include "profile.h"
+
+struct stackmap_entry {
+    uint64_t hash;
+    uint32_t offset;    // frames 在 frame_pool 中的起始位置
+    uint32_t depth;
+};
+
+struct stackmap {
+    struct stackmap_entry* entries;
+    size_t entry_count;
+    size_t entry_cap;
+    uint64_t* values;   // entry i 的计数位于 values[i * nvalues]
+    int nvalues;
+    uint32_t* frame_pool;
+    size_t pool_used;
+    size_t pool_cap;
+    uint32_t* index;    // 开放寻址，存 entry 下标 + 1，0 表示空
+    size_t index_size;  // power of 2
+};
+
+#define DEFAULT_STACKMAP_INDEX_SIZE     1024
+
+static inline uint64_t
+_stackmap_hash(const uint32_t* frames, int depth) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)depth;
+    int i;
+    for (i = 0; i < depth; i++) {
+        h ^= frames[i];
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct stackmap *
+stackmap_create() {
+    return stackmap_create_n(1);
+}
+
+struct stackmap *
+stackmap_create_n(int nvalues) {
+    struct stackmap* sm = (struct stackmap*)pmalloc(sizeof(*sm));
+    sm->entries = NULL;
+    sm->entry_count = 0;
+    sm->entry_cap = 0;
+    sm->values = NULL;
+    sm->nvalues = nvalues > 0 ? nvalues : 1;
+    sm->frame_pool = NULL;
+    sm->pool_used = 0;
+    sm->pool_cap = 0;
+    sm->index_size = DEFAULT_STACKMAP_INDEX_SIZE;
+    sm->index = (uint32_t*)pcalloc(sm->index_size, sizeof(uint32_t));
+    return sm;
+}
+
+void
+stackmap_free(struct stackmap* sm) {
+    if (!sm) return;
+    pfree(sm->entries);
+    pfree(sm->values);
+    pfree(sm->frame_pool);
+    pfree(sm->index);
+    pfree(sm);
+}
+
+static void
+_stackmap_reindex(struct stackmap* sm, size_t new_sz) {
+    uint32_t* index = (uint32_t*)pcalloc(new_sz, sizeof(uint32_t));
+    size_t mask = new_sz - 1;
+    size_t i;
+    for (i = 0; i < sm->entry_count; i++) {
+        size_t pos = (size_t)sm->entries[i].hash & mask;
+        while (index[pos]) {
+            pos = (pos + 1) & mask;
+        }
+        index[pos] = (uint32_t)(i + 1);
+    }
+    pfree(sm->index);
+    sm->index = index;
+    sm->index_size = new_sz;
+}
+
+uint32_t
+stackmap_add(struct stackmap* sm, const uint32_t* frames, int depth, uint64_t count) {
+    uint64_t values[1] = { count };
+    assert(sm->nvalues == 1);
+    return stackmap_add_n(sm, frames, depth, values);
+}
+
+static inline void
+_stackmap_accumulate(struct stackmap* sm, uint32_t idx, const uint64_t* values) {
+    uint64_t* dst = sm->values + (size_t)idx * sm->nvalues;
+    int i;
+    for (i = 0; i < sm->nvalues; i++) {
+        dst[i] += values[i];
+    }
+}
+
+uint32_t
+stackmap_add_n(struct stackmap* sm, const uint32_t* frames, int depth, const uint64_t* values) {
+    uint64_t h = _stackmap_hash(frames, depth);
+    size_t mask = sm->index_size - 1;
+    size_t pos = (size_t)h & mask;
+    while (sm->index[pos]) {
+        uint32_t idx = sm->index[pos] - 1;
+        struct stackmap_entry* e = &sm->entries[idx];
+        if (e->hash == h && e->depth == (uint32_t)depth
+            && memcmp(sm->frame_pool + e->offset, frames, sizeof(uint32_t) * depth) == 0) {
+            _stackmap_accumulate(sm, idx, values);
+            return idx;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    if (sm->entry_count == sm->entry_cap) {
+        sm->entry_cap = sm->entry_cap ? sm->entry_cap * 2 : 256;
+        sm->entries = (struct stackmap_entry*)prealloc(sm->entries, sizeof(struct stackmap_entry) * sm->entry_cap);
+        sm->values = (uint64_t*)prealloc(sm->values, sizeof(uint64_t) * sm->nvalues * sm->entry_cap);
+    }
+    if (sm->pool_used + (size_t)depth > sm->pool_cap) {
+        size_t cap = sm->pool_cap ? sm->pool_cap : 4096;
+        while (cap < sm->pool_used + (size_t)depth) cap *= 2;
+        sm->frame_pool = (uint32_t*)prealloc(sm->frame_pool, sizeof(uint32_t) * cap);
+        sm->pool_cap = cap;
+    }
+
+    uint32_t idx = (uint32_t)sm->entry_count++;
+    struct stackmap_entry* e = &sm->entries[idx];
+    e->hash = h;
+    memset(sm->values + (size_t)idx * sm->nvalues, 0, sizeof(uint64_t) * sm->nvalues);
+    _stackmap_accumulate(sm, idx, values);
+    e->offset = (uint32_t)sm->pool_used;
+    e->depth = (uint32_t)depth;
+    memcpy(sm->frame_pool + sm->pool_used, frames, sizeof(uint32_t) * depth);
+    sm->pool_used += (size_t)depth;
+    sm->index[pos] = idx + 1;
+
+    // 装载因子上限 1/2
+    if (sm->entry_count * 2 > sm->index_size) {
+        _stackmap_reindex(sm, sm->index_size * 2);
+    }
+    return idx;
+}
+
+void
+stackmap_dump(struct stackmap* sm, stackmap_observer observer_cb, void* ud) {
+    size_t i;
+    for (i = 0; i < sm->entry_count; i++) {
+        struct stackmap_entry* e = &sm->entries[i];
+        observer_cb(sm->frame_pool + e->offset, (int)e->depth, sm->values[i * sm->nvalues], ud);
+    }
+}
+
+void
+stackmap_dump_n(struct stackmap* sm, stackmap_observer_n observer_cb, void* ud) {
+    size_t i;
+    for (i = 0; i < sm->entry_count; i++) {
+        struct stackmap_entry* e = &sm->entries[i];
+        observer_cb(sm->frame_pool + e->offset, (int)e->depth, sm->values + i * sm->nvalues, ud);
+    }
+}
+
+size_t
+stackmap_size(struct stackmap* sm) {
+    return sm->entry_count;
+}
+
+int
+stackmap_nvalues(struct stackmap* sm) {
+    return sm->nvalues;
+}
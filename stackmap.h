@@ -0,0 +1,32 @@
+#ifndef _STACKMAP_H_
+#define _STACKMAP_H_
+
+#include <unistd.h>
+#include <stdint.h>
+
+/*
+调用栈去重表：一条栈是 root->leaf 顺序的 frame id（uint32）数组，
+按整数数组做哈希与比较，相同的栈只存一份并累加计数。
+frame id 到字符串的转换只在导出时进行。
+每条栈可以带多个计数（stackmap_create_n），按下标逐个累加。
+*/
+struct stackmap;
+
+struct stackmap* stackmap_create();
+struct stackmap* stackmap_create_n(int nvalues);
+void stackmap_free(struct stackmap* sm);
+
+// 累加 count 到 frames[0..depth) 对应的栈上，返回栈 id
+uint32_t stackmap_add(struct stackmap* sm, const uint32_t* frames, int depth, uint64_t count);
+// values 个数与 stackmap_create_n 的 nvalues 一致
+uint32_t stackmap_add_n(struct stackmap* sm, const uint32_t* frames, int depth, const uint64_t* values);
+
+typedef void(*stackmap_observer)(const uint32_t* frames, int depth, uint64_t count, void* ud);
+void stackmap_dump(struct stackmap* sm, stackmap_observer observer_cb, void* ud);
+typedef void(*stackmap_observer_n)(const uint32_t* frames, int depth, const uint64_t* values, void* ud);
+void stackmap_dump_n(struct stackmap* sm, stackmap_observer_n observer_cb, void* ud);
+
+size_t stackmap_size(struct stackmap* sm);
+int stackmap_nvalues(struct stackmap* sm);
+
+#endif
@@ -0,0 +1,87 @@
+// micro-benchmark: imap (modulo hash + chaining) vs pmap (fmix64 + linear probing)
+// build: make bench && ./bench_map [nkeys]
+#include "imap.h"
+#include "pmap.h"
+#include "profile.h"
+
+#define DEFAULT_BENCH_KEYS  1000000
+
+static inline uint64_t
+now_ns() {
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    return (uint64_t)ti.tv_sec * 1000000000ULL + (uint64_t)ti.tv_nsec;
+}
+
+static void
+report(const char* name, const char* op, size_t n, uint64_t ns) {
+    printf("%-5s %-12s %8.1f ns/op\n", name, op, (double)ns / (double)n);
+}
+
+// 用真实的 malloc 地址作为 key，与 alloc_map 的实际分布一致（16 字节对齐）
+static uint64_t*
+make_keys(size_t n, void*** out_blocks) {
+    uint64_t* keys = (uint64_t*)pmalloc(sizeof(uint64_t) * n);
+    void** blocks = (void**)pmalloc(sizeof(void*) * n);
+    size_t i;
+    for (i = 0; i < n; i++) {
+        blocks[i] = pmalloc(16 + (i % 8) * 16);
+        keys[i] = (uint64_t)(uintptr_t)blocks[i];
+    }
+    // shuffle so query/remove order differs from insert order
+    uint64_t s = 88172645463393265ULL;
+    for (i = n - 1; i > 0; i--) {
+        s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+        size_t j = (size_t)(s % (i + 1));
+        uint64_t t = keys[i]; keys[i] = keys[j]; keys[j] = t;
+    }
+    *out_blocks = blocks;
+    return keys;
+}
+
+#define BENCH_MAP(NAME, CREATE, SET, QUERY, REMOVE, FREE) do {                  \
+    uint64_t t0, sink = 0;                                                      \
+    size_t i;                                                                   \
+    void* m = CREATE();                                                         \
+    t0 = now_ns();                                                              \
+    for (i = 0; i < n; i++) SET(m, keys[i], (void*)(uintptr_t)(i + 1));         \
+    report(NAME, "insert", n, now_ns() - t0);                                   \
+    t0 = now_ns();                                                              \
+    for (i = 0; i < n; i++) sink += (uintptr_t)QUERY(m, keys[n - 1 - i]);       \
+    report(NAME, "query-hit", n, now_ns() - t0);                                \
+    t0 = now_ns();                                                              \
+    for (i = 0; i < n; i++) sink += (uintptr_t)QUERY(m, keys[i] + 8);           \
+    report(NAME, "query-miss", n, now_ns() - t0);                               \
+    t0 = now_ns();                                                              \
+    for (i = 0; i < n; i++) {                                                   \
+        sink += (uintptr_t)REMOVE(m, keys[i]);                                  \
+        SET(m, keys[i], (void*)(uintptr_t)(i + 1));                             \
+    }                                                                           \
+    report(NAME, "churn", n, now_ns() - t0);                                    \
+    t0 = now_ns();                                                              \
+    for (i = 0; i < n; i++) sink += (uintptr_t)REMOVE(m, keys[i]);              \
+    report(NAME, "remove", n, now_ns() - t0);                                   \
+    FREE(m);                                                                    \
+    if (sink == 0) printf("unexpected sink\n");                                 \
+} while (0)
+
+int
+main(int argc, char** argv) {
+    size_t n = DEFAULT_BENCH_KEYS;
+    if (argc > 1) {
+        long v = atol(argv[1]);
+        if (v > 0) n = (size_t)v;
+    }
+    void** blocks = NULL;
+    uint64_t* keys = make_keys(n, &blocks);
+    printf("live keys: %zu\n", n);
+
+    BENCH_MAP("imap", imap_create, imap_set, imap_query, imap_remove, imap_free);
+    BENCH_MAP("pmap", pmap_create, pmap_insert, pmap_query, pmap_remove, pmap_free);
+
+    size_t i;
+    for (i = 0; i < n; i++) pfree(blocks[i]);
+    pfree(blocks);
+    pfree(keys);
+    return 0;
+}
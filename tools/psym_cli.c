@@ -0,0 +1,124 @@
+// offline symbolizer for cpu-c-samples.raw: module!0xoffset stacks -> folded function stacks
+// build: make psym && ./psym [-m module=path]... cpu-c-samples.raw > cpu-c-samples.offline.txt
+#include "psym.h"
+#include "smap.h"
+#include "profile.h"
+
+static inline uint64_t
+now_ns() {
+    struct timespec ti;
+    clock_gettime(CLOCK_MONOTONIC, &ti);
+    return (uint64_t)ti.tv_sec * 1000000000ULL + (uint64_t)ti.tv_nsec;
+}
+
+static void
+usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-m module=path]... file.raw\n", prog);
+}
+
+static void
+write_cb(const char* key, void* value, void* ud) {
+    (void)ud;
+    printf("%s %llu\n", key, (unsigned long long)(uintptr_t)value);
+}
+
+// 一帧 "module!0xoffset" -> "module!function"（找不到符号时为 module+0xoffset），按原始 token 缓存
+static const char*
+symbolize_frame(struct psym* s, smap_t* frames, struct parena* arena, const char* tok) {
+    const char* name = (const char*)smap_get(frames, tok);
+    if (name) return name;
+    char buf[1024];
+    const char* bang = strrchr(tok, '!');
+    if (!bang) {
+        snprintf(buf, sizeof(buf), "%s", tok);
+    } else {
+        char module[512];
+        size_t mlen = (size_t)(bang - tok) < sizeof(module) - 1 ? (size_t)(bang - tok) : sizeof(module) - 1;
+        memcpy(module, tok, mlen);
+        module[mlen] = '\0';
+        uint64_t off = strtoull(bang + 1, NULL, 16);
+        const struct psym_frame* f = psym_lookup_module(s, module, off);
+        if (f->name) snprintf(buf, sizeof(buf), "%s!%s", module, f->name);
+        else snprintf(buf, sizeof(buf), "%s+0x%llx", module, (unsigned long long)off);
+    }
+    name = pastrdup(arena, buf);
+    smap_set(frames, tok, (void*)name);
+    return name;
+}
+
+int
+main(int argc, char** argv) {
+    struct psym* s = psym_create_offline();
+    const char* path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            char* eq = strchr(argv[++i], '=');
+            if (!eq) { usage(argv[0]); return 1; }
+            *eq = '\0';
+            psym_add_module(s, argv[i], eq + 1);
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) { usage(argv[0]); return 1; }
+    FILE* fp = fopen(path, "r");
+    if (!fp) { perror(path); return 1; }
+
+    uint64_t t0 = now_ns();
+    struct parena* arena = parena_create();
+    smap_t* stacks = smap_create(1 << 16, arena);
+    smap_t* frames = smap_create(1 << 14, arena);
+    size_t nsamples = 0;
+    size_t linecap = 1 << 16;
+    char* line = (char*)pmalloc(linecap);
+    char out[8192];
+    while (fgets(line, (int)linecap, fp)) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if (len == 0) continue;
+        if (line[0] == '#') {
+            // # module <name> <path>；命令行 -m 优先
+            char name[256], mpath[4096];
+            if (sscanf(line, "# module %255s %4095s", name, mpath) == 2) psym_add_module(s, name, mpath);
+            continue;
+        }
+        // 行尾可选的 " <count>"：profile 导出的栈已经聚合过
+        uint64_t count = 1;
+        char* sp = strrchr(line, ' ');
+        if (sp && sp[1]) {
+            char* endp = NULL;
+            unsigned long long c = strtoull(sp + 1, &endp, 10);
+            if (endp && *endp == '\0') {
+                count = c;
+                *sp = '\0';
+            }
+        }
+        size_t op = 0;
+        char* save = NULL;
+        for (char* tok = strtok_r(line, ";", &save); tok; tok = strtok_r(NULL, ";", &save)) {
+            const char* name = symbolize_frame(s, frames, arena, tok);
+            size_t n = strlen(name);
+            if (op + n + 2 >= sizeof(out)) break;
+            if (op > 0) out[op++] = ';';
+            memcpy(out + op, name, n);
+            op += n;
+        }
+        out[op] = '\0';
+        uintptr_t cnt = (uintptr_t)smap_get(stacks, out);
+        smap_set(stacks, out, (void*)(cnt + (uintptr_t)count));
+        nsamples += count;
+    }
+    fclose(fp);
+    smap_iterate(stacks, write_cb, NULL);
+    fprintf(stderr, "psym: %zu samples symbolized in %.1f ms\n", nsamples, (double)(now_ns() - t0) / 1e6);
+
+    pfree(line);
+    smap_free(stacks);
+    smap_free(frames);
+    parena_free(arena);
+    psym_free(s);
+    return 0;
+}